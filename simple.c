@@ -3,21 +3,86 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <errno.h>
+#include <limits.h>
 #include <string.h>
+#include <stdarg.h>
+#include <stdatomic.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <time.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <spawn.h>
+#include <sys/inotify.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <sys/wait.h>
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#endif
 
 #define TOKENS_CAPACITY_DEFAULT 256
-#define TOKENS_CAPACITY_GROW 128
 
-#define STR_CAPACITY_DEFAULT 64
-#define STR_CAPACITY_GROW 16
+#define STR_CAPACITY_DEFAULT 64 // first heap capacity of a string that outgrew its inline buffer
+#define STR_INLINE_MAX 22       // characters a string holds without allocating
 
 #define LEX_NODES_CAPACITY_DEFAULT 16
 #define LEX_NODES_CAPACITY_GROW 16
 
+#define IR_CAPACITY_DEFAULT 64
+
+#define INTERN_CAPACITY_DEFAULT 64
+
+#define CSE_CAPACITY_DEFAULT 64
+
+#define SYM_CAPACITY_DEFAULT 64
+
+#define TYPE_TABLE_PAGE 256
+#define TYPE_TABLE_PAGES 4096
+
+#define LITERAL_POOL_CAPACITY_DEFAULT 64
+#define LITERAL_POOL_DATA_DEFAULT 4096
+
+#define DIAGNOSTICS_CAPACITY_DEFAULT 16
+
+#define ARENA_CHUNK_DEFAULT (64*1024)
+
+#define SERVER_CACHE_CAPACITY_DEFAULT 64
+#define SERVER_CACHE_MAX 65536
+#define SERVER_PATH_MAX 4096
+#define SERVER_SOURCE_MAX (64*1024*1024)
+
+#define PRUNE_ENTRY_DEFAULT "main"
+
+#define INLINE_BUDGET_DEFAULT 64 // nodes inlining may add to a single fn
+#define INLINE_CALLEE_MAX 8      // nodes in the body of a fn that can be inlined
+#define INLINE_DEPTH_MAX 8
+
+#define EVAL_STACK_DEFAULT 256
+#define EVAL_DEPTH_MAX 1024
+#define EVAL_CHUNK 1024 // rows a batch kernel works on at a time
+#define EVAL_BENCH_ROWS_DEFAULT (1 << 20)
+#define EVAL_PROFILE_LINES 10 // hottest lines a profile shows
+
+#define NUM_BENCH_LITERALS_DEFAULT (1 << 20)
+#define NUM_BENCH_ROUNDS 9
+
+#define RA_BENCH_FNS_DEFAULT 1024
+#define RA_BENCH_STATEMENTS_DEFAULT 24 // assignments in every generated fn
+
+#define MODULE_CACHE_CAPACITY_DEFAULT 16
+#define MODULE_CACHE_DIR_DEFAULT ".spl-cache"
+#define MODULE_INTERFACE_MAGIC "spl-interface 1"
+#define MODULE_NAME_MAX 256
+
+#define WATCH_FORM_CHUNK 4096
+#define WATCH_COMPARE_BLOCK 4096
+
 #define ERR(msg,  ...) { printf(msg "%s\n", ##__VA_ARGS__, strerror(errno)); return errno; }
 #define TRY(expr, ...) { if (expr) ERR(__VA_ARGS__) }
 
-#define MALLOC(value) memcpy(malloc(sizeof(*(value))),value,sizeof(*(value)))
+#define MALLOC(value) memcpy(node_alloc(sizeof(*(value))),value,sizeof(*(value)))
 
 // TODO: Refactor into enums
 typedef enum {
@@ -47,6 +112,7 @@ typedef enum {
 
 typedef enum {
     LEX_ROOT = 1,
+    LEX_FORM,
     LEX_TYPE,
     LEX_BLOCK,
     LEX_EXPR,
@@ -63,7 +129,9 @@ typedef enum {
     NODE_NAME,
     NODE_NUMBER,
     NODE_BINOP,
-    NODE_UNOP
+    NODE_UNOP,
+    NODE_IMPORT,
+    NODE_CALL
 } node_kind;
 
 typedef enum {
@@ -80,26 +148,140 @@ static inline int isalpha(char c) {
     return (c >= 'A' && c <= 'Z') || (c >= 'a' && c <= 'z');
 }
 
+static inline bool isnamei(char c) {
+    return isalpha(c) || c == '_';
+}
+
+static inline bool isname(char c) {
+    return isnamei(c) || isnum(c);
+}
+
 static inline bool ishex(char c) {
-    return (c >= 'a' && c <= 'f') || (c >= 'A' && c <= 'F') || ishex(c) || isnum(c);
+    return (c >= 'a' && c <= 'f') || (c >= 'A' && c <= 'F') || isnum(c);
 }
 
 static inline unsigned char hexnum(char c) {
     if (c >= '0' && c <= '9')
         return c-'0';
     if (c >= 'A' && c <= 'F')
-        return c-'A';
+        return c-'A'+10;
     if (c >= 'a' && c <= 'f')
-        return c-'a';
+        return c-'a'+10;
     return 0;
 }
 
-static inline bool isnamei(char c) {
-    return isalpha(c) || c == '_';
+typedef enum {
+    NUM_OK = 0,
+    NUM_OVERFLOW,   // does not fit in 64 bits
+    NUM_MALFORMED,  // a prefix without digits, a misplaced `_` or a letter or digit that does not fit the base
+} num_status;
+
+// Value+1 of every character that is a digit in some base up to 16, 0 for the rest
+static const unsigned char num_digits[256] = {
+    ['0'] = 1, ['1'] = 2, ['2'] = 3, ['3'] = 4, ['4'] = 5,
+    ['5'] = 6, ['6'] = 7, ['7'] = 8, ['8'] = 9, ['9'] = 10,
+    ['a'] = 11, ['b'] = 12, ['c'] = 13, ['d'] = 14, ['e'] = 15, ['f'] = 16,
+    ['A'] = 11, ['B'] = 12, ['C'] = 13, ['D'] = 14, ['E'] = 15, ['F'] = 16,
+};
+
+// Value of `c` as a digit, at least 16 when it is none
+static inline unsigned num_digit(char c) {
+    return (unsigned)num_digits[(unsigned char)c]-1;
 }
 
-static inline bool isname(char c) {
-    return isnamei(c) || isnum(c);
+// Number of leading decimal digits in 8 bytes, first one in the lowest byte
+static inline unsigned num_swar_digits(uint64_t v) {
+    const uint64_t other = (
+        ((v & 0xf0f0f0f0f0f0f0f0ull) ^ 0x3030303030303030ull) |
+        (((v + 0x0606060606060606ull) & 0xf0f0f0f0f0f0f0f0ull) ^ 0x3030303030303030ull)
+    );
+    return other ? __builtin_ctzll(other)/8 : 8;
+}
+
+// Value of 8 decimal digits, pairs are combined into 2 digit values, those into 4 and those into 8
+static inline uint64_t num_swar_value(uint64_t v) {
+    v = ((v & 0x0f0f0f0f0f0f0f0full) * 2561) >> 8;
+    v = ((v & 0x00ff00ff00ff00ffull) * 6553601) >> 16;
+    return ((v & 0x0000ffff0000ffffull) * 42949672960001ull) >> 32;
+}
+
+// Value of the first `n` digits of 8, they are shifted to the top and the zero bytes below read as leading zeros
+static inline uint64_t num_swar_prefix(uint64_t v, unsigned n) {
+    return n ? num_swar_value(v << (64-8*n)) : 0;
+}
+
+// Parses the number literal at the start of `text`, which has `len` characters left and starts with a digit
+// Takes 0x, 0o and 0b prefixes and `_` between digits, sets `consumed` to the length of the whole literal
+// Decimal runs are converted 8 digits at a time, a literal that overflows is still consumed to its end
+// Most literals end within their first 8 bytes, those return right after one chunk without any per digit branch
+// Letters, digits and `_` right after the literal are consumed with it and make it malformed, `1__2` is not `1` and `__2`
+static num_status num_parse(const char* text, size_t len, size_t* consumed, unsigned long* value) {
+    unsigned base = 10;
+    size_t i = 0;
+    if (len >= 2 && text[0] == '0') {
+        const char p = text[1] | 0x20;
+        base = p == 'x' ? 16 : p == 'o' ? 8 : p == 'b' ? 2 : 10;
+        if (base != 10)
+            i = 2;
+    }
+
+    const size_t digits = i;
+    unsigned long v = 0;
+    bool overflow = false;
+    bool full = false; // the last chunk was all digits, so the run may go on
+    // 8 digits always fit, so the first chunk needs no overflow check
+    if (base == 10 && len >= 8) {
+        uint64_t chunk;
+        memcpy(&chunk, text, 8);
+        const unsigned n = num_swar_digits(chunk);
+        v = num_swar_prefix(chunk, n);
+        if (n != 0 && n < 8 && !isname(text[n])) {
+            *consumed = n;
+            *value = v;
+            return NUM_OK;
+        }
+        i = n;
+        full = n == 8;
+    }
+    while (full && i+8 <= len) {
+        static const unsigned long pow10[9] = {1, 10, 100, 1000, 10000, 100000, 1000000, 10000000, 100000000};
+        uint64_t chunk;
+        memcpy(&chunk, text+i, 8);
+        const unsigned n = num_swar_digits(chunk);
+        overflow |= __builtin_mul_overflow(v, pow10[n], &v);
+        overflow |= __builtin_add_overflow(v, num_swar_prefix(chunk, n), &v);
+        i += n;
+        full = n == 8;
+        if (!full && i < len && !isname(text[i])) {
+            *consumed = i;
+            *value = v;
+            return overflow ? NUM_OVERFLOW : NUM_OK;
+        }
+    }
+    while (i < len) {
+        // A separator only counts between two digits
+        if (text[i] == '_' && i > digits && i+1 < len && num_digit(text[i+1]) < base) {
+            i++;
+            continue;
+        }
+        const unsigned d = num_digit(text[i]);
+        if (d >= base)
+            break;
+        overflow |= __builtin_mul_overflow(v, base, &v);
+        overflow |= __builtin_add_overflow(v, d, &v);
+        i++;
+    }
+
+    const bool empty = i == digits;
+    const size_t end = i;
+    while (i < len && isname(text[i]))
+        i++;
+
+    *consumed = i;
+    *value = v;
+    if (empty || i != end)
+        return NUM_MALFORMED;
+    return overflow ? NUM_OVERFLOW : NUM_OK;
 }
 
 const char* token_kind_str(token_kind kind) {
@@ -138,7 +320,7 @@ typedef struct {
     size_t l;
     size_t c;
     token_kind k;
-    void* d;
+    void* d; // value of a number, NULL when it has none, the literal pool id itself for a string
 } Token;
 
 typedef struct {
@@ -147,19 +329,53 @@ typedef struct {
     size_t len;
 } Tokens;
 
+typedef struct {
+    size_t l;
+    size_t c;
+    uint64_t order; // breaks ties between diagnostics at the same position
+    char* message;
+} diagnostic;
+
+typedef struct {
+    diagnostic* items;
+    size_t len;
+    size_t cap;
+} diagnostics;
+
 typedef struct {
     Tokens* tokens;
     size_t i;
+    diagnostics* diags; // every syntax error when not NULL
+    size_t errors;
 } lex_state;
 
+// The top bit of heap.cap, which shares its last byte with small.size
+#define STR_HEAP ((size_t)1 << (sizeof(size_t)*8-1))
+
+_Static_assert(__BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__, "str_t expects the top byte of heap.cap to be its last one");
+
+// Strings of up to STR_INLINE_MAX characters live inline, longer ones on the heap
+// Always NUL terminated, a zeroed str_t is a valid empty string
 typedef struct {
-    char* str;
-    size_t cap;
-    size_t len;
+    union {
+        struct {
+            char* ptr;
+            size_t len;
+            size_t cap; // STR_HEAP | capacity
+        } heap;
+        struct {
+            char buf[STR_INLINE_MAX+1];
+            unsigned char size; // length, never has STR_HEAP's bit set
+        } small;
+    };
 } str_t;
 
+_Static_assert(sizeof(str_t) == 3*sizeof(size_t), "str_t should stay three words");
+
 typedef struct {
     const char* message;
+    size_t l; // of the token the parser stopped at
+    size_t c;
 } lex_error;
 
 typedef struct {
@@ -177,14 +393,21 @@ typedef struct {
     lex_nodes children;
 } lex_node_root;
 
+typedef uint32_t type_id;
+
 typedef struct {
     node_kind_type kind;
     void* data;
+    type_id id; // index in global_types, two types are the same iff their ids are
 } lex_node_type;
 
+// Slot of a declaration or name that was not resolved (yet)
+#define SYM_NONE ((uint32_t)-1)
+
 typedef struct {
     const char* name;
     lex_node_type type;
+    uint32_t slot;
 } lex_node_def;
 
 typedef struct {
@@ -196,8 +419,18 @@ typedef struct {
     lex_node_type type;
     lex_nodes params;
     lex_node_block body;
+    uint32_t slot;
+    size_t l;
+    size_t c;
 } lex_node_fn;
 
+typedef struct {
+    const char* name;
+    uint32_t slot; // binding the name refers to
+    size_t l;
+    size_t c;
+} lex_node_name;
+
 typedef struct {
     Token op;
     lex_node lhs;
@@ -212,8 +445,31 @@ typedef struct {
 typedef struct {
     const char* name;
     lex_node_type type;
+    uint32_t slot;
 } lex_node_fn_param;
 
+typedef struct {
+    lex_node_name callee; // resolved like any other name, to a fn
+    lex_nodes args;
+} lex_node_call;
+
+// Everything other files see of a module, keyed by a hash of its source
+typedef struct {
+    uint64_t hash;
+    lex_nodes decls; // NODE_FUNCTION without a body and NODE_DEF, shared by every importer
+} module_interface;
+
+typedef struct {
+    const char* path; // as written, relative to the directory of the importing file
+    size_t l;
+    size_t c;
+    const module_interface* module; // NULL until loaded, or when loading failed
+    const char* file;               // path it was loaded from, NULL until loaded
+    uint64_t hash;                  // of the source read from `file`, 0 when it could not be read
+    int error;                      // errno of a module that could not be read
+    const char* syntax_error;       // of a module that could not be parsed
+} lex_node_import;
+
 typedef struct {
     unsigned char status; // TODO: Mabe give this a better type
     union {
@@ -222,22 +478,14 @@ typedef struct {
     } result;
 } lex_result;
 
-lex_node_type lex_node_type_deref(lex_node_type* node) {
-    if (node->kind == NODE_TYPE_POINTER)
-        return *(lex_node_type*)(node->data);
-    return (lex_node_type){.kind=0};
-}
-
-lex_node_type lex_node_type_ref(lex_node_type* node) {
-    return (lex_node_type){.kind=NODE_TYPE_POINTER,.data=node};
-}
-
-static inline lex_result lex_result_error(const char* message) {
+static inline lex_result lex_result_error(const Token at, const char* message) {
     return (lex_result){
         .status = 0,
         .result = {
             .error = (lex_error){
                 .message = message,
+                .l = at.l,
+                .c = at.c,
             }
         },
     };
@@ -252,16 +500,83 @@ static inline lex_result lex_result_node(lex_node node) {
     };
 }
 
+typedef struct arena_chunk {
+    struct arena_chunk* next;
+    size_t cap;
+    size_t used;
+    _Alignas(16) char data[];
+} arena_chunk;
+
+// Bump allocator, everything it handed out goes away at once
+typedef struct {
+    arena_chunk* chunks; // newest, and largest, first
+    size_t used;         // bytes handed out since the last reset
+    size_t chunk;        // size of the first chunk, ARENA_CHUNK_DEFAULT when 0
+} arena;
+
+void* arena_alloc(arena* a, size_t size) {
+    size = (size+15) & ~(size_t)15;
+    arena_chunk* chunk = a->chunks;
+    if (!chunk || chunk->used+size > chunk->cap) {
+        size_t cap = chunk ? chunk->cap*2 : a->chunk ? a->chunk : ARENA_CHUNK_DEFAULT;
+        while (cap < size)
+            cap *= 2;
+        arena_chunk* next = (arena_chunk*)malloc(sizeof(arena_chunk)+cap);
+        next->next = chunk;
+        next->cap = cap;
+        next->used = 0;
+        a->chunks = chunk = next;
+    }
+    void* ptr = chunk->data+chunk->used;
+    chunk->used += size;
+    a->used += size;
+    return ptr;
+}
+
+// Releases everything but the largest chunk, which is kept for the next round
+void arena_reset(arena* a) {
+    if (!a->chunks)
+        return;
+    arena_chunk* chunk = a->chunks->next;
+    while (chunk) {
+        arena_chunk* next = chunk->next;
+        free(chunk);
+        chunk = next;
+    }
+    a->chunks->next = NULL;
+    a->chunks->used = 0;
+    a->used = 0;
+}
+
+void arena_free(arena* a) {
+    arena_reset(a);
+    free(a->chunks);
+    a->chunks = NULL;
+}
+
+// Arena the tokens and AST of the current thread are allocated from, the heap when NULL
+// It must not change while a tree allocated under the previous value is alive
+static _Thread_local arena* node_arena = NULL;
+
+static inline void* node_alloc(size_t size) {
+    return node_arena ? arena_alloc(node_arena, size) : malloc(size);
+}
+
+static inline void node_free(void* ptr) {
+    if (!node_arena)
+        free(ptr);
+}
+
 void lex_nodes_init(lex_nodes* nodes) {
     nodes->len = 0;
     nodes->cap = LEX_NODES_CAPACITY_DEFAULT;
-    nodes->nodes = (lex_node*)malloc(sizeof(lex_node)*nodes->cap);
+    nodes->nodes = (lex_node*)node_alloc(sizeof(lex_node)*nodes->cap);
 }
 
 void lex_nodes_grow(lex_nodes* nodes, const size_t new_capacity) {
-    lex_node* new_nodes = (lex_node*)malloc(sizeof(lex_node)*new_capacity);
+    lex_node* new_nodes = (lex_node*)node_alloc(sizeof(lex_node)*new_capacity);
     memcpy(new_nodes, nodes->nodes, sizeof(lex_node)*nodes->cap);
-    free(nodes->nodes);
+    node_free(nodes->nodes);
     nodes->nodes = new_nodes;
     nodes->cap = new_capacity;
 }
@@ -275,7 +590,7 @@ void lex_nodes_push(lex_nodes* nodes, lex_node node) {
 void lex_nodes_free(lex_nodes* nodes) {
     nodes->len = 0;
     nodes->cap = 0;
-    free(nodes->nodes);
+    node_free(nodes->nodes);
 }
 
 void tokens_init(Tokens* tokens) {
@@ -294,7 +609,7 @@ void tokens_grow(Tokens* tokens, const size_t new_capacity) {
 
 void tokens_push(Tokens* tokens, const Token token) {
     if (tokens->cap <= tokens->len)
-        tokens_grow(tokens, tokens->len+TOKENS_CAPACITY_GROW);
+        tokens_grow(tokens, tokens->cap ? tokens->cap*2 : TOKENS_CAPACITY_DEFAULT);
     tokens->tokens[tokens->len++] = token;
 }
 
@@ -313,112 +628,695 @@ void tokens_free(Tokens* tokens) {
     free(tokens->tokens);
 }
 
+static inline bool str_on_heap(const str_t* str) {
+    return str->heap.cap & STR_HEAP;
+}
+
+// The characters of a string, NUL terminated, valid until it grows or is freed
+static inline char* str_data(const str_t* str) {
+    return str_on_heap(str) ? str->heap.ptr : (char*)str->small.buf;
+}
+
+static inline size_t str_len(const str_t* str) {
+    return str_on_heap(str) ? str->heap.len : str->small.size;
+}
+
+// Bytes available for characters and the terminator
+static inline size_t str_cap(const str_t* str) {
+    return str_on_heap(str) ? str->heap.cap & ~STR_HEAP : STR_INLINE_MAX+1;
+}
+
+// Sets the length of a string that already has room for it and terminates it there
+static inline void str_set_len(str_t* str, size_t len) {
+    if (str_on_heap(str))
+        str->heap.len = len;
+    else
+        str->small.size = len;
+    str_data(str)[len] = 0;
+}
+
 // Creates a new empty string
 void str_init(str_t* str) {
-    str->len = 0;
-    str->cap = STR_CAPACITY_DEFAULT;
-    str->str = (char*)malloc(str->cap);
-    memset(str->str, 0, str->cap);
+    memset(str, 0, sizeof(str_t));
+}
+
+// Makes room for `len` more characters and the terminator, moving to the heap and doubling the capacity as needed
+static void str_reserve(str_t* str, size_t len) {
+    const size_t cur = str_len(str);
+    if (cur+len < str_cap(str))
+        return;
+    size_t cap = str_on_heap(str) ? str_cap(str) : STR_CAPACITY_DEFAULT;
+    while (cur+len >= cap)
+        cap *= 2;
+    if (str_on_heap(str))
+        str->heap.ptr = (char*)realloc(str->heap.ptr, cap);
+    else {
+        char* ptr = (char*)malloc(cap);
+        memcpy(ptr, str->small.buf, cur+1);
+        str->heap.ptr = ptr;
+        str->heap.len = cur;
+    }
+    str->heap.cap = cap | STR_HEAP;
+}
+
+// Appends lengthed data at the end of a string
+void str_append(str_t* str, const char* data, size_t len) {
+    str_reserve(str, len);
+    const size_t cur = str_len(str);
+    memcpy(str_data(str)+cur, data, len);
+    str_set_len(str, cur+len);
 }
 
 // Creates a new string from lengthed data
 void str_init_data(str_t *restrict str, const char *restrict data, const size_t len) {
-    str->len = len;
-    str->cap = ((len+1)/STR_CAPACITY_DEFAULT+1)*STR_CAPACITY_DEFAULT;
-    str->str = (char*)malloc(str->cap);
-    memset(str->str, 0, str->cap); // TODO: Only set last bytes
-    memcpy(str->str, data, len);
+    str_init(str);
+    str_append(str, data, len);
 }
 
 // Creates a string from a null-terminated string
 void str_init_cstr(str_t *restrict str, const char *restrict cstr) {
-    str->len = strlen(cstr);
-    str->cap = ((str->len+1)/STR_CAPACITY_DEFAULT+1)*STR_CAPACITY_DEFAULT;
-    str->str = (char*)malloc(str->cap);
-    memset(str->str, 0, str->cap); // TODO: Only set last bytes
-    memcpy(str->str, cstr, str->len);
+    str_init_data(str, cstr, strlen(cstr));
 }
 
-// Frees a previously allocated string
+// Frees a previously allocated string, leaving it empty
 void str_free(str_t* str) {
-    free(str->str);
-    str->str = NULL;
-    str->len = 0;
-    str->cap = 0;
+    if (str_on_heap(str))
+        free(str->heap.ptr);
+    str_init(str);
 }
 
 // Duplicates a string as a C string
 void str_dup_c(str_t *restrict str, char *restrict *restrict new_str) {
-    const size_t len = strlen(str->str);
+    const size_t len = strlen(str_data(str));
     char* cstr = malloc(len+1);
     cstr[len] = 0;
-    memcpy(cstr, str->str, len);
+    memcpy(cstr, str_data(str), len);
     *new_str = cstr;
 }
 
 // Duplicates a string's data
 void str_dup_data(str_t*restrict str, char*restrict*restrict data) {
-    const size_t len = str->len;
+    const size_t len = str_len(str);
     char* cstr = malloc(len+1);
     cstr[len] = 0;
-    memcpy(cstr, str->str, len);
+    memcpy(cstr, str_data(str), len);
     *data = cstr;
 }
 
-// Duplicates a string
+// Duplicates a string, a long one gets a heap buffer of exactly its length
 void str_dup(str_t* restrict str, str_t* restrict new_str) {
-    const size_t cap = str->cap;
-    new_str->cap = cap;
-    new_str->len = str->len;
-    new_str->str = (char*)malloc(cap);
-    memcpy(new_str->str, str->str, cap);
+    const size_t len = str_len(str);
+    if (len <= STR_INLINE_MAX) {
+        *new_str = *str;
+        return;
+    }
+    new_str->heap.ptr = (char*)malloc(len+1);
+    memcpy(new_str->heap.ptr, str->heap.ptr, len+1);
+    new_str->heap.len = len;
+    new_str->heap.cap = (len+1) | STR_HEAP;
+}
+
+// Hands the characters of a string over to the caller, who frees them, and leaves the string empty
+char* str_release(str_t* str) {
+    char* data = str->heap.ptr;
+    if (!str_on_heap(str)) {
+        data = (char*)malloc(str->small.size+1);
+        memcpy(data, str->small.buf, str->small.size+1);
+    }
+    str_init(str);
+    return data;
 }
 
 // Appends a single character at the end of a string
 void str_push(str_t* str, char c) {
-    if (str->len+1 >= str->cap) {
-        const size_t newlen = str->len+STR_CAPACITY_GROW;
-        char* new_str = (char*)malloc(newlen);
-        memset(new_str, 0, newlen); // TODO: Only set last bytes
-        memcpy(new_str, str->str, str->len);
-        str->cap = newlen;
-        free(str->str);
-        str->str = new_str;
-    }
-    str->str[str->len++] = c;
+    str_reserve(str, 1);
+    const size_t len = str_len(str);
+    str_data(str)[len] = c;
+    str_set_len(str, len+1);
+}
+
+// Appends formatted text at the end of a string
+__attribute__((format(printf, 2, 3)))
+void str_printf(str_t* str, const char* fmt, ...) {
+    va_list args;
+    va_start(args, fmt);
+    const int len = vsnprintf(NULL, 0, fmt, args);
+    va_end(args);
+    str_reserve(str, len);
+    const size_t cur = str_len(str);
+    va_start(args, fmt);
+    vsnprintf(str_data(str)+cur, len+1, fmt, args);
+    va_end(args);
+    str_set_len(str, cur+len);
 }
 
 char* strdup(const char* str) {
     const size_t l = strlen(str);
-    char* new = (char*)malloc(l);
+    char* new = (char*)malloc(l+1);
     memcpy(new, str, l);
     new[l] = 0;
     return new;
 }
 
+// FNV-1a over a buffer
+static inline uint64_t hash_bytes(const void* data, size_t len) {
+    const unsigned char* p = data;
+    uint64_t h = 0xcbf29ce484222325ull;
+    for (size_t i = 0; i < len; i++) {
+        h ^= p[i];
+        h *= 0x100000001b3ull;
+    }
+    return h;
+}
+
+// Combines a value into a hash, spreading every bit of it
+static inline uint64_t hash_mix(uint64_t h, uint64_t v) {
+    h ^= v + 0x9e3779b97f4a7c15ull + (h << 6) + (h >> 2);
+    h ^= h >> 31;
+    h *= 0xbf58476d1ce4e5b9ull;
+    h ^= h >> 29;
+    return h;
+}
+
+// Set of unique strings, each one gets a dense id that stays valid as long as the table lives
+typedef struct {
+    const char** strs;
+    uint32_t len;
+    uint32_t cap;
+    uint32_t* slots; // Open addressing, 0 is empty, otherwise id+1
+    uint32_t slots_cap;
+} intern_table;
+
+void intern_init(intern_table* table) {
+    table->len = 0;
+    table->cap = INTERN_CAPACITY_DEFAULT;
+    table->strs = (const char**)malloc(sizeof(const char*)*table->cap);
+    table->slots_cap = INTERN_CAPACITY_DEFAULT*2;
+    table->slots = (uint32_t*)calloc(table->slots_cap, sizeof(uint32_t));
+}
+
+void intern_free(intern_table* table) {
+    for (uint32_t i = 0; i < table->len; i++)
+        free((char*)table->strs[i]);
+    free(table->strs);
+    free(table->slots);
+    table->len = table->cap = table->slots_cap = 0;
+}
+
+static void intern_rehash(intern_table* table) {
+    free(table->slots);
+    table->slots_cap *= 2;
+    table->slots = (uint32_t*)calloc(table->slots_cap, sizeof(uint32_t));
+    for (uint32_t id = 0; id < table->len; id++) {
+        uint32_t s = hash_bytes(table->strs[id], strlen(table->strs[id])) & (table->slots_cap-1);
+        while (table->slots[s])
+            s = (s+1) & (table->slots_cap-1);
+        table->slots[s] = id+1;
+    }
+}
+
+// Returns the id of a string, adding a copy of it to the table if it is new
+uint32_t intern(intern_table* table, const char* str) {
+    const size_t len = strlen(str);
+    uint32_t s = hash_bytes(str, len) & (table->slots_cap-1);
+    while (table->slots[s]) {
+        const uint32_t id = table->slots[s]-1;
+        if (!strcmp(table->strs[id], str))
+            return id;
+        s = (s+1) & (table->slots_cap-1);
+    }
+
+    if (table->len >= table->cap) {
+        table->cap *= 2;
+        table->strs = (const char**)realloc(table->strs, sizeof(const char*)*table->cap);
+    }
+    char* copy = (char*)malloc(len+1);
+    memcpy(copy, str, len+1);
+    table->strs[table->len] = copy;
+    table->slots[s] = ++table->len;
+
+    // Keeps the load factor under one half
+    if (table->len*2 > table->slots_cap)
+        intern_rehash(table);
+    return table->len-1;
+}
+
+void diagnostics_init(diagnostics* diags) {
+    diags->len = 0;
+    diags->cap = DIAGNOSTICS_CAPACITY_DEFAULT;
+    diags->items = (diagnostic*)malloc(sizeof(diagnostic)*diags->cap);
+}
+
+void diagnostics_free(diagnostics* diags) {
+    for (size_t i = 0; i < diags->len; i++)
+        free(diags->items[i].message);
+    free(diags->items);
+    diags->len = 0;
+    diags->cap = 0;
+}
+
+__attribute__((format(printf, 5, 6)))
+void diagnostics_push(diagnostics* diags, size_t l, size_t c, uint64_t order, const char* fmt, ...) {
+    if (diags->cap <= diags->len) {
+        diags->cap = diags->cap ? diags->cap*2 : DIAGNOSTICS_CAPACITY_DEFAULT;
+        diags->items = (diagnostic*)realloc(diags->items, sizeof(diagnostic)*diags->cap);
+    }
+    va_list args;
+    va_start(args, fmt);
+    const int len = vsnprintf(NULL, 0, fmt, args);
+    va_end(args);
+    char* message = (char*)malloc(len+1);
+    va_start(args, fmt);
+    vsnprintf(message, len+1, fmt, args);
+    va_end(args);
+    diags->items[diags->len++] = (diagnostic){.l = l, .c = c, .order = order, .message = message};
+}
+
+// Moves every diagnostic of `from` to the end of `into`
+void diagnostics_append(diagnostics* into, diagnostics* from) {
+    for (size_t i = 0; i < from->len; i++) {
+        if (into->cap <= into->len) {
+            into->cap = into->cap ? into->cap*2 : DIAGNOSTICS_CAPACITY_DEFAULT;
+            into->items = (diagnostic*)realloc(into->items, sizeof(diagnostic)*into->cap);
+        }
+        into->items[into->len++] = from->items[i];
+    }
+    from->len = 0;
+}
+
+static int diagnostic_cmp(const void* a, const void* b) {
+    const diagnostic* x = a;
+    const diagnostic* y = b;
+    if (x->l != y->l)
+        return x->l < y->l ? -1 : 1;
+    if (x->c != y->c)
+        return x->c < y->c ? -1 : 1;
+    if (x->order != y->order)
+        return x->order < y->order ? -1 : 1;
+    return 0;
+}
+
+// Sorts by source position, the result does not depend on the order diagnostics were pushed in
+void diagnostics_sort(diagnostics* diags) {
+    qsort(diags->items, diags->len, sizeof(diagnostic), diagnostic_cmp);
+}
+
+typedef void (*pool_task)(void* ctx, size_t index, unsigned worker);
+
+// Indices a worker still has to run, it takes them from the front and thieves from the back
+typedef struct {
+    pthread_mutex_t lock;
+    size_t begin;
+    size_t end;
+    size_t tasks; // ran by this worker since the pool started
+    size_t steals;
+} pool_range;
+
+// Fixed set of threads running the iterations of one parallel loop at a time
+// Each worker starts with an equal slice of the loop and steals half of another one's when it runs dry
+typedef struct {
+    pthread_t* threads;
+    unsigned nthreads; // the thread calling pool_run is the extra worker
+    pthread_mutex_t lock;
+    pthread_cond_t wake;
+    pthread_cond_t done;
+    uint64_t generation;
+    unsigned busy;
+    bool stop;
+
+    pool_task task;
+    void* ctx;
+    pool_range* ranges; // one per worker
+} thread_pool;
+
+typedef struct {
+    thread_pool* pool;
+    unsigned id;
+} pool_worker_arg;
+
+static bool pool_pop(pool_range* range, size_t* index) {
+    pthread_mutex_lock(&range->lock);
+    const bool some = range->begin < range->end;
+    if (some)
+        *index = range->begin++;
+    pthread_mutex_unlock(&range->lock);
+    return some;
+}
+
+// Moves the back half of the first non-empty range after ours into ours
+static bool pool_steal(thread_pool* pool, unsigned worker) {
+    const unsigned workers = pool->nthreads+1;
+    for (unsigned k = 1; k < workers; k++) {
+        pool_range* victim = &pool->ranges[(worker+k)%workers];
+        pthread_mutex_lock(&victim->lock);
+        const size_t left = victim->end-victim->begin;
+        if (!left) {
+            pthread_mutex_unlock(&victim->lock);
+            continue;
+        }
+        const size_t end = victim->end;
+        victim->end -= (left+1)/2;
+        const size_t begin = victim->end;
+        pthread_mutex_unlock(&victim->lock);
+
+        pool_range* own = &pool->ranges[worker];
+        pthread_mutex_lock(&own->lock);
+        own->begin = begin;
+        own->end = end;
+        own->steals++;
+        pthread_mutex_unlock(&own->lock);
+        return true;
+    }
+    return false;
+}
+
+static void pool_work(thread_pool* pool, unsigned worker) {
+    size_t i;
+    for (;;) {
+        while (pool_pop(&pool->ranges[worker], &i)) {
+            pool->task(pool->ctx, i, worker);
+            pool->ranges[worker].tasks++;
+        }
+        // Tasks never add work, so once every range is empty the loop is over
+        if (!pool_steal(pool, worker))
+            break;
+    }
+}
+
+static void* pool_worker(void* arg) {
+    thread_pool* pool = ((pool_worker_arg*)arg)->pool;
+    const unsigned id = ((pool_worker_arg*)arg)->id;
+    free(arg);
+
+    uint64_t seen = 0;
+    for (;;) {
+        pthread_mutex_lock(&pool->lock);
+        while (pool->generation == seen && !pool->stop)
+            pthread_cond_wait(&pool->wake, &pool->lock);
+        if (pool->stop) {
+            pthread_mutex_unlock(&pool->lock);
+            return NULL;
+        }
+        seen = pool->generation;
+        pthread_mutex_unlock(&pool->lock);
+
+        pool_work(pool, id);
+
+        pthread_mutex_lock(&pool->lock);
+        if (--pool->busy == 0)
+            pthread_cond_signal(&pool->done);
+        pthread_mutex_unlock(&pool->lock);
+    }
+}
+
+// Sets up `workers` workers, the calling thread being one of them, 0 picks one per core
+void pool_init(thread_pool* pool, unsigned workers) {
+    memset(pool, 0, sizeof(thread_pool));
+    if (!workers) {
+        const long cores = sysconf(_SC_NPROCESSORS_ONLN);
+        workers = cores > 1 ? cores : 1;
+    }
+    const unsigned nthreads = workers-1;
+    pthread_mutex_init(&pool->lock, NULL);
+    pthread_cond_init(&pool->wake, NULL);
+    pthread_cond_init(&pool->done, NULL);
+    pool->threads = (pthread_t*)malloc(sizeof(pthread_t)*(nthreads+1));
+    pool->ranges = (pool_range*)calloc(nthreads+1, sizeof(pool_range));
+    for (unsigned i = 0; i < nthreads+1; i++)
+        pthread_mutex_init(&pool->ranges[i].lock, NULL);
+    for (unsigned i = 0; i < nthreads; i++) {
+        pool_worker_arg* arg = (pool_worker_arg*)malloc(sizeof(pool_worker_arg));
+        *arg = (pool_worker_arg){.pool = pool, .id = i};
+        if (pthread_create(&pool->threads[pool->nthreads], NULL, pool_worker, arg)) {
+            free(arg);
+            break;
+        }
+        pool->nthreads++;
+    }
+}
+
+void pool_free(thread_pool* pool) {
+    pthread_mutex_lock(&pool->lock);
+    pool->stop = true;
+    pthread_cond_broadcast(&pool->wake);
+    pthread_mutex_unlock(&pool->lock);
+    for (unsigned i = 0; i < pool->nthreads; i++)
+        pthread_join(pool->threads[i], NULL);
+    free(pool->threads);
+    for (unsigned i = 0; i < pool->nthreads+1; i++)
+        pthread_mutex_destroy(&pool->ranges[i].lock);
+    free(pool->ranges);
+    pthread_mutex_destroy(&pool->lock);
+    pthread_cond_destroy(&pool->wake);
+    pthread_cond_destroy(&pool->done);
+}
+
+// Number of distinct worker ids tasks can be called with
+static inline unsigned pool_workers(const thread_pool* pool) {
+    return pool->nthreads+1;
+}
+
+// Calls `task` for every index below `count` and waits for all of them to finish
+void pool_run(thread_pool* pool, size_t count, pool_task task, void* ctx) {
+    pthread_mutex_lock(&pool->lock);
+    pool->task = task;
+    pool->ctx = ctx;
+    const unsigned workers = pool->nthreads+1;
+    for (unsigned i = 0; i < workers; i++) {
+        pool->ranges[i].begin = count*i/workers;
+        pool->ranges[i].end = count*(i+1)/workers;
+    }
+    pool->busy = pool->nthreads;
+    pool->generation++;
+    pthread_cond_broadcast(&pool->wake);
+    pthread_mutex_unlock(&pool->lock);
+
+    pool_work(pool, pool->nthreads);
+
+    pthread_mutex_lock(&pool->lock);
+    while (pool->busy)
+        pthread_cond_wait(&pool->done, &pool->lock);
+    pthread_mutex_unlock(&pool->lock);
+}
+
+// Every distinct type exists once, pointer types are cached on their pointee
+typedef struct {
+    lex_node_type node; // canonical node, `data` points into the table
+    type_id ptr;        // pointer to this type, TYPE_NONE until first requested
+} type_entry;
+
+// Lookups of existing ids are lock-free, adding a type takes the lock
+typedef struct {
+    type_entry* pages[TYPE_TABLE_PAGES]; // entries never move so that canonical nodes can point to each other
+    _Atomic uint32_t len;
+    pthread_mutex_t lock;
+    intern_table names;
+    type_id* by_name; // named type of each interned name, TYPE_NONE if there is none yet
+    uint32_t by_name_cap;
+} type_table;
+
+#define TYPE_NONE ((type_id)-1)
+#define TYPE_UNIT ((type_id)0)
+
+type_table global_types;
+
+static inline type_entry* type_table_get(type_table* table, type_id id) {
+    return &table->pages[id/TYPE_TABLE_PAGE][id%TYPE_TABLE_PAGE];
+}
+
+// Must be called with the lock held
+static type_id type_table_add(type_table* table, lex_node_type node) {
+    const type_id id = table->len;
+    if (id/TYPE_TABLE_PAGE >= TYPE_TABLE_PAGES) {
+        fprintf(stderr, "Too many distinct types\n");
+        exit(1);
+    }
+    if (!table->pages[id/TYPE_TABLE_PAGE])
+        table->pages[id/TYPE_TABLE_PAGE] = (type_entry*)malloc(sizeof(type_entry)*TYPE_TABLE_PAGE);
+    node.id = id;
+    *type_table_get(table, id) = (type_entry){.node = node, .ptr = TYPE_NONE};
+    table->len = id+1;
+    return id;
+}
+
+void type_table_init(type_table* table) {
+    memset(table, 0, sizeof(type_table));
+    pthread_mutex_init(&table->lock, NULL);
+    intern_init(&table->names);
+    type_table_add(table, (lex_node_type){.kind = NODE_TYPE_UNIT, .data = NULL});
+}
+
+// Returns the type named `name`
+lex_node_type type_table_name(type_table* table, const char* name) {
+    pthread_mutex_lock(&table->lock);
+    const uint32_t n = intern(&table->names, name);
+    if (n >= table->by_name_cap) {
+        const uint32_t cap = table->names.cap;
+        table->by_name = (type_id*)realloc(table->by_name, sizeof(type_id)*cap);
+        memset(table->by_name+table->by_name_cap, 0xff, sizeof(type_id)*(cap-table->by_name_cap));
+        table->by_name_cap = cap;
+    }
+    if (table->by_name[n] == TYPE_NONE) {
+        const type_id id = type_table_add(table, (lex_node_type){
+            .kind = NODE_TYPE_NAME,
+            .data = (void*)table->names.strs[n],
+        });
+        table->by_name[n] = id;
+    }
+    const type_id id = table->by_name[n];
+    pthread_mutex_unlock(&table->lock);
+    return type_table_get(table, id)->node;
+}
+
+// Returns the type of pointers to `id`
+lex_node_type type_table_ptr(type_table* table, type_id id) {
+    pthread_mutex_lock(&table->lock);
+    type_id ptr = type_table_get(table, id)->ptr;
+    if (ptr == TYPE_NONE) {
+        ptr = type_table_add(table, (lex_node_type){
+            .kind = NODE_TYPE_POINTER,
+            .data = &type_table_get(table, id)->node,
+        });
+        type_table_get(table, id)->ptr = ptr;
+    }
+    pthread_mutex_unlock(&table->lock);
+    return type_table_get(table, ptr)->node;
+}
+
+lex_node_type lex_node_type_deref(lex_node_type* node) {
+    if (node->kind == NODE_TYPE_POINTER)
+        return *(lex_node_type*)(node->data);
+    return type_table_get(&global_types, TYPE_UNIT)->node;
+}
+
+lex_node_type lex_node_type_ref(lex_node_type* node) {
+    return type_table_ptr(&global_types, node->id);
+}
+
+static inline bool lex_node_type_eq(lex_node_type a, lex_node_type b) {
+    return a.id == b.id;
+}
+
+// Every distinct string literal, stored once and back to back so that a backend can emit the buffer as rodata
+typedef struct {
+    size_t offset; // in data
+    size_t len;    // without the NUL that follows every literal
+} literal_entry;
+
+// Shared by every thread, the buffer moves as it grows so reads take the lock as well
+typedef struct {
+    char* data;
+    size_t data_len;
+    size_t data_cap;
+    literal_entry* entries; // by id
+    uint32_t len;
+    uint32_t cap;
+    uint32_t* slots; // Open addressing, 0 is empty, otherwise id+1
+    uint32_t slots_cap;
+    _Atomic size_t refs; // literals added, repeats included
+    pthread_mutex_t lock;
+} literal_pool;
+
+literal_pool global_literals;
+
+void literal_pool_init(literal_pool* pool) {
+    memset(pool, 0, sizeof(literal_pool));
+    pthread_mutex_init(&pool->lock, NULL);
+    pool->data_cap = LITERAL_POOL_DATA_DEFAULT;
+    pool->data = (char*)malloc(pool->data_cap);
+    pool->cap = LITERAL_POOL_CAPACITY_DEFAULT;
+    pool->entries = (literal_entry*)malloc(sizeof(literal_entry)*pool->cap);
+    pool->slots_cap = LITERAL_POOL_CAPACITY_DEFAULT*2;
+    pool->slots = (uint32_t*)calloc(pool->slots_cap, sizeof(uint32_t));
+}
+
+static void literal_pool_rehash(literal_pool* pool) {
+    free(pool->slots);
+    pool->slots_cap *= 2;
+    pool->slots = (uint32_t*)calloc(pool->slots_cap, sizeof(uint32_t));
+    for (uint32_t id = 0; id < pool->len; id++) {
+        const literal_entry e = pool->entries[id];
+        uint32_t s = hash_bytes(pool->data+e.offset, e.len) & (pool->slots_cap-1);
+        while (pool->slots[s])
+            s = (s+1) & (pool->slots_cap-1);
+        pool->slots[s] = id+1;
+    }
+}
+
+// Returns the id of a decoded literal, which may contain NULs, adding it to the pool if it is new
+uint32_t literal_add(literal_pool* pool, const char* data, size_t len) {
+    const uint64_t hash = hash_bytes(data, len);
+    pool->refs++;
+    pthread_mutex_lock(&pool->lock);
+    uint32_t s = hash & (pool->slots_cap-1);
+    while (pool->slots[s]) {
+        const literal_entry e = pool->entries[pool->slots[s]-1];
+        if (e.len == len && !memcmp(pool->data+e.offset, data, len)) {
+            pthread_mutex_unlock(&pool->lock);
+            return pool->slots[s]-1;
+        }
+        s = (s+1) & (pool->slots_cap-1);
+    }
+
+    if (pool->data_len+len+1 > pool->data_cap) {
+        while (pool->data_len+len+1 > pool->data_cap)
+            pool->data_cap *= 2;
+        pool->data = (char*)realloc(pool->data, pool->data_cap);
+    }
+    if (pool->len >= pool->cap) {
+        pool->cap *= 2;
+        pool->entries = (literal_entry*)realloc(pool->entries, sizeof(literal_entry)*pool->cap);
+    }
+    const uint32_t id = pool->len++;
+    pool->entries[id] = (literal_entry){.offset = pool->data_len, .len = len};
+    memcpy(pool->data+pool->data_len, data, len);
+    pool->data[pool->data_len+len] = 0;
+    pool->data_len += len+1;
+    pool->slots[s] = id+1;
+    if (pool->len*2 > pool->slots_cap)
+        literal_pool_rehash(pool);
+    pthread_mutex_unlock(&pool->lock);
+    return id;
+}
+
+// Copies literal `id` out of the pool into node memory, NUL terminated
+char* literal_copy(literal_pool* pool, uint32_t id, size_t* len) {
+    pthread_mutex_lock(&pool->lock);
+    const literal_entry e = pool->entries[id];
+    char* copy = (char*)node_alloc(e.len+1);
+    memcpy(copy, pool->data+e.offset, e.len+1);
+    pthread_mutex_unlock(&pool->lock);
+    if (len)
+        *len = e.len;
+    return copy;
+}
+
 void tokenize(const char* text, Tokens* tokens) {
     size_t len = strlen(text);
 
     size_t tk_start = 0;
     size_t tk_esc = 0;
     token_kind tk_kind = 0;
+    size_t tk_row = 0; // where the token being read started
+    size_t tk_col = 0;
 
-    unsigned long tk_num;
     str_t tk_str;
 
     int in_comment = 0;
 
     size_t row = 0;
-    size_t col = 0;
+    size_t line_start = 0; // index of the first character of the current line
 
     for (size_t i = 0; i < len; i++) {
         const char c = text[i];
 
-        col++;
-        if (c == '\n') {
-            col = 0;
+        // Names go over their first and last character twice, a newline only counts the first time
+        if (c == '\n' && i >= line_start) {
             row++;
+            line_start = i+1;
         }
+        // Columns start at 1, the newline itself is at 0
+        const size_t col = i+1-line_start;
 
         if (in_comment) {
             if (i < len-1 && c == ';' && text[i+1] == ')') {
@@ -461,13 +1359,12 @@ void tokenize(const char* text, Tokens* tokens) {
                 if (c == '\\')
                     tk_esc = i;
                 else if (c == '"') {
-                    str_t* d = malloc(sizeof(str_t));
-                    str_dup(&tk_str, d);
+                    const uint32_t id = literal_add(&global_literals, str_data(&tk_str), str_len(&tk_str));
                     const size_t l = i-tk_start+1;
-                    char* t = (char*)malloc(l+1);
+                    char* t = (char*)node_alloc(l+1);
                     t[l] = 0;
                     memcpy(t, text+tk_start, l);
-                    tokens_push(tokens, (Token){.t=t,.c=col,.l=row,.k=tk_kind,.d=d});
+                    tokens_push(tokens, (Token){.t=t,.c=tk_col,.l=tk_row,.k=tk_kind,.d=(void*)(uintptr_t)id});
                     tk_kind = 0;
                     str_free(&tk_str);
                 }
@@ -477,49 +1374,13 @@ void tokenize(const char* text, Tokens* tokens) {
             continue;
         }
 
-        if (tk_kind == TK_NUMBER) {
-            int end_num = 0;
-            
-            if (tk_kind+1 < len  && text[tk_start] == '0' && text[tk_start+1] == 'x') {
-                if (i-tk_start < 2)
-                    continue;
-                if (ishex(c)) {
-                    tk_num <<= 4;
-                    tk_num |= hexnum(c);
-                } else
-                    end_num = 1;
-            }
-
-            else {
-                if (isnum(c)) {
-                    tk_num *= 10;
-                    tk_num |= hexnum(c);
-                } else
-                    end_num = 1;
-            }
-
-            if (end_num) {
-                size_t l = i-tk_start;
-                char* t = (char*)malloc(l+1);
-                t[l] = 0;
-                memcpy(t, text+tk_start, l);
-                unsigned long* d = (unsigned long*)malloc(sizeof(long));
-                *d = tk_num;
-                tokens_push(tokens, (Token){.t=t,.c=col,.l=row,.k=tk_kind,.d=d});
-                tk_kind = 0;
-                i--;
-            }
-
-            continue;
-        }
-
         if (tk_kind == TK_NAME) {
             if (!isname(c)) {
                 size_t l = i-tk_start;
-                char* t = (char*)malloc(l+1);
+                char* t = (char*)node_alloc(l+1);
                 t[l] = 0;
                 memmove(t, text+tk_start, l);
-                tokens_push(tokens, (Token){.t=t,.c=col,.l=row,.k=tk_kind,.d=NULL});
+                tokens_push(tokens, (Token){.t=t,.c=tk_col,.l=tk_row,.k=tk_kind,.d=NULL});
                 tk_kind = 0;
                 i--;
             }
@@ -531,20 +1392,34 @@ void tokenize(const char* text, Tokens* tokens) {
             tk_kind = TK_STRING;
             str_init(&tk_str);
             tk_start = i;
+            tk_row = row;
+            tk_col = col;
             continue;
         }
 
+        // Literals that overflow or are malformed get no value, the parser reports them
         if (isnum(c)) {
-            tk_kind = TK_NUMBER;
-            tk_num = 0;
-            tk_start = i;
-            i--;
+            size_t l;
+            unsigned long num;
+            const num_status status = num_parse(text+i, len-i, &l, &num);
+            char* t = (char*)node_alloc(l+1);
+            t[l] = 0;
+            memcpy(t, text+i, l);
+            unsigned long* d = NULL;
+            if (status == NUM_OK) {
+                d = (unsigned long*)node_alloc(sizeof(long));
+                *d = num;
+            }
+            tokens_push(tokens, (Token){.t=t,.c=col,.l=row,.k=TK_NUMBER,.d=d});
+            i += l-1;
             continue;
         }
 
         if (isnamei(c)) {
             tk_kind = TK_NAME;
             tk_start = i;
+            tk_row = row;
+            tk_col = col;
             i--;
             continue;
         }
@@ -582,7 +1457,7 @@ void tokenize(const char* text, Tokens* tokens) {
                     case DUB_CHR('<','='): if (!kind) kind = TK_LE;
                     case DUB_CHR('<','<'): if (!kind) kind = TK_SHL;
                     case DUB_CHR('>','>'): if (!kind) kind = TK_SHR;
-                        char* t = (char*)malloc(3);
+                        char* t = (char*)node_alloc(3);
                         t[0] = c;
                         t[1] = text[i+1];
                         t[2] = 0;
@@ -608,7 +1483,7 @@ void tokenize(const char* text, Tokens* tokens) {
                 case '!': if (!kind) kind = TK_NOT;
                 case '>': if (!kind) kind = TK_GT;
                 case '<': if (!kind) kind = TK_LT;
-                    char* t = (char*)malloc(2);
+                    char* t = (char*)node_alloc(2);
                     t[0] = c;
                     t[1] = 0;
                     tokens_push(tokens, (Token){.t=t,.c=col,.l=row,.k=kind,.d=NULL});
@@ -620,138 +1495,229 @@ void tokenize(const char* text, Tokens* tokens) {
     }
 }
 
+// Token `i`, or the last one when `i` is past the end so that errors at EOF still get a position
+static inline Token lex_token(const lex_state* st, size_t i) {
+    if (st->tokens->len == 0)
+        return (Token){0};
+    return st->tokens->tokens[i < st->tokens->len ? i : st->tokens->len-1];
+}
+
+// Whether token `i` opens a top-level form, a `(` at the start of a line followed by a keyword
+static bool lex_form_start(const lex_state* st, size_t i) {
+    const Token tk = st->tokens->tokens[i];
+    const Token kw = st->tokens->tokens[i+1];
+    return tk.k == TK_LPAREN && tk.c == 1 && kw.k == TK_NAME && (!strcmp(kw.t, "fn") || !strcmp(kw.t, "def") || !strcmp(kw.t, "import"));
+}
+
+// Where parsing resumes after the top-level form at `start` failed, past its matching `)`
+// A form missing its `)` ends at the next line that starts another one, stray tokens at the next `(`
+static size_t lex_resync(const lex_state* st, size_t start, bool* unclosed) {
+    size_t depth = 0;
+    *unclosed = false;
+    for (size_t i = start; i < st->tokens->len; i++) {
+        const token_kind k = st->tokens->tokens[i].k;
+        if (i > start && k == TK_LPAREN && (depth == 0 || lex_form_start(st, i))) {
+            *unclosed = depth > 0;
+            return i;
+        }
+        if (k == TK_LPAREN)
+            depth++;
+        else if (k == TK_RPAREN && depth > 0 && --depth == 0)
+            return i+1;
+    }
+    *unclosed = depth > 0;
+    return st->tokens->len;
+}
+
+// Operators that are only defined with exactly two operands
+static inline bool lex_binary_only(token_kind k) {
+    return (
+        k == TK_EQ || k == TK_NE ||
+        k == TK_GT || k == TK_GE ||
+        k == TK_LT || k == TK_LE ||
+        k == TK_SHL || k == TK_SHR
+    );
+}
+
 lex_result lex_util(lex_state* st, const lex_type state) {
+    // Every form that does not parse is reported and skipped, parsing resumes at the next top-level `(`
     if (state == LEX_ROOT) {
         lex_node_root root_node;
         lex_nodes_init(&root_node.children);
+        lex_result first = {0};
 
         while (st->i+1 < st->tokens->len) {
-            const Token tk = st->tokens->tokens[st->i];
-            
-            if (tk.k != TK_LPAREN || st->i+2 >= st->tokens->len) {
-                return lex_result_error("Expected an instruction");
+            const size_t start = st->i;
+            lex_result form = lex_util(st, LEX_FORM);
+            if (form.status) {
+                lex_nodes_push(&root_node.children, form.result.node);
+                continue;
             }
-            
-            switch (st->tokens->tokens[st->i+1].k) {
-                case TK_NAME: {
-                    const char* const n = st->tokens->tokens[++st->i].t;
-                    
-                    if (st->i+1 > st->tokens->len)
-                        return lex_result_error("Unexpected EOF");
-
-                    if (!strcmp(n, "fn")) {
-                        st->i++;
+            // A form missing its `)` fails wherever the forms after it stop making sense, the `(` is what to fix
+            bool unclosed;
+            st->i = lex_resync(st, start, &unclosed);
+            const Token last = lex_token(st, st->i-1);
+            const lex_error error = form.result.error;
+            if (unclosed && (error.l > last.l || (error.l == last.l && error.c >= last.c)))
+                form = lex_result_error(st->tokens->tokens[start], "Missing `)` to close this form");
+            if (st->errors++ == 0)
+                first = form;
+            if (st->diags)
+                diagnostics_push(st->diags, form.result.error.l, form.result.error.c, st->errors, "%s", form.result.error.message);
+        }
 
-                        lex_node_fn fn;
-                        lex_nodes_init(&fn.params);
+        if (st->errors)
+            return first;
+        return lex_result_node((lex_node){
+            .kind = NODE_ROOT,
+            .data = MALLOC(&root_node),
+        });
+    }
 
-                        // TODO: Probably extract parsing of type + name into a separate function or node kind
-                        lex_result type_result = lex_util(st, LEX_TYPE);
-                        if (!type_result.status)
-                            return type_result;
+    if (state == LEX_FORM) {
+        const Token tk = st->tokens->tokens[st->i];
+        
+        if (tk.k != TK_LPAREN || st->i+2 >= st->tokens->len) {
+            return lex_result_error(tk, "Expected an instruction");
+        }
+        
+        switch (st->tokens->tokens[st->i+1].k) {
+            case TK_NAME: {
+                const char* const n = st->tokens->tokens[++st->i].t;
+                
+                if (st->i+1 > st->tokens->len)
+                    return lex_result_error(lex_token(st, st->i), "Unexpected EOF");
 
-                        fn.type = *(lex_node_type*)type_result.result.node.data;
-                        free(type_result.result.node.data);
+                if (!strcmp(n, "fn")) {
+                    st->i++;
 
-                        const Token name_tk = st->tokens->tokens[st->i++];
-                        if (name_tk.k != TK_NAME)
-                            return lex_result_error("Name expected after 'fn' type");
-                        fn.name = name_tk.t;
+                    lex_node_fn fn = {.slot = SYM_NONE};
+                    lex_nodes_init(&fn.params);
 
-                        if (st->tokens->tokens[st->i++].k != TK_LPAREN)
-                            return lex_result_error("Argument list expected after 'fn' name");
+                    // TODO: Probably extract parsing of type + name into a separate function or node kind
+                    lex_result type_result = lex_util(st, LEX_TYPE);
+                    if (!type_result.status)
+                        return type_result;
 
-                        while (st->tokens->tokens[st->i].k != TK_RPAREN) {
-                            if (st->i+1 > st->tokens->len)
-                                return lex_result_error("Unexpected EOF");
+                    fn.type = *(lex_node_type*)type_result.result.node.data;
+                    node_free(type_result.result.node.data);
 
-                            lex_node_fn_param param;
+                    const Token name_tk = st->tokens->tokens[st->i++];
+                    if (name_tk.k != TK_NAME)
+                        return lex_result_error(name_tk, "Name expected after 'fn' type");
+                    fn.name = name_tk.t;
+                    fn.l = name_tk.l;
+                    fn.c = name_tk.c;
 
-                            lex_result ptype_result = lex_util(st, LEX_TYPE);
-                            if (!ptype_result.status)
-                                return ptype_result;
+                    if (st->tokens->tokens[st->i++].k != TK_LPAREN)
+                        return lex_result_error(lex_token(st, st->i-1), "Argument list expected after 'fn' name");
 
-                            param.type = *(lex_node_type*)ptype_result.result.node.data;
-                            free(ptype_result.result.node.data);
+                    while (st->tokens->tokens[st->i].k != TK_RPAREN) {
+                        if (st->i+1 > st->tokens->len)
+                            return lex_result_error(lex_token(st, st->i), "Unexpected EOF");
 
-                            const Token name_tk = st->tokens->tokens[st->i++];
-                            if (name_tk.k != TK_NAME)
-                                return lex_result_error("Name expected after 'fn' parameter type");
-                            param.name = name_tk.t;
+                        lex_node_fn_param param = {.slot = SYM_NONE};
 
-                            lex_nodes_push(&fn.params,(lex_node){
-                                .kind = NODE_FUNCTION_PARAM,
-                                .data = MALLOC(&param),
-                            });
-                        }
+                        lex_result ptype_result = lex_util(st, LEX_TYPE);
+                        if (!ptype_result.status)
+                            return ptype_result;
 
-                        st->i++;
+                        param.type = *(lex_node_type*)ptype_result.result.node.data;
+                        node_free(ptype_result.result.node.data);
 
-                        lex_result body_result = lex_util(st, LEX_BLOCK);
-                        if (!body_result.status)
-                            return body_result;
-                        fn.body = *(lex_node_block*)body_result.result.node.data;
-                        free(body_result.result.node.data);
+                        const Token name_tk = st->tokens->tokens[st->i++];
+                        if (name_tk.k != TK_NAME)
+                            return lex_result_error(name_tk, "Name expected after 'fn' parameter type");
+                        param.name = name_tk.t;
 
-                        st->i++;
-                        lex_nodes_push(&root_node.children,(lex_node){
-                            .kind = NODE_FUNCTION,
-                            .data = MALLOC(&fn),
+                        lex_nodes_push(&fn.params,(lex_node){
+                            .kind = NODE_FUNCTION_PARAM,
+                            .data = MALLOC(&param),
                         });
                     }
-                    
-                    else if (!strcmp(n, "def")) {
-                        st->i++;
 
-                        lex_node_def def;
+                    st->i++;
 
-                        lex_result type_result = lex_util(st, LEX_TYPE);
-                        if (!type_result.status)
-                            return type_result;
+                    lex_result body_result = lex_util(st, LEX_BLOCK);
+                    if (!body_result.status)
+                        return body_result;
+                    fn.body = *(lex_node_block*)body_result.result.node.data;
+                    node_free(body_result.result.node.data);
 
-                        def.type = *(lex_node_type*)type_result.result.node.data;
-                        free(type_result.result.node.data);
-                        
-                        const Token name_tk = st->tokens->tokens[st->i++];
-                        if (name_tk.k != TK_NAME)
-                            return lex_result_error("Name expected after 'def' type");
-                        def.name = name_tk.t;
+                    st->i++;
+                    return lex_result_node((lex_node){
+                        .kind = NODE_FUNCTION,
+                        .data = MALLOC(&fn),
+                    });
+                }
+                
+                else if (!strcmp(n, "def")) {
+                    st->i++;
 
-                        lex_nodes_push(&root_node.children,(lex_node){
-                            .kind = NODE_DEF,
-                            .data = MALLOC(&def),
-                        });
-                    } 
+                    lex_node_def def = {.slot = SYM_NONE};
+
+                    lex_result type_result = lex_util(st, LEX_TYPE);
+                    if (!type_result.status)
+                        return type_result;
+
+                    def.type = *(lex_node_type*)type_result.result.node.data;
+                    node_free(type_result.result.node.data);
                     
-                    else {
-                        return lex_result_error("Invalid keyword");
-                    }
-                } break;
+                    const Token name_tk = st->tokens->tokens[st->i++];
+                    if (name_tk.k != TK_NAME)
+                        return lex_result_error(name_tk, "Name expected after 'def' type");
+                    def.name = name_tk.t;
+
+                    if (st->i >= st->tokens->len || st->tokens->tokens[st->i++].k != TK_RPAREN)
+                        return lex_result_error(lex_token(st, st->i-1), "Expected `)` to close 'def'");
+
+                    return lex_result_node((lex_node){
+                        .kind = NODE_DEF,
+                        .data = MALLOC(&def),
+                    });
+                } 
                 
-                default: {
-                    return lex_result_error("Unexpected token");
-                } break;
-            }
+                else if (!strcmp(n, "import")) {
+                    st->i++;
+
+                    const Token path_tk = st->tokens->tokens[st->i++];
+                    if (path_tk.k != TK_STRING)
+                        return lex_result_error(path_tk, "Module path expected after 'import'");
+
+                    if (st->i >= st->tokens->len || st->tokens->tokens[st->i++].k != TK_RPAREN)
+                        return lex_result_error(lex_token(st, st->i-1), "Expected `)` to close 'import'");
+
+                    char* path = literal_copy(&global_literals, (uint32_t)(uintptr_t)path_tk.d, NULL);
+
+                    lex_node_import import = {.path = path, .l = tk.l, .c = tk.c};
+                    return lex_result_node((lex_node){
+                        .kind = NODE_IMPORT,
+                        .data = MALLOC(&import),
+                    });
+                }
+                
+                else {
+                    return lex_result_error(lex_token(st, st->i), "Invalid keyword");
+                }
+            } break;
+            
+            default: {
+                return lex_result_error(lex_token(st, st->i+1), "Unexpected token");
+            } break;
         }
 
-        return lex_result_node((lex_node){
-            .kind = NODE_ROOT,
-            .data = MALLOC(&root_node),
-        });
+        return lex_result_error(lex_token(st, st->i), "Invalid state");
     }
-    
+
     if (state == LEX_TYPE) {
-        lex_node_type type_node = {
-            .kind = NODE_TYPE_UNIT,
-            .data = NULL
-        };
+        lex_node_type type_node = type_table_get(&global_types, TYPE_UNIT)->node;
 
         if (st->i >= st->tokens->len || st->tokens->tokens[st->i++].k != TK_LPAREN)
-            return lex_result_error("Type expressions must start with a `(`");
+            return lex_result_error(lex_token(st, st->i-1), "Type expressions must start with a `(`");
 
         for (;;st->i++) {
             if (st->i >= st->tokens->len)
-                return lex_result_error("Unfinished type expression");
+                return lex_result_error(lex_token(st, st->i), "Unfinished type expression");
             
             const Token tk = st->tokens->tokens[st->i];
             
@@ -762,19 +1728,18 @@ lex_result lex_util(lex_state* st, const lex_type state) {
 
             if (tk.k == TK_NAME) {
                 if (type_node.kind != NODE_TYPE_UNIT)
-                    return lex_result_error("Unexpected identifier");
-                type_node.kind = NODE_TYPE_NAME;
-                type_node.data = strdup(tk.t);
+                    return lex_result_error(tk, "Unexpected identifier");
+                type_node = type_table_name(&global_types, tk.t);
             }
 
             else if (tk.k == TK_MUL) {
                 if (type_node.kind == NODE_TYPE_UNIT)
-                    return lex_result_error("Unexpected star");
-                type_node = lex_node_type_ref(MALLOC(&type_node));
+                    return lex_result_error(tk, "Unexpected star");
+                type_node = lex_node_type_ref(&type_node);
             }
 
             else {
-                return lex_result_error("Unexpected token");
+                return lex_result_error(tk, "Unexpected token");
             }
         }
 
@@ -790,7 +1755,7 @@ lex_result lex_util(lex_state* st, const lex_type state) {
 
         for (;;) {
             if (st->i >= st->tokens->len) {
-                return lex_result_error("Unexpected EOF");
+                return lex_result_error(lex_token(st, st->i), "Unexpected EOF");
             }
 
             const Token tk = st->tokens->tokens[st->i];
@@ -799,7 +1764,7 @@ lex_result lex_util(lex_state* st, const lex_type state) {
                 break;
             
             if (tk.k != TK_LPAREN || st->i+2 >= st->tokens->len) {
-                return lex_result_error("Expected an instruction");
+                return lex_result_error(tk, "Expected an instruction");
             }
             
             bool invalid = false;
@@ -808,27 +1773,27 @@ lex_result lex_util(lex_state* st, const lex_type state) {
                     const char* const n = st->tokens->tokens[++st->i].t;
                     
                     if (st->i+1 > st->tokens->len)
-                        return lex_result_error("Unexpected EOF");
+                        return lex_result_error(lex_token(st, st->i), "Unexpected EOF");
 
                     if (!strcmp(n, "def")) {
                         st->i++;
 
-                        lex_node_def def;
+                        lex_node_def def = {.slot = SYM_NONE};
 
                         lex_result type_result = lex_util(st, LEX_TYPE);
                         if (!type_result.status)
                             return type_result;
 
                         def.type = *(lex_node_type*)type_result.result.node.data;
-                        free(type_result.result.node.data);
+                        node_free(type_result.result.node.data);
                         
                         const Token name_tk = st->tokens->tokens[st->i++];
                         if (name_tk.k != TK_NAME)
-                            return lex_result_error("Name expected after 'def' type");
+                            return lex_result_error(name_tk, "Name expected after 'def' type");
                         def.name = name_tk.t;
 
                         if (st->tokens->tokens[st->i++].k != TK_RPAREN)
-                            return lex_result_error("Expected `)` to close 'def'");
+                            return lex_result_error(lex_token(st, st->i-1), "Expected `)` to close 'def'");
 
                         lex_nodes_push(&block_node.children,(lex_node){
                             .kind = NODE_DEF,
@@ -864,12 +1829,28 @@ lex_result lex_util(lex_state* st, const lex_type state) {
     if (state == LEX_EXPR) {
         const Token hook = st->tokens->tokens[st->i++];
 
-        if (hook.k == TK_NAME)
+        if (hook.k == TK_NAME) {
+            lex_node_name name = {
+                .name = hook.t,
+                .slot = SYM_NONE,
+                .l = hook.l,
+                .c = hook.c,
+            };
             return lex_result_node((lex_node){
                 .kind = NODE_NAME,
-                .data = strdup(hook.t)
+                .data = MALLOC(&name)
             });
+        }
         
+        // Parsed again to tell the two apart, only literals without a value get here
+        if (hook.k == TK_NUMBER && hook.d == NULL) {
+            size_t consumed;
+            unsigned long value;
+            if (num_parse(hook.t, strlen(hook.t), &consumed, &value) == NUM_OVERFLOW)
+                return lex_result_error(hook, "Number literal does not fit in 64 bits");
+            return lex_result_error(hook, "Number literal is malformed");
+        }
+
         if (hook.k == TK_NUMBER)
             return lex_result_node((lex_node){
                 .kind = NODE_NUMBER,
@@ -878,7 +1859,7 @@ lex_result lex_util(lex_state* st, const lex_type state) {
 
         if (hook.k == TK_LPAREN) {
             if (st->i+1 > st->tokens->len)
-                return lex_result_error("Unexpected EOF");
+                return lex_result_error(lex_token(st, st->i), "Unexpected EOF");
 
             const Token opr = st->tokens->tokens[st->i++];
 
@@ -887,14 +1868,23 @@ lex_result lex_util(lex_state* st, const lex_type state) {
                 opr.k == TK_MUL ||
                 opr.k == TK_SUB ||
                 opr.k == TK_DIV ||
-                opr.k == TK_SET
+                opr.k == TK_SET ||
+                opr.k == TK_EQ ||
+                opr.k == TK_NE ||
+                opr.k == TK_GT ||
+                opr.k == TK_GE ||
+                opr.k == TK_LT ||
+                opr.k == TK_LE ||
+                opr.k == TK_SHL ||
+                opr.k == TK_SHR ||
+                opr.k == TK_NOT
             ) {
                 lex_nodes args;
                 lex_nodes_init(&args);
 
                 for (;;) {
                     if (st->i+1 > st->tokens->len)
-                        return lex_result_error("Unexpected EOF");
+                        return lex_result_error(lex_token(st, st->i), "Unexpected EOF");
 
                     if (st->tokens->tokens[st->i].k == TK_RPAREN) {
                         st->i++;
@@ -908,7 +1898,38 @@ lex_result lex_util(lex_state* st, const lex_type state) {
                 }
 
                 if (args.len <= 0)
-                    return lex_result_error("Too few arguments");
+                    return lex_result_error(opr, "Too few arguments");
+
+                // Comparisons and shifts only take two operands, `!` only one
+                if (opr.k == TK_NOT && args.len > 1)
+                    return lex_result_error(opr, "Too many arguments");
+                if (opr.k != TK_NOT && args.len > 2)
+                    return lex_result_error(opr, "Too many arguments");
+                if (lex_binary_only(opr.k) && args.len < 2)
+                    return lex_result_error(opr, "Too few arguments");
+
+                if (opr.k == TK_NOT) {
+                    lex_node_unop node_unop = {
+                        .op = opr,
+                        .value = args.nodes[0],
+                    };
+                    return lex_result_node((lex_node){
+                        .kind = NODE_UNOP,
+                        .data = MALLOC(&node_unop)
+                    });
+                }
+
+                if (lex_binary_only(opr.k)) {
+                    lex_node_binop node_binop = {
+                        .op = opr,
+                        .lhs = args.nodes[0],
+                        .rhs = args.nodes[1],
+                    };
+                    return lex_result_node((lex_node){
+                        .kind = NODE_BINOP,
+                        .data = MALLOC(&node_binop)
+                    });
+                }
 
                 if (
                     opr.k == TK_ADD ||
@@ -918,10 +1939,10 @@ lex_result lex_util(lex_state* st, const lex_type state) {
                     opr.k == TK_SET
                 ) {
                     if (args.len > 2)
-                        return lex_result_error("Too many arguments");
+                        return lex_result_error(opr, "Too many arguments");
 
                     if (opr.k == TK_SET && args.len < 2)
-                        return lex_result_error("Too few arguments");
+                        return lex_result_error(opr, "Too few arguments");
                     
                     if (args.len == 1) {
                         lex_node_unop node_unop = {
@@ -947,171 +1968,5420 @@ lex_result lex_util(lex_state* st, const lex_type state) {
                     }
                 }
             }
+
+            if (opr.k == TK_NAME) {
+                lex_node_call call = {
+                    .callee = {
+                        .name = opr.t,
+                        .slot = SYM_NONE,
+                        .l = opr.l,
+                        .c = opr.c,
+                    },
+                };
+                lex_nodes_init(&call.args);
+
+                for (;;) {
+                    if (st->i+1 > st->tokens->len)
+                        return lex_result_error(lex_token(st, st->i), "Unexpected EOF");
+
+                    if (st->tokens->tokens[st->i].k == TK_RPAREN) {
+                        st->i++;
+                        break;
+                    }
+
+                    lex_result arg_result = lex_util(st, LEX_EXPR);
+                    if (!arg_result.status)
+                        return arg_result;
+                    lex_nodes_push(&call.args, arg_result.result.node);
+                }
+
+                return lex_result_node((lex_node){
+                    .kind = NODE_CALL,
+                    .data = MALLOC(&call)
+                });
+            }
         }
 
-        return lex_result_error("Unexpected token");
+        return lex_result_error(hook, "Unexpected token");
     }
 
-    return lex_result_error("Invalid state");
+    return lex_result_error(lex_token(st, st->i), "Invalid state");
 }
 
-lex_result lex(Tokens* tokens) {
+// Parses every top-level form, one with a syntax error is skipped and the rest still get parsed
+// Returns the first error if there was any, `diags` gets all of them when it is not NULL
+lex_result lex(Tokens* tokens, diagnostics* diags) {
+    // The parser peeks past the last token on truncated input, make that read tokens of no kind
+    // instead of whatever a previous source left in the buffer
+    if (tokens->len+2 > tokens->cap)
+        tokens_grow(tokens, tokens->len+2);
+    memset(tokens->tokens+tokens->len, 0, sizeof(Token)*2);
+
     lex_state st = {
         .i = 0,
         .tokens = tokens,
+        .diags = diags,
     };
     return lex_util(&st, LEX_ROOT);
 }
 
-const char* shift_args(int* argc, const char*** argv) {
-    return (*argc)--, *(*argv)++;
+// Frees an expression tree, returns how many nodes were released
+size_t lex_node_free(lex_node node) {
+    size_t count = 1;
+    if (node.kind == NODE_BINOP) {
+        lex_node_binop* data = node.data;
+        count += lex_node_free(data->lhs);
+        count += lex_node_free(data->rhs);
+    }
+    else if (node.kind == NODE_UNOP) {
+        lex_node_unop* data = node.data;
+        count += lex_node_free(data->value);
+    }
+    else if (node.kind == NODE_CALL) {
+        lex_node_call* data = node.data;
+        for (size_t i = 0; i < data->args.len; i++)
+            count += lex_node_free(data->args.nodes[i]);
+        lex_nodes_free(&data->args);
+    }
+    node_free(node.data);
+    return count;
 }
 
-void debug_ast_type(lex_node_type node) {
-    if (node.kind == NODE_TYPE_UNIT) {
-        printf("()");
-    }
-    else if (node.kind == NODE_TYPE_NAME) {
-        printf("%s", (const char*)node.data);
+// Bytes the parser allocated for an expression tree or a declaration, arrays included
+size_t lex_node_bytes(lex_node node) {
+    if (node.kind == NODE_BINOP) {
+        lex_node_binop* data = node.data;
+        return sizeof(lex_node_binop)+lex_node_bytes(data->lhs)+lex_node_bytes(data->rhs);
     }
-    else if (node.kind == NODE_TYPE_POINTER) {
-        debug_ast_type(*(lex_node_type*)node.data);
-        printf("*");
+    if (node.kind == NODE_UNOP)
+        return sizeof(lex_node_unop)+lex_node_bytes(((lex_node_unop*)node.data)->value);
+    if (node.kind == NODE_CALL) {
+        lex_node_call* data = node.data;
+        size_t bytes = sizeof(lex_node_call)+sizeof(lex_node)*data->args.cap;
+        for (size_t i = 0; i < data->args.len; i++)
+            bytes += lex_node_bytes(data->args.nodes[i]);
+        return bytes;
     }
-    else {
-        printf("\x1b[91m?\x1b[39m");
+    if (node.kind == NODE_NAME)
+        return sizeof(lex_node_name);
+    if (node.kind == NODE_NUMBER)
+        return sizeof(long);
+    if (node.kind == NODE_DEF)
+        return sizeof(lex_node_def);
+    if (node.kind == NODE_FUNCTION) {
+        lex_node_fn* fn = node.data;
+        size_t bytes = sizeof(lex_node_fn)+sizeof(lex_node)*(fn->params.cap+fn->body.children.cap);
+        bytes += sizeof(lex_node_fn_param)*fn->params.len;
+        for (size_t i = 0; i < fn->body.children.len; i++)
+            bytes += lex_node_bytes(fn->body.children.nodes[i]);
+        return bytes;
     }
+    return 0;
 }
 
-void debug_ast(lex_node node, int indent) {
-    if (node.kind == NODE_ROOT) {
-        lex_node_root* data = node.data;
-        printf("%*s\x1b[91;1mROOT\x1b[39;22m {\n", indent, "");
-        for (size_t i = 0; i < data->children.len; i++) {
-            debug_ast(data->children.nodes[i], indent+2);
-        }
-        printf("%*s}\n", indent, "");
+// Whether evaluating an expression can not have any effect besides producing its value
+// Operators that fail at run time for some operands, like `/` by 0, only count when a constant rules that out
+bool lex_node_pure(lex_node node) {
+    if (node.kind == NODE_NUMBER || node.kind == NODE_NAME)
+        return true;
+    if (node.kind == NODE_BINOP) {
+        lex_node_binop* data = node.data;
+        const long* rhs = data->rhs.kind == NODE_NUMBER ? data->rhs.data : NULL;
+        if (data->op.k == TK_SET)
+            return false;
+        if (data->op.k == TK_DIV && (rhs == NULL || *rhs == 0 || *rhs == -1))
+            return false;
+        if ((data->op.k == TK_SHL || data->op.k == TK_SHR) && (rhs == NULL || (unsigned long)*rhs >= 64))
+            return false;
+        return lex_node_pure(data->lhs) && lex_node_pure(data->rhs);
     }
-    else if (node.kind == NODE_DEF) {
-        lex_node_def* data = node.data;
-        printf("%*s\x1b[91;1mDEF\x1b[39;22m \x1b[94m", indent, "");
-        debug_ast_type(data->type);
-        printf(" \x1b[39m\x1b[95;1m%s\x1b[39;22m", data->name);
-        printf("\n");
+    if (node.kind == NODE_UNOP) {
+        lex_node_unop* data = node.data;
+        return data->op.k != TK_MUL && data->op.k != TK_DIV && lex_node_pure(data->value);
     }
-    else if (node.kind == NODE_TYPE) {
-        printf("%*s\x1b[91;1mTYPE\x1b[39;22m ", indent, "");
-        debug_ast_type(*(lex_node_type*)node.data);
-        printf("\n");
+    return false;
+}
+
+// Computes `a <op> b`, returns false when the result is undefined or the operator unknown
+bool eval_binop(token_kind op, long a, long b, long* result) {
+    const unsigned long ua = a, ub = b;
+    switch (op) {
+        case TK_ADD: *result = (long)(ua + ub); return true;
+        case TK_SUB: *result = (long)(ua - ub); return true;
+        case TK_MUL: *result = (long)(ua * ub); return true;
+        case TK_DIV:
+            if (b == 0 || (a == LONG_MIN && b == -1))
+                return false;
+            *result = a / b;
+            return true;
+        case TK_EQ: *result = a == b; return true;
+        case TK_NE: *result = a != b; return true;
+        case TK_GT: *result = a > b; return true;
+        case TK_GE: *result = a >= b; return true;
+        case TK_LT: *result = a < b; return true;
+        case TK_LE: *result = a <= b; return true;
+        case TK_SHL:
+            if (ub >= 64)
+                return false;
+            *result = (long)(ua << ub);
+            return true;
+        case TK_SHR:
+            if (ub >= 64)
+                return false;
+            *result = a >> b;
+            return true;
+        default:
+            return false;
     }
-    else if (node.kind == NODE_FUNCTION) {
-        lex_node_fn* data = node.data;
-        printf("%*s\x1b[91;1mFN\x1b[39;22m \x1b[94m", indent, "");
-        debug_ast_type(data->type);
-        printf("\x1b[39m \x1b[95;1m%s\x1b[39;22m {\n", data->name);
-        for (size_t i = 0; i < data->params.len; i++)
-            debug_ast(data->params.nodes[i], indent+2);
-        debug_ast((lex_node){.kind=NODE_BLOCK,.data=&data->body}, indent+2);
-        printf("%*s}\n", indent, "");
+}
+
+// Computes `<op> a`, returns false when the result is undefined or the operator unknown
+bool eval_unop(token_kind op, long a, long* result) {
+    switch (op) {
+        case TK_ADD: *result = a; return true;
+        case TK_SUB: *result = (long)(-(unsigned long)a); return true;
+        case TK_NOT: *result = !a; return true;
+        default:
+            return false;
     }
-    else if (node.kind == NODE_FUNCTION_PARAM) {
-        lex_node_fn_param* data = node.data;
-        printf("%*s\x1b[91;1mPARAM\x1b[39;22m \x1b[94m", indent, "");
-        debug_ast_type(data->type);
-        printf("\x1b[39m \x1b[95;1m%s\x1b[39;22m\n", data->name);
+}
+
+static inline bool fold_is_number(lex_node node, long value) {
+    return node.kind == NODE_NUMBER && *(long*)node.data == value;
+}
+
+// Folds an expression in place, bottom-up, adds the number of nodes that disappeared to `removed`
+void fold_node(lex_node* node, size_t* removed) {
+    if (node->kind == NODE_CALL) {
+        lex_node_call* data = node->data;
+        for (size_t i = 0; i < data->args.len; i++)
+            fold_node(&data->args.nodes[i], removed);
+        return;
     }
-    else if (node.kind == NODE_BLOCK) {
-        lex_node_root* data = node.data;
-        printf("%*s\x1b[91;1mBLOCK\x1b[39;22m {\n", indent, "");
-        for (size_t i = 0; i < data->children.len; i++) {
-            debug_ast(data->children.nodes[i], indent+2);
+
+    if (node->kind == NODE_UNOP) {
+        lex_node_unop* data = node->data;
+        fold_node(&data->value, removed);
+
+        long value;
+        if (data->value.kind == NODE_NUMBER && eval_unop(data->op.k, *(long*)data->value.data, &value)) {
+            // The number node is kept and takes the place of the operator
+            *(long*)data->value.data = value;
+            *node = data->value;
+            node_free(data);
+            *removed += 1;
         }
-        printf("%*s}\n", indent, "");
+        return;
     }
-    else if (node.kind == NODE_BINOP) {
-        lex_node_binop* data = node.data;
-        printf("%*s\x1b[91;1mBINOP\x1b[39;22m \x1b[96m%s\x1b[39m {\n", indent, "", data->op.t);
-        debug_ast(data->lhs, indent+2);
-        debug_ast(data->rhs, indent+2);
-        printf("%*s}\n", indent, "");
+
+    if (node->kind != NODE_BINOP)
+        return;
+
+    lex_node_binop* data = node->data;
+
+    // The target of an assignment is a place, not a value
+    if (data->op.k != TK_SET)
+        fold_node(&data->lhs, removed);
+    fold_node(&data->rhs, removed);
+
+    if (data->op.k == TK_SET)
+        return;
+
+    long value;
+    if (
+        data->lhs.kind == NODE_NUMBER &&
+        data->rhs.kind == NODE_NUMBER &&
+        eval_binop(data->op.k, *(long*)data->lhs.data, *(long*)data->rhs.data, &value)
+    ) {
+        *(long*)data->lhs.data = value;
+        *node = data->lhs;
+        node_free(data->rhs.data);
+        node_free(data);
+        *removed += 2;
+        return;
     }
-    else if (node.kind == NODE_NAME) {
-        printf("%*s\x1b[91;1mNAME\x1b[39;22m \x1b[95;1m%s\x1b[39;22m\n", indent, "", (const char*)node.data);
+
+    const token_kind op = data->op.k;
+    lex_node keep;
+    lex_node drop;
+
+    if ((op == TK_ADD || op == TK_SUB) && fold_is_number(data->rhs, 0))
+        keep = data->lhs, drop = data->rhs;
+    else if ((op == TK_MUL || op == TK_DIV) && fold_is_number(data->rhs, 1))
+        keep = data->lhs, drop = data->rhs;
+    else if (op == TK_ADD && fold_is_number(data->lhs, 0))
+        keep = data->rhs, drop = data->lhs;
+    else if (op == TK_MUL && fold_is_number(data->lhs, 1))
+        keep = data->rhs, drop = data->lhs;
+    else if (op == TK_MUL && fold_is_number(data->rhs, 0) && lex_node_pure(data->lhs))
+        keep = data->rhs, drop = data->lhs;
+    else if (op == TK_MUL && fold_is_number(data->lhs, 0) && lex_node_pure(data->rhs))
+        keep = data->lhs, drop = data->rhs;
+    else
+        return;
+
+    *node = keep;
+    *removed += lex_node_free(drop);
+    node_free(data);
+    *removed += 1;
+}
+
+void fold_block(lex_node_block* block, size_t* removed) {
+    for (size_t i = 0; i < block->children.len; i++)
+        fold_node(&block->children.nodes[i], removed);
+}
+
+// Folds constant expressions in every function of a program, returns how many nodes were removed
+size_t fold_ast(lex_node root) {
+    size_t removed = 0;
+    lex_node_root* data = root.data;
+    for (size_t i = 0; i < data->children.len; i++) {
+        const lex_node child = data->children.nodes[i];
+        if (child.kind == NODE_FUNCTION)
+            fold_block(&((lex_node_fn*)child.data)->body, &removed);
     }
-    else if (node.kind == NODE_NUMBER) {
-        printf("%*s\x1b[91;1mNUMBER\x1b[39;22m \x1b[93m%zi\x1b[39m\n", indent, "", *(long*)node.data);
+    return removed;
+}
+
+typedef struct {
+    unsigned char kind; // node_kind
+    unsigned char op;   // token_kind of a BINOP / UNOP
+    uint32_t a;         // lhs or operand id, interned name of a NAME
+    uint32_t b;         // rhs id, version of the name of a NAME
+    long value;         // value of a NUMBER
+    lex_node node;      // canonical node, duplicates end up pointing to its data
+} cse_entry;
+
+// Hash-consed expressions of a block, two nodes with the same id always compute the same value
+typedef struct {
+    intern_table* names;
+    uint32_t* versions; // bumped each time a name is assigned, indexed by name id
+    uint32_t versions_cap;
+
+    cse_entry* entries;
+    uint32_t len;
+    uint32_t cap;
+    uint32_t* slots; // Open addressing, 0 is empty, otherwise id+1
+    uint32_t slots_cap;
+
+    size_t removed;
+} cse_dag;
+
+void cse_init(cse_dag* dag, intern_table* names) {
+    memset(dag, 0, sizeof(cse_dag));
+    dag->names = names;
+    dag->cap = CSE_CAPACITY_DEFAULT;
+    dag->entries = (cse_entry*)malloc(sizeof(cse_entry)*dag->cap);
+    dag->slots_cap = CSE_CAPACITY_DEFAULT*2;
+    dag->slots = (uint32_t*)calloc(dag->slots_cap, sizeof(uint32_t));
+}
+
+void cse_free(cse_dag* dag) {
+    free(dag->versions);
+    free(dag->entries);
+    free(dag->slots);
+    memset(dag, 0, sizeof(cse_dag));
+}
+
+static inline uint64_t cse_hash(const cse_entry* e) {
+    uint64_t h = hash_mix(e->kind, e->op);
+    h = hash_mix(h, e->a);
+    h = hash_mix(h, e->b);
+    return hash_mix(h, (uint64_t)e->value);
+}
+
+static inline bool cse_equal(const cse_entry* x, const cse_entry* y) {
+    return x->kind == y->kind && x->op == y->op && x->a == y->a && x->b == y->b && x->value == y->value;
+}
+
+static uint32_t cse_add(cse_dag* dag, cse_entry entry) {
+    if (dag->len >= dag->cap) {
+        dag->cap *= 2;
+        dag->entries = (cse_entry*)realloc(dag->entries, sizeof(cse_entry)*dag->cap);
     }
-    else {
-        printf("%*s\x1b[90m(Invalid node kind %d)\x1b[39m\n", indent, "", node.kind);
+    dag->entries[dag->len] = entry;
+    return dag->len++;
+}
+
+static void cse_rehash(cse_dag* dag) {
+    free(dag->slots);
+    dag->slots_cap *= 2;
+    dag->slots = (uint32_t*)calloc(dag->slots_cap, sizeof(uint32_t));
+    for (uint32_t id = 0; id < dag->len; id++) {
+        const cse_entry* e = &dag->entries[id];
+        if (!e->kind)
+            continue;
+        uint32_t s = cse_hash(e) & (dag->slots_cap-1);
+        while (dag->slots[s])
+            s = (s+1) & (dag->slots_cap-1);
+        dag->slots[s] = id+1;
     }
 }
 
-int main(int argc, const char** argv) {
-    const char* program = shift_args(&argc, &argv);
-    
-    if (argc == 0) {
-        printf("Usage: %s <file.spl>\n", program);
-        return 1;
+// Returns the id of an expression, replacing the node by the canonical one when it was seen before
+static uint32_t cse_intern(cse_dag* dag, lex_node* node, cse_entry key) {
+    uint32_t s = cse_hash(&key) & (dag->slots_cap-1);
+    while (dag->slots[s]) {
+        const uint32_t id = dag->slots[s]-1;
+        const cse_entry* e = &dag->entries[id];
+        if (cse_equal(e, &key)) {
+            if (e->node.data != node->data) {
+                // Operands were already rewired to their canonical nodes, only the node itself goes away
+                node_free(node->data);
+                *node = e->node;
+                dag->removed++;
+            }
+            return id;
+        }
+        s = (s+1) & (dag->slots_cap-1);
     }
 
-    const char* source_path = shift_args(&argc, &argv);
-    
-    FILE* f = fopen(source_path, "rt");
-    if (f == NULL) {
-        printf("Could not open %s: %s\n", source_path, strerror(errno));
-        return 1;
+    key.node = *node;
+    const uint32_t id = cse_add(dag, key);
+    dag->slots[s] = id+1;
+    if (dag->len*2 > dag->slots_cap)
+        cse_rehash(dag);
+    return id;
+}
+
+static uint32_t cse_name(cse_dag* dag, const char* name) {
+    const uint32_t id = intern(dag->names, name);
+    if (id >= dag->versions_cap) {
+        const uint32_t cap = dag->names->cap;
+        dag->versions = (uint32_t*)realloc(dag->versions, sizeof(uint32_t)*cap);
+        memset(dag->versions+dag->versions_cap, 0, sizeof(uint32_t)*(cap-dag->versions_cap));
+        dag->versions_cap = cap;
     }
+    return id;
+}
 
-    TRY( fseek(f, 0, SEEK_END) );
-    size_t source_len = ftell(f);
-    if (!source_len) {
-        printf("An empty program was provided\n");
-        printf(
-            "Try a simple one:\n"
-            "\x1b[90m|\x1b[39m(\x1b[91mfn\x1b[39m \x1b[96mmain\x1b[39m()\n"
-            "\x1b[90m|\x1b[39m  (\x1b[96mprintf\x1b[39m \x1b[92m\"Hello, world!\x1b[1m\\n\x1b[22m\"\x1b[39m)\n"
-            "\x1b[90m|\x1b[39m  (\x1b[91mreturn\x1b[39m \x1b[35m0\x1b[39m)\n"
-            "\x1b[90m|\x1b[39m)\n"
-        );
-        return 0;
+// Hash-conses an expression bottom-up, returns its id in the DAG
+uint32_t cse_node(cse_dag* dag, lex_node* node) {
+    if (node->kind == NODE_NUMBER)
+        return cse_intern(dag, node, (cse_entry){.kind = NODE_NUMBER, .value = *(long*)node->data});
+
+    if (node->kind == NODE_NAME) {
+        const uint32_t name = cse_name(dag, ((lex_node_name*)node->data)->name);
+        return cse_intern(dag, node, (cse_entry){.kind = NODE_NAME, .a = name, .b = dag->versions[name]});
     }
-    TRY( fseek(f, 0, SEEK_SET) );
-    char* source = (char*)malloc(source_len);
-    TRY( !fread(source, source_len, 1, f), "Failed to read: " );
-    TRY( fclose(f), "Failed to close: " );
 
-    Tokens tokens;
-    tokens_init(&tokens);
-    tokenize(source, &tokens);
+    if (node->kind == NODE_BINOP) {
+        lex_node_binop* data = node->data;
 
-    printf("showing %zu tokens:\n", tokens.len);
-    for (size_t i = 0; i < tokens.len; i++) {
-        Token tk = tokens.tokens[i];
-        printf("  %02zu \x1b[92m%s\x1b[39m [%02x %s]\n", i, tk.t, tk.k, token_kind_str(tk.k));
-        if (tk.k == TK_STRING) {
-            str_t str = *(str_t*)tk.d;
-            for (size_t j = 0; j < str.len; j++) {
-                const char c = str.str[j];
-                printf("    %02zu %02x\n", j, c);
+        if (data->op.k == TK_SET) {
+            cse_node(dag, &data->rhs);
+            // Every expression reading the old value of the name keeps its old version and stops matching
+            if (data->lhs.kind == NODE_NAME) {
+                const uint32_t name = cse_name(dag, ((lex_node_name*)data->lhs.data)->name);
+                dag->versions[name]++;
             }
+            else
+                cse_node(dag, &data->lhs);
+            return cse_add(dag, (cse_entry){.kind = 0, .node = *node});
+        }
+
+        const uint32_t lhs = cse_node(dag, &data->lhs);
+        const uint32_t rhs = cse_node(dag, &data->rhs);
+        return cse_intern(dag, node, (cse_entry){.kind = NODE_BINOP, .op = data->op.k, .a = lhs, .b = rhs});
+    }
+
+    if (node->kind == NODE_UNOP) {
+        lex_node_unop* data = node->data;
+        const uint32_t value = cse_node(dag, &data->value);
+        return cse_intern(dag, node, (cse_entry){.kind = NODE_UNOP, .op = data->op.k, .a = value});
+    }
+
+    if (node->kind == NODE_CALL) {
+        lex_node_call* data = node->data;
+        for (size_t i = 0; i < data->args.len; i++)
+            cse_node(dag, &data->args.nodes[i]);
+        // The callee may assign any global, so nothing computed before the call is reused after it
+        for (uint32_t i = 0; i < dag->versions_cap; i++)
+            dag->versions[i]++;
+        return cse_add(dag, (cse_entry){.kind = 0, .node = *node});
+    }
+
+    // Anything else is opaque and never shared
+    return cse_add(dag, (cse_entry){.kind = 0, .node = *node});
+}
+
+// Turns the expressions of a block into a DAG, returns how many duplicate nodes were released
+// The block must not be folded again afterwards since subtrees are now shared
+size_t cse_block(lex_node_block* block, intern_table* names) {
+    cse_dag dag;
+    cse_init(&dag, names);
+    for (size_t i = 0; i < block->children.len; i++) {
+        lex_node* child = &block->children.nodes[i];
+        // A definition starts a new variable, nothing computed from the shadowed one applies to it
+        if (child->kind == NODE_DEF) {
+            const uint32_t name = cse_name(&dag, ((lex_node_def*)child->data)->name);
+            dag.versions[name]++;
+        }
+        else
+            cse_node(&dag, child);
+    }
+    const size_t removed = dag.removed;
+    cse_free(&dag);
+    return removed;
+}
+
+// Eliminates common subexpressions in every function of a program
+size_t cse_ast(lex_node root, intern_table* names) {
+    size_t removed = 0;
+    lex_node_root* data = root.data;
+    for (size_t i = 0; i < data->children.len; i++) {
+        const lex_node child = data->children.nodes[i];
+        if (child.kind == NODE_FUNCTION)
+            removed += cse_block(&((lex_node_fn*)child.data)->body, names);
+    }
+    return removed;
+}
+
+typedef enum {
+    SYM_FN = 1,
+    SYM_GLOBAL,
+    SYM_PARAM,
+    SYM_LOCAL,
+} sym_kind;
+
+typedef struct {
+    unsigned char kind; // sym_kind
+    const char* name;
+    void* decl;     // lex_node_fn, lex_node_def or lex_node_fn_param
+    uint32_t owner; // slot of the function a param or local belongs to, SYM_NONE for globals
+} sym_binding;
+
+// One level of the scope stack, maps interned names to binding slots
+typedef struct {
+    uint32_t* keys; // Open addressing, 0 is empty, otherwise name id+1
+    uint32_t* slots;
+    uint32_t len;
+    uint32_t cap;
+} sym_scope;
+
+typedef struct {
+    intern_table* names;
+
+    sym_binding* bindings; // indexed by slot
+    uint32_t len;
+    uint32_t cap;
+
+    sym_scope* scopes; // scopes[0] is the global scope
+    uint32_t depth;
+    uint32_t scopes_cap;
+
+    const lex_node_name** unresolved;
+    uint32_t unresolved_len;
+    uint32_t unresolved_cap;
+} sym_table;
+
+void sym_init(sym_table* table, intern_table* names) {
+    memset(table, 0, sizeof(sym_table));
+    table->names = names;
+    table->cap = SYM_CAPACITY_DEFAULT;
+    table->bindings = (sym_binding*)malloc(sizeof(sym_binding)*table->cap);
+}
+
+void sym_free(sym_table* table) {
+    for (uint32_t i = 0; i < table->scopes_cap; i++) {
+        free(table->scopes[i].keys);
+        free(table->scopes[i].slots);
+    }
+    free(table->scopes);
+    free(table->bindings);
+    free(table->unresolved);
+    memset(table, 0, sizeof(sym_table));
+}
+
+// Scopes keep their tables once popped so that the next function reuses them
+void sym_push_scope(sym_table* table) {
+    if (table->depth >= table->scopes_cap) {
+        const uint32_t cap = table->scopes_cap ? table->scopes_cap*2 : 4;
+        table->scopes = (sym_scope*)realloc(table->scopes, sizeof(sym_scope)*cap);
+        memset(table->scopes+table->scopes_cap, 0, sizeof(sym_scope)*(cap-table->scopes_cap));
+        table->scopes_cap = cap;
+    }
+    sym_scope* scope = &table->scopes[table->depth++];
+    if (!scope->cap) {
+        scope->cap = SYM_CAPACITY_DEFAULT;
+        scope->keys = (uint32_t*)calloc(scope->cap, sizeof(uint32_t));
+        scope->slots = (uint32_t*)malloc(sizeof(uint32_t)*scope->cap);
+    }
+}
+
+void sym_pop_scope(sym_table* table) {
+    sym_scope* scope = &table->scopes[--table->depth];
+    if (scope->len)
+        memset(scope->keys, 0, sizeof(uint32_t)*scope->cap);
+    scope->len = 0;
+}
+
+static void sym_scope_put(sym_scope* scope, uint32_t name, uint32_t slot) {
+    if ((scope->len+1)*2 > scope->cap) {
+        uint32_t* keys = scope->keys;
+        uint32_t* slots = scope->slots;
+        const uint32_t cap = scope->cap;
+        scope->cap *= 2;
+        scope->keys = (uint32_t*)calloc(scope->cap, sizeof(uint32_t));
+        scope->slots = (uint32_t*)malloc(sizeof(uint32_t)*scope->cap);
+        scope->len = 0;
+        for (uint32_t i = 0; i < cap; i++)
+            if (keys[i])
+                sym_scope_put(scope, keys[i]-1, slots[i]);
+        free(keys);
+        free(slots);
+    }
+    uint32_t s = hash_mix(0, name) & (scope->cap-1);
+    while (scope->keys[s] && scope->keys[s] != name+1)
+        s = (s+1) & (scope->cap-1);
+    if (!scope->keys[s])
+        scope->len++;
+    // A redeclaration in the same scope shadows the previous one
+    scope->keys[s] = name+1;
+    scope->slots[s] = slot;
+}
+
+static uint32_t sym_scope_get(const sym_scope* scope, uint32_t name) {
+    uint32_t s = hash_mix(0, name) & (scope->cap-1);
+    while (scope->keys[s]) {
+        if (scope->keys[s] == name+1)
+            return scope->slots[s];
+        s = (s+1) & (scope->cap-1);
+    }
+    return SYM_NONE;
+}
+
+// Adds a binding to the innermost scope, returns its slot
+uint32_t sym_declare(sym_table* table, sym_kind kind, const char* name, void* decl, uint32_t owner) {
+    if (table->len >= table->cap) {
+        table->cap *= 2;
+        table->bindings = (sym_binding*)realloc(table->bindings, sizeof(sym_binding)*table->cap);
+    }
+    const uint32_t slot = table->len++;
+    table->bindings[slot] = (sym_binding){
+        .kind = kind,
+        .name = name,
+        .decl = decl,
+        .owner = owner,
+    };
+    sym_scope_put(&table->scopes[table->depth-1], intern(table->names, name), slot);
+    return slot;
+}
+
+// Finds the slot a name refers to, from the innermost scope outwards
+uint32_t sym_lookup(sym_table* table, const char* name) {
+    const uint32_t id = intern(table->names, name);
+    for (uint32_t i = table->depth; i > 0; i--) {
+        const uint32_t slot = sym_scope_get(&table->scopes[i-1], id);
+        if (slot != SYM_NONE)
+            return slot;
+    }
+    return SYM_NONE;
+}
+
+static void resolve_expr(sym_table* table, lex_node node) {
+    if (node.kind == NODE_NAME) {
+        lex_node_name* name = node.data;
+        name->slot = sym_lookup(table, name->name);
+        if (name->slot == SYM_NONE) {
+            if (table->unresolved_len >= table->unresolved_cap) {
+                table->unresolved_cap = table->unresolved_cap ? table->unresolved_cap*2 : SYM_CAPACITY_DEFAULT;
+                table->unresolved = (const lex_node_name**)realloc(table->unresolved, sizeof(lex_node_name*)*table->unresolved_cap);
+            }
+            table->unresolved[table->unresolved_len++] = name;
+        }
+    }
+    else if (node.kind == NODE_BINOP) {
+        lex_node_binop* data = node.data;
+        resolve_expr(table, data->lhs);
+        resolve_expr(table, data->rhs);
+    }
+    else if (node.kind == NODE_UNOP) {
+        lex_node_unop* data = node.data;
+        resolve_expr(table, data->value);
+    }
+    else if (node.kind == NODE_CALL) {
+        lex_node_call* data = node.data;
+        resolve_expr(table, (lex_node){.kind = NODE_NAME, .data = &data->callee});
+        for (size_t i = 0; i < data->args.len; i++)
+            resolve_expr(table, data->args.nodes[i]);
+    }
+}
+
+void resolve_block(sym_table* table, lex_node_block* block, uint32_t owner) {
+    sym_push_scope(table);
+    for (size_t i = 0; i < block->children.len; i++) {
+        const lex_node child = block->children.nodes[i];
+        if (child.kind == NODE_DEF) {
+            lex_node_def* def = child.data;
+            // Declared after the fact so that a def can not see itself
+            def->slot = sym_declare(table, SYM_LOCAL, def->name, def, owner);
+        }
+        else
+            resolve_expr(table, child);
+    }
+    sym_pop_scope(table);
+}
+
+// Declares a top-level fn or def in the current scope
+void resolve_decl(sym_table* table, lex_node node) {
+    if (node.kind == NODE_FUNCTION) {
+        lex_node_fn* fn = node.data;
+        fn->slot = sym_declare(table, SYM_FN, fn->name, fn, SYM_NONE);
+    }
+    else if (node.kind == NODE_DEF) {
+        lex_node_def* def = node.data;
+        def->slot = sym_declare(table, SYM_GLOBAL, def->name, def, SYM_NONE);
+    }
+    else if (node.kind == NODE_IMPORT) {
+        // Interfaces are shared between files and threads, so their slots are never written
+        const module_interface* module = ((lex_node_import*)node.data)->module;
+        for (size_t i = 0; module && i < module->decls.len; i++) {
+            const lex_node decl = module->decls.nodes[i];
+            if (decl.kind == NODE_FUNCTION)
+                sym_declare(table, SYM_FN, ((lex_node_fn*)decl.data)->name, decl.data, SYM_NONE);
+            else
+                sym_declare(table, SYM_GLOBAL, ((lex_node_def*)decl.data)->name, decl.data, SYM_NONE);
+        }
+    }
+}
+
+// Binds the names of a fn whose declaration is already visible
+void resolve_fn(sym_table* table, lex_node_fn* fn) {
+    sym_push_scope(table);
+    for (size_t j = 0; j < fn->params.len; j++) {
+        lex_node_fn_param* param = fn->params.nodes[j].data;
+        param->slot = sym_declare(table, SYM_PARAM, param->name, param, fn->slot);
+    }
+    resolve_block(table, &fn->body, fn->slot);
+    sym_pop_scope(table);
+}
+
+// Binds every name of a program to its declaration, returns how many names could not be resolved
+// Top-level fns and defs are visible from anywhere in the file, locals only after their def
+size_t resolve_ast(sym_table* table, lex_node root) {
+    lex_node_root* data = root.data;
+
+    sym_push_scope(table);
+    for (size_t i = 0; i < data->children.len; i++)
+        resolve_decl(table, data->children.nodes[i]);
+
+    for (size_t i = 0; i < data->children.len; i++)
+        if (data->children.nodes[i].kind == NODE_FUNCTION)
+            resolve_fn(table, data->children.nodes[i].data);
+    sym_pop_scope(table);
+
+    return table->unresolved_len;
+}
+
+typedef struct {
+    size_t fns;   // top-level fns removed
+    size_t defs;  // top-level and local defs removed
+    size_t nodes;
+    size_t bytes;
+} prune_stats;
+
+typedef struct {
+    const sym_table* symbols;
+    bool* live;        // by binding slot
+    lex_node_fn** work; // reached fns whose bodies were not walked yet
+    size_t work_len;
+    size_t work_cap;
+} prune_state;
+
+static void prune_reach(prune_state* st, uint32_t slot) {
+    if (slot == SYM_NONE || st->live[slot])
+        return;
+    st->live[slot] = true;
+    if (st->symbols->bindings[slot].kind == SYM_FN) {
+        if (st->work_len >= st->work_cap) {
+            st->work_cap = st->work_cap ? st->work_cap*2 : LEX_NODES_CAPACITY_DEFAULT;
+            st->work = (lex_node_fn**)realloc(st->work, sizeof(lex_node_fn*)*st->work_cap);
+        }
+        st->work[st->work_len++] = st->symbols->bindings[slot].decl;
+    }
+}
+
+static void prune_mark(prune_state* st, lex_node node) {
+    if (node.kind == NODE_NAME)
+        prune_reach(st, ((lex_node_name*)node.data)->slot);
+    else if (node.kind == NODE_BINOP) {
+        lex_node_binop* data = node.data;
+        prune_mark(st, data->lhs);
+        prune_mark(st, data->rhs);
+    }
+    else if (node.kind == NODE_UNOP) {
+        prune_mark(st, ((lex_node_unop*)node.data)->value);
+    }
+    else if (node.kind == NODE_CALL) {
+        lex_node_call* data = node.data;
+        prune_reach(st, data->callee.slot);
+        for (size_t i = 0; i < data->args.len; i++)
+            prune_mark(st, data->args.nodes[i]);
+    }
+}
+
+// Releases a fn or def that nothing reaches
+static void prune_release(lex_node node, prune_stats* stats) {
+    stats->bytes += lex_node_bytes(node);
+    stats->nodes++;
+    if (node.kind == NODE_FUNCTION) {
+        lex_node_fn* fn = node.data;
+        for (size_t i = 0; i < fn->params.len; i++)
+            node_free(fn->params.nodes[i].data);
+        for (size_t i = 0; i < fn->body.children.len; i++)
+            stats->nodes += lex_node_free(fn->body.children.nodes[i]);
+        stats->nodes += fn->params.len;
+        lex_nodes_free(&fn->params);
+        lex_nodes_free(&fn->body.children);
+        stats->fns++;
+    }
+    else
+        stats->defs++;
+    node_free(node.data);
+}
+
+// Removes the fns and defs, top-level or local, that the fn named `entry` can not reach through names
+// Needs resolved names and must run before cse_ast, whose shared subtrees would be released twice
+// Returns false, leaving the tree alone, when there is no such fn
+bool prune_ast(lex_node root, const sym_table* symbols, const char* entry, prune_stats* stats) {
+    lex_node_root* data = root.data;
+    prune_state st = {
+        .symbols = symbols,
+        .live = (bool*)calloc(symbols->len+1, sizeof(bool)),
+    };
+
+    for (size_t i = 0; i < data->children.len; i++) {
+        const lex_node node = data->children.nodes[i];
+        lex_node_fn* fn = node.data;
+        if (node.kind == NODE_FUNCTION && !strcmp(fn->name, entry)) {
+            prune_reach(&st, fn->slot);
+            break;
+        }
+    }
+    if (!st.work_len) {
+        free(st.live);
+        return false;
+    }
+
+    while (st.work_len) {
+        const lex_node_fn* fn = st.work[--st.work_len];
+        for (size_t i = 0; i < fn->body.children.len; i++)
+            prune_mark(&st, fn->body.children.nodes[i]);
+    }
+
+    size_t kept = 0;
+    for (size_t i = 0; i < data->children.len; i++) {
+        const lex_node node = data->children.nodes[i];
+        uint32_t slot = SYM_NONE;
+        if (node.kind == NODE_FUNCTION)
+            slot = ((lex_node_fn*)node.data)->slot;
+        else if (node.kind == NODE_DEF)
+            slot = ((lex_node_def*)node.data)->slot;
+        if (slot != SYM_NONE && !st.live[slot]) {
+            prune_release(node, stats);
+            continue;
+        }
+        data->children.nodes[kept++] = node;
+
+        if (node.kind != NODE_FUNCTION)
+            continue;
+        lex_node_block* body = &((lex_node_fn*)node.data)->body;
+        size_t body_kept = 0;
+        for (size_t j = 0; j < body->children.len; j++) {
+            const lex_node child = body->children.nodes[j];
+            const uint32_t local = child.kind == NODE_DEF ? ((lex_node_def*)child.data)->slot : SYM_NONE;
+            if (local != SYM_NONE && !st.live[local])
+                prune_release(child, stats);
+            else
+                body->children.nodes[body_kept++] = child;
+        }
+        body->children.len = body_kept;
+    }
+    data->children.len = kept;
+
+    free(st.live);
+    free(st.work);
+    return true;
+}
+
+typedef struct {
+    size_t calls;     // call sites replaced by the body of their callee
+    long growth;      // nodes added by them, removed calls counted against it
+    size_t recursive; // calls left alone because their callee was being inlined already
+    size_t over;      // calls left alone because the budget of their caller was spent
+} inline_stats;
+
+typedef struct {
+    const sym_table* symbols;
+    const lex_node_fn* caller;
+    const lex_node_fn* stack[INLINE_DEPTH_MAX]; // callees whose bodies are being expanded
+    unsigned depth;
+    long budget; // nodes the caller may still grow by
+    inline_stats* stats;
+} inline_state;
+
+// Number of nodes in an expression tree
+static size_t inline_count(lex_node node) {
+    if (node.kind == NODE_BINOP)
+        return 1+inline_count(((lex_node_binop*)node.data)->lhs)+inline_count(((lex_node_binop*)node.data)->rhs);
+    if (node.kind == NODE_UNOP)
+        return 1+inline_count(((lex_node_unop*)node.data)->value);
+    if (node.kind == NODE_CALL) {
+        const lex_node_call* data = node.data;
+        size_t count = 1;
+        for (size_t i = 0; i < data->args.len; i++)
+            count += inline_count(data->args.nodes[i]);
+        return count;
+    }
+    return 1;
+}
+
+// Index of the parameter of `fn` a name refers to, -1 for any other name
+static long inline_param(const lex_node_fn* fn, const lex_node_name* name) {
+    for (size_t i = 0; name->slot != SYM_NONE && i < fn->params.len; i++)
+        if (((lex_node_fn_param*)fn->params.nodes[i].data)->slot == name->slot)
+            return i;
+    return -1;
+}
+
+// Whether an expression reads a variable, anything else keeps its value whatever the callee assigns
+static bool inline_reads_names(lex_node node) {
+    if (node.kind == NODE_NAME)
+        return true;
+    if (node.kind == NODE_BINOP)
+        return inline_reads_names(((lex_node_binop*)node.data)->lhs) || inline_reads_names(((lex_node_binop*)node.data)->rhs);
+    if (node.kind == NODE_UNOP)
+        return inline_reads_names(((lex_node_unop*)node.data)->value);
+    if (node.kind == NODE_CALL) {
+        const lex_node_call* data = node.data;
+        for (size_t i = 0; i < data->args.len; i++)
+            if (inline_reads_names(data->args.nodes[i]))
+                return true;
+    }
+    return false;
+}
+
+static bool inline_args_read_names(const lex_nodes* args) {
+    for (size_t i = 0; i < args->len; i++)
+        if (inline_reads_names(args->nodes[i]))
+            return true;
+    return false;
+}
+
+// Size of the body of `fn` once its parameters are replaced by `args`, -1 when it can not be inlined there:
+// it calls itself, assigns a parameter, or reads a global that the caller shadows and that CSE, which goes by
+// spelling, would confuse with the caller's variable
+// A body that assigns or calls may change a global an argument reads, arguments are then evaluated after the
+// change instead of before the call, so such a body only takes arguments that read no variable
+static long inline_size(const inline_state* st, const lex_node_fn* fn, lex_node node, const lex_nodes* args) {
+    if (node.kind == NODE_NAME) {
+        const lex_node_name* name = node.data;
+        const long param = inline_param(fn, name);
+        if (param >= 0)
+            return inline_count(args->nodes[param]);
+        const lex_node_fn* caller = st->caller;
+        for (size_t i = 0; i < caller->params.len; i++)
+            if (!strcmp(((lex_node_fn_param*)caller->params.nodes[i].data)->name, name->name))
+                return -1;
+        for (size_t i = 0; i < caller->body.children.len; i++) {
+            const lex_node child = caller->body.children.nodes[i];
+            if (child.kind == NODE_DEF && !strcmp(((lex_node_def*)child.data)->name, name->name))
+                return -1;
+        }
+        return 1;
+    }
+    if (node.kind == NODE_BINOP) {
+        const lex_node_binop* data = node.data;
+        if (data->op.k == TK_SET && data->lhs.kind == NODE_NAME && inline_param(fn, data->lhs.data) >= 0)
+            return -1;
+        if (data->op.k == TK_SET && inline_args_read_names(args))
+            return -1;
+        const long lhs = inline_size(st, fn, data->lhs, args);
+        const long rhs = inline_size(st, fn, data->rhs, args);
+        return lhs < 0 || rhs < 0 ? -1 : 1+lhs+rhs;
+    }
+    if (node.kind == NODE_UNOP) {
+        const long value = inline_size(st, fn, ((lex_node_unop*)node.data)->value, args);
+        return value < 0 ? -1 : 1+value;
+    }
+    if (node.kind == NODE_CALL) {
+        const lex_node_call* data = node.data;
+        // A fn calling itself would only get unrolled once
+        if (data->callee.slot == fn->slot)
+            return -1;
+        if (inline_args_read_names(args))
+            return -1;
+        long size = 1;
+        for (size_t i = 0; i < data->args.len; i++) {
+            const long arg = inline_size(st, fn, data->args.nodes[i], args);
+            if (arg < 0)
+                return -1;
+            size += arg;
+        }
+        return size;
+    }
+    return 1;
+}
+
+// Copies an expression, parameters of `fn` are replaced by copies of `args` when it is not NULL
+static lex_node inline_clone(const lex_node_fn* fn, lex_node node, const lex_nodes* args) {
+    if (node.kind == NODE_NAME) {
+        const long param = fn ? inline_param(fn, node.data) : -1;
+        if (param >= 0)
+            return inline_clone(NULL, args->nodes[param], NULL);
+        return (lex_node){.kind = NODE_NAME, .data = MALLOC((lex_node_name*)node.data)};
+    }
+    if (node.kind == NODE_NUMBER)
+        return (lex_node){.kind = NODE_NUMBER, .data = MALLOC((long*)node.data)};
+    if (node.kind == NODE_BINOP) {
+        lex_node_binop data = *(lex_node_binop*)node.data;
+        data.lhs = inline_clone(fn, data.lhs, args);
+        data.rhs = inline_clone(fn, data.rhs, args);
+        return (lex_node){.kind = NODE_BINOP, .data = MALLOC(&data)};
+    }
+    if (node.kind == NODE_UNOP) {
+        lex_node_unop data = *(lex_node_unop*)node.data;
+        data.value = inline_clone(fn, data.value, args);
+        return (lex_node){.kind = NODE_UNOP, .data = MALLOC(&data)};
+    }
+    const lex_node_call* call = node.data;
+    lex_node_call data = {.callee = call->callee};
+    lex_nodes_init(&data.args);
+    for (size_t i = 0; i < call->args.len; i++)
+        lex_nodes_push(&data.args, inline_clone(fn, call->args.nodes[i], args));
+    return (lex_node){.kind = NODE_CALL, .data = MALLOC(&data)};
+}
+
+static void inline_expr(inline_state* st, lex_node* node) {
+    if (node->kind == NODE_BINOP) {
+        lex_node_binop* data = node->data;
+        inline_expr(st, &data->lhs);
+        inline_expr(st, &data->rhs);
+        return;
+    }
+    if (node->kind == NODE_UNOP) {
+        inline_expr(st, &((lex_node_unop*)node->data)->value);
+        return;
+    }
+    if (node->kind != NODE_CALL)
+        return;
+
+    lex_node_call* call = node->data;
+    for (size_t i = 0; i < call->args.len; i++)
+        inline_expr(st, &call->args.nodes[i]);
+
+    const uint32_t slot = call->callee.slot;
+    if (slot == SYM_NONE || st->symbols->bindings[slot].kind != SYM_FN)
+        return;
+    const lex_node_fn* fn = st->symbols->bindings[slot].decl;
+
+    // Only bodies made of a single small expression are candidates, imported fns have none
+    if (fn->params.len != call->args.len || fn->body.children.len != 1)
+        return;
+    const lex_node body = fn->body.children.nodes[0];
+    if (body.kind == NODE_DEF || inline_count(body) > INLINE_CALLEE_MAX)
+        return;
+
+    // Arguments may be evaluated any number of times, and in another order, once substituted
+    for (size_t i = 0; i < call->args.len; i++)
+        if (!lex_node_pure(call->args.nodes[i]))
+            return;
+
+    bool recursive = fn == st->caller || st->depth >= INLINE_DEPTH_MAX;
+    for (unsigned i = 0; i < st->depth; i++)
+        recursive |= st->stack[i] == fn;
+    if (recursive) {
+        st->stats->recursive++;
+        return;
+    }
+
+    const long size = inline_size(st, fn, body, &call->args);
+    if (size < 0)
+        return;
+    const long growth = size-(long)inline_count(*node);
+    if (growth > st->budget) {
+        st->stats->over++;
+        return;
+    }
+
+    const lex_node inlined = inline_clone(fn, body, &call->args);
+    lex_node_free(*node);
+    *node = inlined;
+    st->budget -= growth;
+    st->stats->calls++;
+    st->stats->growth += growth;
+
+    // Calls the body itself makes are expanded in turn, with the callee on the stack
+    st->stack[st->depth++] = fn;
+    inline_expr(st, node);
+    st->depth--;
+}
+
+// Replaces calls to fns whose body is a single small expression by that expression
+// Each fn may grow by at most `budget` nodes, 0 disables inlining
+// Needs resolved and checked names and must run before cse_ast, the inlined copies are not checked again
+void inline_ast(lex_node root, const sym_table* symbols, size_t budget, inline_stats* stats) {
+    lex_node_root* data = root.data;
+    for (size_t i = 0; budget && i < data->children.len; i++) {
+        if (data->children.nodes[i].kind != NODE_FUNCTION)
+            continue;
+        lex_node_fn* fn = data->children.nodes[i].data;
+        inline_state st = {
+            .symbols = symbols,
+            .caller = fn,
+            .budget = budget,
+            .stats = stats,
+        };
+        for (size_t j = 0; j < fn->body.children.len; j++)
+            inline_expr(&st, &fn->body.children.nodes[j]);
+    }
+}
+
+// Type of an integer literal, it takes the type of whatever number it is combined with
+#define TYPE_LITERAL ((type_id)-2)
+
+typedef struct {
+    const sym_table* symbols;
+    type_id* slot_types; // declared type of every binding, return type of fns
+    type_id int_type;
+    lex_node_fn** fns;
+    uint32_t* fn_order; // position of each fn among the root children
+    size_t fns_len;
+    diagnostics* worker_diags; // one list per pool worker, merged once every fn is checked
+} check_ctx;
+
+typedef struct {
+    check_ctx* ctx;
+    diagnostics* diags;
+    uint64_t order; // fn position in the high bits, diagnostic counter in the low ones
+} check_state;
+
+// Writes the spelling of a type
+void type_str(type_id id, char* buf, size_t size) {
+    if (id == TYPE_LITERAL) {
+        snprintf(buf, size, "int");
+        return;
+    }
+    const lex_node_type node = type_table_get(&global_types, id)->node;
+    if (node.kind == NODE_TYPE_NAME)
+        snprintf(buf, size, "%s", (const char*)node.data);
+    else if (node.kind == NODE_TYPE_POINTER) {
+        type_str(((lex_node_type*)node.data)->id, buf, size);
+        const size_t len = strlen(buf);
+        if (len+1 < size) {
+            buf[len] = '*';
+            buf[len+1] = 0;
+        }
+    }
+    else
+        snprintf(buf, size, "()");
+}
+
+static inline node_kind_type check_kind(type_id id) {
+    if (id == TYPE_LITERAL)
+        return NODE_TYPE_NAME;
+    return type_table_get(&global_types, id)->node.kind;
+}
+
+static inline bool check_numeric(type_id id) {
+    return check_kind(id) == NODE_TYPE_NAME;
+}
+
+// The type both operands agree on, TYPE_NONE when they do not
+static inline type_id check_unify(type_id a, type_id b) {
+    if (a == TYPE_LITERAL && check_numeric(b))
+        return b;
+    if (b == TYPE_LITERAL && check_numeric(a))
+        return a;
+    return a == b ? a : TYPE_NONE;
+}
+
+__attribute__((format(printf, 4, 5)))
+static void check_error(check_state* st, size_t l, size_t c, const char* fmt, ...) {
+    char message[256];
+    va_list args;
+    va_start(args, fmt);
+    vsnprintf(message, sizeof(message), fmt, args);
+    va_end(args);
+    diagnostics_push(st->diags, l, c, st->order++, "%s", message);
+}
+
+// Returns the type of an expression, TYPE_NONE once an error was reported for it
+static type_id check_expr(check_state* st, lex_node node) {
+    char a[64], b[64];
+
+    if (node.kind == NODE_NUMBER)
+        return TYPE_LITERAL;
+
+    if (node.kind == NODE_NAME) {
+        const lex_node_name* name = node.data;
+        if (name->slot == SYM_NONE)
+            return TYPE_NONE; // Already reported by resolve_ast
+        if (st->ctx->symbols->bindings[name->slot].kind == SYM_FN) {
+            check_error(st, name->l, name->c, "'%s' is a function and can not be used as a value", name->name);
+            return TYPE_NONE;
+        }
+        return st->ctx->slot_types[name->slot];
+    }
+
+    if (node.kind == NODE_UNOP) {
+        const lex_node_unop* data = node.data;
+        const type_id value = check_expr(st, data->value);
+        if (value == TYPE_NONE)
+            return TYPE_NONE;
+        type_str(value, a, sizeof(a));
+
+        if (data->op.k == TK_MUL) {
+            if (check_kind(value) != NODE_TYPE_POINTER) {
+                check_error(st, data->op.l, data->op.c, "Can not dereference a value of type '%s'", a);
+                return TYPE_NONE;
+            }
+            return ((lex_node_type*)type_table_get(&global_types, value)->node.data)->id;
+        }
+        if (data->op.k == TK_NOT)
+            return st->ctx->int_type;
+        if (!check_numeric(value)) {
+            check_error(st, data->op.l, data->op.c, "`%s` expects a number, got '%s'", data->op.t, a);
+            return TYPE_NONE;
+        }
+        return value;
+    }
+
+    if (node.kind == NODE_CALL) {
+        const lex_node_call* data = node.data;
+        const lex_node_name* callee = &data->callee;
+        const lex_node_fn* fn = NULL;
+        if (callee->slot != SYM_NONE && st->ctx->symbols->bindings[callee->slot].kind == SYM_FN)
+            fn = st->ctx->symbols->bindings[callee->slot].decl;
+        else if (callee->slot != SYM_NONE)
+            check_error(st, callee->l, callee->c, "'%s' is not a function", callee->name);
+        if (fn && fn->params.len != data->args.len) {
+            check_error(st, callee->l, callee->c, "'%s' expects %zu arguments, got %zu", callee->name, fn->params.len, data->args.len);
+            fn = NULL;
+        }
+
+        bool valid = fn != NULL;
+        for (size_t i = 0; i < data->args.len; i++) {
+            const type_id value = check_expr(st, data->args.nodes[i]);
+            if (!fn || value == TYPE_NONE) {
+                valid = false;
+                continue;
+            }
+            const type_id param = ((lex_node_fn_param*)fn->params.nodes[i].data)->type.id;
+            if (value != param && !(value == TYPE_LITERAL && check_numeric(param))) {
+                type_str(value, a, sizeof(a));
+                type_str(param, b, sizeof(b));
+                check_error(st, callee->l, callee->c, "Argument %zu of '%s' is '%s' but '%s' was expected", i+1, callee->name, a, b);
+                valid = false;
+            }
+        }
+        return valid ? fn->type.id : TYPE_NONE;
+    }
+
+    if (node.kind != NODE_BINOP)
+        return TYPE_NONE;
+
+    const lex_node_binop* data = node.data;
+    const token_kind op = data->op.k;
+
+    if (op == TK_SET) {
+        if (data->lhs.kind != NODE_NAME) {
+            check_error(st, data->op.l, data->op.c, "Only names can be assigned to");
+            check_expr(st, data->rhs);
+            return TYPE_NONE;
+        }
+        const type_id target = check_expr(st, data->lhs);
+        const type_id value = check_expr(st, data->rhs);
+        if (target == TYPE_NONE || value == TYPE_NONE)
+            return TYPE_NONE;
+        if (target != value && !(value == TYPE_LITERAL && check_numeric(target))) {
+            type_str(value, a, sizeof(a));
+            type_str(target, b, sizeof(b));
+            check_error(st, data->op.l, data->op.c, "Can not assign '%s' to '%s' of type '%s'", a, ((lex_node_name*)data->lhs.data)->name, b);
+            return TYPE_NONE;
+        }
+        return target;
+    }
+
+    const type_id lhs = check_expr(st, data->lhs);
+    const type_id rhs = check_expr(st, data->rhs);
+    if (lhs == TYPE_NONE || rhs == TYPE_NONE)
+        return TYPE_NONE;
+
+    const bool lptr = check_kind(lhs) == NODE_TYPE_POINTER;
+    const bool rptr = check_kind(rhs) == NODE_TYPE_POINTER;
+    type_id result = TYPE_NONE;
+
+    switch (op) {
+        case TK_ADD:
+            if (lptr && check_numeric(rhs))
+                result = lhs;
+            else if (rptr && check_numeric(lhs))
+                result = rhs;
+            else if (check_numeric(lhs) && check_numeric(rhs))
+                result = check_unify(lhs, rhs);
+            break;
+        case TK_SUB:
+            if (lptr && check_numeric(rhs))
+                result = lhs;
+            else if (lptr && lhs == rhs)
+                result = st->ctx->int_type;
+            else if (check_numeric(lhs) && check_numeric(rhs))
+                result = check_unify(lhs, rhs);
+            break;
+        case TK_MUL:
+        case TK_DIV:
+            if (check_numeric(lhs) && check_numeric(rhs))
+                result = check_unify(lhs, rhs);
+            break;
+        case TK_SHL:
+        case TK_SHR:
+            if (check_numeric(lhs) && check_numeric(rhs))
+                result = lhs;
+            break;
+        case TK_EQ:
+        case TK_NE:
+        case TK_GT:
+        case TK_GE:
+        case TK_LT:
+        case TK_LE:
+            if ((lptr && lhs == rhs) || (!lptr && !rptr && check_unify(lhs, rhs) != TYPE_NONE))
+                result = st->ctx->int_type;
+            break;
+        default:
+            break;
+    }
+
+    if (result == TYPE_NONE) {
+        type_str(lhs, a, sizeof(a));
+        type_str(rhs, b, sizeof(b));
+        check_error(st, data->op.l, data->op.c, "Operands of `%s` have incompatible types '%s' and '%s'", data->op.t, a, b);
+    }
+    return result;
+}
+
+void check_fn(check_state* st, const lex_node_fn* fn) {
+    type_id last = TYPE_UNIT;
+    size_t l = fn->l, c = fn->c;
+    for (size_t i = 0; i < fn->body.children.len; i++) {
+        const lex_node child = fn->body.children.nodes[i];
+        if (child.kind == NODE_DEF) {
+            last = TYPE_UNIT;
+            continue;
+        }
+        last = check_expr(st, child);
+        if (child.kind == NODE_BINOP)
+            l = ((lex_node_binop*)child.data)->op.l, c = ((lex_node_binop*)child.data)->op.c;
+        else if (child.kind == NODE_UNOP)
+            l = ((lex_node_unop*)child.data)->op.l, c = ((lex_node_unop*)child.data)->op.c;
+        else if (child.kind == NODE_NAME)
+            l = ((lex_node_name*)child.data)->l, c = ((lex_node_name*)child.data)->c;
+        else if (child.kind == NODE_CALL)
+            l = ((lex_node_call*)child.data)->callee.l, c = ((lex_node_call*)child.data)->callee.c;
+    }
+
+    if (last == TYPE_NONE || fn->type.id == TYPE_UNIT)
+        return;
+    if (last != fn->type.id && !(last == TYPE_LITERAL && check_numeric(fn->type.id))) {
+        char a[64], b[64];
+        type_str(fn->type.id, a, sizeof(a));
+        type_str(last, b, sizeof(b));
+        check_error(st, l, c, "'%s' returns '%s' but its body evaluates to '%s'", fn->name, a, b);
+    }
+}
+
+static void check_task(void* arg, size_t index, unsigned worker) {
+    check_ctx* ctx = arg;
+    check_state st = {
+        .ctx = ctx,
+        .diags = &ctx->worker_diags[worker],
+        .order = (uint64_t)ctx->fn_order[index] << 32,
+    };
+    check_fn(&st, ctx->fns[index]);
+}
+
+// Type checks every function of a resolved program, bodies are checked in parallel on `pool` unless it is NULL
+// Diagnostics are appended to `out` sorted by position, returns how many were found
+size_t check_ast(lex_node root, const sym_table* symbols, thread_pool* pool, diagnostics* out) {
+    const unsigned workers = pool ? pool_workers(pool) : 1;
+    lex_node_root* data = root.data;
+
+    // Signature table, only read once workers start
+    check_ctx ctx = {
+        .symbols = symbols,
+        .slot_types = (type_id*)malloc(sizeof(type_id)*(symbols->len+1)),
+        .int_type = type_table_name(&global_types, "int").id,
+        .fns = (lex_node_fn**)malloc(sizeof(lex_node_fn*)*(data->children.len+1)),
+        .fn_order = (uint32_t*)malloc(sizeof(uint32_t)*(data->children.len+1)),
+        .worker_diags = (diagnostics*)malloc(sizeof(diagnostics)*workers),
+    };
+    for (uint32_t slot = 0; slot < symbols->len; slot++) {
+        const sym_binding binding = symbols->bindings[slot];
+        switch (binding.kind) {
+            case SYM_FN: ctx.slot_types[slot] = ((lex_node_fn*)binding.decl)->type.id; break;
+            case SYM_PARAM: ctx.slot_types[slot] = ((lex_node_fn_param*)binding.decl)->type.id; break;
+            default: ctx.slot_types[slot] = ((lex_node_def*)binding.decl)->type.id; break;
+        }
+    }
+    for (size_t i = 0; i < data->children.len; i++) {
+        if (data->children.nodes[i].kind != NODE_FUNCTION)
+            continue;
+        ctx.fn_order[ctx.fns_len] = i;
+        ctx.fns[ctx.fns_len++] = data->children.nodes[i].data;
+    }
+    for (unsigned i = 0; i < workers; i++)
+        diagnostics_init(&ctx.worker_diags[i]);
+
+    if (pool)
+        pool_run(pool, ctx.fns_len, check_task, &ctx);
+    else
+        for (size_t i = 0; i < ctx.fns_len; i++)
+            check_task(&ctx, i, 0);
+
+    const size_t start = out->len;
+    for (unsigned i = 0; i < workers; i++) {
+        diagnostics_append(out, &ctx.worker_diags[i]);
+        diagnostics_free(&ctx.worker_diags[i]);
+    }
+    diagnostics_sort(out);
+
+    free(ctx.slot_types);
+    free(ctx.fns);
+    free(ctx.fn_order);
+    free(ctx.worker_diags);
+    return out->len-start;
+}
+
+typedef enum {
+    IR_CONST = 1, // dst = imm
+    IR_PARAM,     // dst = parameter #imm
+    IR_UNDEF,     // dst = value of a variable read before any assignment
+    IR_LOAD,      // dst = global names[imm]
+    IR_STORE,     // global names[imm] = a
+    IR_BINOP,     // dst = a <tk> b
+    IR_UNOP,      // dst = <tk> a
+    IR_ARG,       // pass a to the next IR_CALL
+    IR_CALL,      // dst = global names[imm] called with the b IR_ARG before it
+    IR_RET,       // return a (IR_NONE for no value)
+} ir_opcode;
+
+typedef uint32_t ir_reg;
+
+#define IR_NONE ((uint32_t)-1)
+
+#define IR_PUSH(arr, len, cap, value) { \
+    if ((cap) <= (len)) { \
+        (cap) = (cap) ? (cap)*2 : IR_CAPACITY_DEFAULT; \
+        (arr) = realloc((arr), sizeof(*(arr))*(cap)); \
+    } \
+    (arr)[(len)++] = (value); \
+}
+
+typedef struct {
+    unsigned char op; // ir_opcode
+    unsigned char tk; // token_kind of the operator for IR_BINOP / IR_UNOP
+    ir_reg dst;
+    uint32_t a;
+    uint32_t b;
+    long imm;
+} ir_inst;
+
+// Phi nodes live in their own array so that the instructions of a block stay contiguous
+// The language has no control flow yet, so every fn lowers to its entry block alone and no phi is ever made
+typedef struct {
+    uint32_t block;
+    ir_reg dst;
+    uint32_t args; // first argument in ir_fn.phi_args
+    uint32_t nargs;
+} ir_phi;
+
+typedef struct {
+    uint32_t block; // predecessor the value flows in from
+    ir_reg reg;
+} ir_phi_arg;
+
+typedef struct {
+    uint32_t start; // first instruction in ir_fn.insts
+    uint32_t len;
+    uint32_t preds; // first predecessor in ir_fn.preds
+    uint32_t npreds;
+} ir_block;
+
+// A function in SSA form, every array is flat and indexed by 32 bits ids
+typedef struct {
+    const char* name;
+    const char* error;
+    uint32_t nparams;
+    uint32_t nregs;
+
+    ir_inst* insts;
+    uint32_t insts_len, insts_cap;
+
+    ir_block* blocks;
+    uint32_t blocks_len, blocks_cap;
+
+    uint32_t* preds;
+    uint32_t preds_len, preds_cap;
+
+    ir_phi* phis;
+    uint32_t phis_len, phis_cap;
+
+    ir_phi_arg* phi_args;
+    uint32_t phi_args_len, phi_args_cap;
+
+    const char** names; // globals referenced by IR_LOAD / IR_STORE / IR_CALL
+    uint32_t names_len, names_cap;
+} ir_fn;
+
+typedef struct {
+    const char* name;
+    uint32_t slot;
+} ir_var;
+
+typedef struct {
+    ir_fn* fn;
+    uint32_t block; // block instructions are currently appended to
+
+    ir_var* vars;
+    uint32_t vars_len, vars_cap;
+    uint32_t vars_visible; // vars past this index went out of scope
+
+    ir_reg* defs; // current definition of each var, one row of vars_cap per block
+    uint32_t defs_rows;
+
+    // Registers of the expressions lowered in the current block, keyed by node data
+    // A node shared by cse_block is only lowered once
+    const void** memo_keys;
+    ir_reg* memo_regs;
+    uint32_t memo_len, memo_cap;
+} ir_builder;
+
+static ir_reg ir_memo_get(ir_builder* b, const void* key) {
+    if (!b->memo_cap)
+        return IR_NONE;
+    uint32_t s = hash_mix(0, (uintptr_t)key) & (b->memo_cap-1);
+    while (b->memo_keys[s]) {
+        if (b->memo_keys[s] == key)
+            return b->memo_regs[s];
+        s = (s+1) & (b->memo_cap-1);
+    }
+    return IR_NONE;
+}
+
+static void ir_memo_put(ir_builder* b, const void* key, ir_reg reg) {
+    if ((b->memo_len+1)*2 > b->memo_cap) {
+        const void** keys = b->memo_keys;
+        ir_reg* regs = b->memo_regs;
+        const uint32_t cap = b->memo_cap;
+        b->memo_cap = cap ? cap*2 : IR_CAPACITY_DEFAULT;
+        b->memo_keys = (const void**)calloc(b->memo_cap, sizeof(void*));
+        b->memo_regs = (ir_reg*)malloc(sizeof(ir_reg)*b->memo_cap);
+        b->memo_len = 0;
+        for (uint32_t i = 0; i < cap; i++)
+            if (keys[i])
+                ir_memo_put(b, keys[i], regs[i]);
+        free(keys);
+        free(regs);
+    }
+    uint32_t s = hash_mix(0, (uintptr_t)key) & (b->memo_cap-1);
+    while (b->memo_keys[s])
+        s = (s+1) & (b->memo_cap-1);
+    b->memo_keys[s] = key;
+    b->memo_regs[s] = reg;
+    b->memo_len++;
+}
+
+static ir_reg ir_emit(ir_builder* b, ir_opcode op, unsigned char tk, uint32_t a, uint32_t bb, long imm) {
+    ir_fn* fn = b->fn;
+    const ir_reg dst = (op == IR_STORE || op == IR_ARG || op == IR_RET) ? IR_NONE : fn->nregs++;
+    IR_PUSH(fn->insts, fn->insts_len, fn->insts_cap, ((ir_inst){
+        .op = op,
+        .tk = tk,
+        .dst = dst,
+        .a = a,
+        .b = bb,
+        .imm = imm,
+    }));
+    fn->blocks[b->block].len++;
+    return dst;
+}
+
+static uint32_t ir_new_block(ir_builder* b, const uint32_t* preds, uint32_t npreds) {
+    ir_fn* fn = b->fn;
+    const uint32_t id = fn->blocks_len;
+    IR_PUSH(fn->blocks, fn->blocks_len, fn->blocks_cap, ((ir_block){
+        .start = fn->insts_len,
+        .len = 0,
+        .preds = fn->preds_len,
+        .npreds = npreds,
+    }));
+    for (uint32_t i = 0; i < npreds; i++)
+        IR_PUSH(fn->preds, fn->preds_len, fn->preds_cap, preds[i]);
+
+    b->defs = realloc(b->defs, sizeof(ir_reg)*b->vars_cap*fn->blocks_len);
+    for (uint32_t i = 0; i < b->vars_cap; i++)
+        b->defs[id*b->vars_cap+i] = IR_NONE;
+    b->defs_rows = fn->blocks_len;
+    b->block = id;
+    if (b->memo_cap)
+        memset(b->memo_keys, 0, sizeof(void*)*b->memo_cap);
+    b->memo_len = 0;
+    return id;
+}
+
+static uint32_t ir_global(ir_fn* fn, const char* name) {
+    for (uint32_t i = 0; i < fn->names_len; i++)
+        if (!strcmp(fn->names[i], name))
+            return i;
+    IR_PUSH(fn->names, fn->names_len, fn->names_cap, name);
+    return fn->names_len-1;
+}
+
+// Resolved names are matched by binding slot, the others by spelling
+static uint32_t ir_lookup_var(ir_builder* b, const lex_node_name* name) {
+    if (name->slot != SYM_NONE) {
+        for (uint32_t i = b->vars_visible; i > 0; i--)
+            if (b->vars[i-1].slot == name->slot)
+                return i-1;
+        return IR_NONE;
+    }
+    for (uint32_t i = b->vars_visible; i > 0; i--)
+        if (!strcmp(b->vars[i-1].name, name->name))
+            return i-1;
+    return IR_NONE;
+}
+
+static void ir_write_var(ir_builder* b, uint32_t block, uint32_t var, ir_reg reg) {
+    b->defs[block*b->vars_cap+var] = reg;
+}
+
+// Looks up the reaching definition of a variable, inserting phi nodes at joins
+// Only the entry block exists until something lowers to branches, the predecessor paths are there for that
+static ir_reg ir_read_var(ir_builder* b, uint32_t block, uint32_t var) {
+    ir_reg reg = b->defs[block*b->vars_cap+var];
+    if (reg != IR_NONE)
+        return reg;
+
+    ir_fn* fn = b->fn;
+    const ir_block bl = fn->blocks[block];
+
+    if (bl.npreds == 0) {
+        // Only the entry block has no predecessor, and it is always the one being built
+        reg = ir_emit(b, IR_UNDEF, 0, IR_NONE, IR_NONE, 0);
+    }
+    else if (bl.npreds == 1) {
+        reg = ir_read_var(b, fn->preds[bl.preds], var);
+    }
+    else {
+        reg = fn->nregs++;
+        ir_write_var(b, block, var, reg); // Breaks cycles through loops
+        const uint32_t args = fn->phi_args_len;
+        for (uint32_t i = 0; i < bl.npreds; i++) {
+            const uint32_t pred = fn->preds[bl.preds+i];
+            IR_PUSH(fn->phi_args, fn->phi_args_len, fn->phi_args_cap, ((ir_phi_arg){
+                .block = pred,
+                .reg = ir_read_var(b, pred, var),
+            }));
+        }
+        IR_PUSH(fn->phis, fn->phis_len, fn->phis_cap, ((ir_phi){
+            .block = block,
+            .dst = reg,
+            .args = args,
+            .nargs = bl.npreds,
+        }));
+    }
+
+    ir_write_var(b, block, var, reg);
+    return reg;
+}
+
+static ir_reg ir_lower_expr(ir_builder* b, lex_node node) {
+    if (node.kind == NODE_NUMBER)
+        return ir_emit(b, IR_CONST, 0, IR_NONE, IR_NONE, *(long*)node.data);
+
+    if (node.kind == NODE_NAME) {
+        const lex_node_name* name = node.data;
+        const uint32_t var = ir_lookup_var(b, name);
+        if (var != IR_NONE)
+            return ir_read_var(b, b->block, var);
+        return ir_emit(b, IR_LOAD, 0, IR_NONE, IR_NONE, ir_global(b->fn, name->name));
+    }
+
+    if (node.kind == NODE_BINOP) {
+        lex_node_binop* data = node.data;
+
+        if (data->op.k == TK_SET) {
+            if (data->lhs.kind != NODE_NAME) {
+                b->fn->error = "Only names can be assigned to";
+                return IR_NONE;
+            }
+            const ir_reg value = ir_lower_expr(b, data->rhs);
+            if (value == IR_NONE)
+                return IR_NONE;
+            const lex_node_name* name = data->lhs.data;
+            const uint32_t var = ir_lookup_var(b, name);
+            if (var != IR_NONE)
+                ir_write_var(b, b->block, var, value);
+            else
+                ir_emit(b, IR_STORE, 0, value, IR_NONE, ir_global(b->fn, name->name));
+            return value;
+        }
+
+        ir_reg reg = ir_memo_get(b, data);
+        if (reg != IR_NONE)
+            return reg;
+        const ir_reg lhs = ir_lower_expr(b, data->lhs);
+        if (lhs == IR_NONE)
+            return IR_NONE;
+        const ir_reg rhs = ir_lower_expr(b, data->rhs);
+        if (rhs == IR_NONE)
+            return IR_NONE;
+        reg = ir_emit(b, IR_BINOP, data->op.k, lhs, rhs, 0);
+        ir_memo_put(b, data, reg);
+        return reg;
+    }
+
+    if (node.kind == NODE_UNOP) {
+        lex_node_unop* data = node.data;
+        ir_reg reg = ir_memo_get(b, data);
+        if (reg != IR_NONE)
+            return reg;
+        const ir_reg value = ir_lower_expr(b, data->value);
+        if (value == IR_NONE)
+            return IR_NONE;
+        reg = ir_emit(b, IR_UNOP, data->op.k, value, IR_NONE, 0);
+        ir_memo_put(b, data, reg);
+        return reg;
+    }
+
+    if (node.kind == NODE_CALL) {
+        lex_node_call* data = node.data;
+        // Arguments are passed once they are all computed, so that calls in them do not interleave
+        ir_reg* args = (ir_reg*)malloc(sizeof(ir_reg)*(data->args.len+1));
+        for (size_t i = 0; i < data->args.len; i++) {
+            args[i] = ir_lower_expr(b, data->args.nodes[i]);
+            if (args[i] == IR_NONE) {
+                free(args);
+                return IR_NONE;
+            }
+        }
+        for (size_t i = 0; i < data->args.len; i++)
+            ir_emit(b, IR_ARG, 0, args[i], IR_NONE, 0);
+        free(args);
+        return ir_emit(b, IR_CALL, 0, IR_NONE, data->args.len, ir_global(b->fn, data->callee.name));
+    }
+
+    b->fn->error = "Expression can not be lowered";
+    return IR_NONE;
+}
+
+// Lowers a function into SSA form, returns 0 on success or sets `ir->error`
+int ir_lower_fn(lex_node_fn* fn, ir_fn* ir) {
+    memset(ir, 0, sizeof(ir_fn));
+    ir->name = fn->name;
+    ir->nparams = fn->params.len;
+
+    ir_builder b = {
+        .fn = ir,
+        .vars_cap = fn->params.len,
+    };
+    for (size_t i = 0; i < fn->body.children.len; i++)
+        if (fn->body.children.nodes[i].kind == NODE_DEF)
+            b.vars_cap++;
+    if (!b.vars_cap)
+        b.vars_cap = 1;
+    b.vars = malloc(sizeof(ir_var)*b.vars_cap);
+
+    ir_new_block(&b, NULL, 0);
+
+    for (size_t i = 0; i < fn->params.len; i++) {
+        lex_node_fn_param* param = fn->params.nodes[i].data;
+        b.vars[b.vars_len++] = (ir_var){.name = param->name, .slot = param->slot};
+        b.vars_visible = b.vars_len;
+        ir_write_var(&b, b.block, b.vars_len-1, ir_emit(&b, IR_PARAM, 0, IR_NONE, IR_NONE, i));
+    }
+
+    ir_reg last = IR_NONE;
+    for (size_t i = 0; i < fn->body.children.len; i++) {
+        const lex_node child = fn->body.children.nodes[i];
+        if (child.kind == NODE_DEF) {
+            lex_node_def* def = child.data;
+            b.vars[b.vars_len++] = (ir_var){.name = def->name, .slot = def->slot};
+            b.vars_visible = b.vars_len;
+            continue;
+        }
+        last = ir_lower_expr(&b, child);
+        if (ir->error)
+            break;
+    }
+
+    if (!ir->error)
+        ir_emit(&b, IR_RET, 0, last, IR_NONE, 0);
+
+    free(b.vars);
+    free(b.defs);
+    free(b.memo_keys);
+    free(b.memo_regs);
+    return ir->error != NULL;
+}
+
+void ir_free(ir_fn* ir) {
+    free(ir->insts);
+    free(ir->blocks);
+    free(ir->preds);
+    free(ir->phis);
+    free(ir->phi_args);
+    free(ir->names);
+    memset(ir, 0, sizeof(ir_fn));
+}
+
+const char* ir_op_str(unsigned char tk, bool unary) {
+    switch (tk) {
+        case TK_ADD: return unary ? "pos" : "add";
+        case TK_SUB: return unary ? "neg" : "sub";
+        case TK_MUL: return unary ? "deref" : "mul";
+        case TK_DIV: return unary ? "inv" : "div";
+        case TK_EQ: return "eq";
+        case TK_NE: return "ne";
+        case TK_GT: return "gt";
+        case TK_GE: return "ge";
+        case TK_LT: return "lt";
+        case TK_LE: return "le";
+        case TK_SHL: return "shl";
+        case TK_SHR: return "shr";
+        case TK_NOT: return "not";
+        case TK_SET: return "set"; // lowers to a variable write, named for the operator profile
+    }
+    return "?";
+}
+
+void ir_dump(FILE* out, const ir_fn* ir) {
+    fprintf(out, "  \x1b[91;1mfn\x1b[39;22m \x1b[95;1m%s\x1b[39;22m(%u params, %u regs) {\n", ir->name, ir->nparams, ir->nregs);
+    for (uint32_t bi = 0; bi < ir->blocks_len; bi++) {
+        const ir_block bl = ir->blocks[bi];
+        fprintf(out, "  \x1b[93mb%u\x1b[39m:", bi);
+        for (uint32_t i = 0; i < bl.npreds; i++)
+            fprintf(out, "%s b%u", i ? "," : " <-", ir->preds[bl.preds+i]);
+        fprintf(out, "\n");
+
+        for (uint32_t pi = 0; pi < ir->phis_len; pi++) {
+            const ir_phi phi = ir->phis[pi];
+            if (phi.block != bi)
+                continue;
+            fprintf(out, "    %%%u = \x1b[96mphi\x1b[39m", phi.dst);
+            for (uint32_t i = 0; i < phi.nargs; i++) {
+                const ir_phi_arg arg = ir->phi_args[phi.args+i];
+                fprintf(out, "%s [b%u %%%u]", i ? "," : "", arg.block, arg.reg);
+            }
+            fprintf(out, "\n");
+        }
+
+        for (uint32_t ii = bl.start; ii < bl.start+bl.len; ii++) {
+            const ir_inst in = ir->insts[ii];
+            switch (in.op) {
+                case IR_CONST: fprintf(out, "    %%%u = \x1b[96mconst\x1b[39m \x1b[93m%ld\x1b[39m\n", in.dst, in.imm); break;
+                case IR_PARAM: fprintf(out, "    %%%u = \x1b[96mparam\x1b[39m %ld\n", in.dst, in.imm); break;
+                case IR_UNDEF: fprintf(out, "    %%%u = \x1b[96mundef\x1b[39m\n", in.dst); break;
+                case IR_LOAD: fprintf(out, "    %%%u = \x1b[96mload\x1b[39m @%s\n", in.dst, ir->names[in.imm]); break;
+                case IR_STORE: fprintf(out, "    \x1b[96mstore\x1b[39m @%s, %%%u\n", ir->names[in.imm], in.a); break;
+                case IR_BINOP: fprintf(out, "    %%%u = \x1b[96m%s\x1b[39m %%%u, %%%u\n", in.dst, ir_op_str(in.tk, false), in.a, in.b); break;
+                case IR_UNOP: fprintf(out, "    %%%u = \x1b[96m%s\x1b[39m %%%u\n", in.dst, ir_op_str(in.tk, true), in.a); break;
+                case IR_ARG: fprintf(out, "    \x1b[96marg\x1b[39m %%%u\n", in.a); break;
+                case IR_CALL: fprintf(out, "    %%%u = \x1b[96mcall\x1b[39m @%s, %u args\n", in.dst, ir->names[in.imm], in.b); break;
+                case IR_RET:
+                    if (in.a == IR_NONE)
+                        fprintf(out, "    \x1b[96mret\x1b[39m\n");
+                    else
+                        fprintf(out, "    \x1b[96mret\x1b[39m %%%u\n", in.a);
+                    break;
+            }
+        }
+    }
+    fprintf(out, "  }\n");
+}
+
+// x86-64 general purpose registers in encoding order
+typedef enum {
+    RA_RAX, RA_RCX, RA_RDX, RA_RBX, RA_RSP, RA_RBP, RA_RSI, RA_RDI,
+    RA_R8, RA_R9, RA_R10, RA_R11, RA_R12, RA_R13, RA_R14, RA_R15,
+    RA_GPRS, // not a register, the value lives in a stack slot
+} ra_gpr;
+
+static const char* ra_gpr_names[RA_GPRS] = {
+    "rax", "rcx", "rdx", "rbx", "rsp", "rbp", "rsi", "rdi",
+    "r8", "r9", "r10", "r11", "r12", "r13", "r14", "r15",
+};
+
+// System V, a fn that uses these has to save and restore them
+#define RA_CALLEE_SAVED (1u << RA_RBX | 1u << RA_RBP | 1u << RA_R12 | 1u << RA_R13 | 1u << RA_R14 | 1u << RA_R15)
+
+// Registers free registers are picked from, caller-saved first since they need no saving as long as no call is in the way
+// rsp and rbp hold the frame, r11 is kept for the emitter to reload spilled operands through
+static const unsigned char ra_order[] = {
+    RA_RAX, RA_RCX, RA_RDX, RA_RSI, RA_RDI, RA_R8, RA_R9, RA_R10,
+    RA_RBX, RA_R12, RA_R13, RA_R14, RA_R15,
+};
+
+// Registers the first System V integer arguments arrive in, the rest are on the stack
+static const unsigned char ra_param_gprs[] = {RA_RDI, RA_RSI, RA_RDX, RA_RCX, RA_R8, RA_R9};
+
+// Positions are 2*inst+1 for instructions and 2*block.start for the phis at the top of a block
+typedef struct {
+    ir_reg reg;
+    uint32_t start;
+    uint32_t end; // last use, start when the value is never used
+    unsigned char hint; // register the value is wanted in, RA_GPRS when any will do
+    bool crosses_call;
+} ra_interval;
+
+// Where every value of an ir_fn lives and what memory traffic that costs
+typedef struct {
+    unsigned char* gprs; // per ir_reg, RA_GPRS when spilled
+    uint32_t* slots;     // per ir_reg, stack slot of the spilled ones
+    uint32_t values;
+    uint32_t spilled;
+    uint32_t frame_slots;
+    uint32_t callee_saved; // mask of the callee-saved registers the fn has to preserve
+    size_t memory_ops;     // loads and stores of the allocated code
+    size_t naive_memory_ops; // loads and stores when every value gets its own stack slot
+} ra_result;
+
+static int ra_interval_cmp(const void* a, const void* b) {
+    const ra_interval* x = a;
+    const ra_interval* y = b;
+    if (x->start != y->start)
+        return x->start < y->start ? -1 : 1;
+    return x->reg < y->reg ? -1 : x->reg > y->reg;
+}
+
+static void ra_use(ra_interval* by_reg, ir_reg reg, uint32_t pos) {
+    if (reg != IR_NONE && by_reg[reg].end < pos)
+        by_reg[reg].end = pos;
+}
+
+static void ra_hint(ra_interval* by_reg, ir_reg reg, unsigned char gpr) {
+    if (reg != IR_NONE && by_reg[reg].hint == RA_GPRS)
+        by_reg[reg].hint = gpr;
+}
+
+// Inserts into `active`, which is kept sorted by end
+static void ra_activate(ra_interval** active, uint32_t* len, ra_interval* it) {
+    uint32_t i = (*len)++;
+    while (i > 0 && active[i-1]->end > it->end) {
+        active[i] = active[i-1];
+        i--;
+    }
+    active[i] = it;
+}
+
+// Live intervals of every value, sorted by start, returns how many there are
+static uint32_t ra_intervals(const ir_fn* ir, ra_interval* out) {
+    ra_interval* by_reg = (ra_interval*)malloc(sizeof(ra_interval)*(ir->nregs+1));
+    for (uint32_t r = 0; r < ir->nregs; r++)
+        by_reg[r] = (ra_interval){.reg = r, .start = UINT32_MAX, .end = 0, .hint = RA_GPRS};
+
+    // Calls clobber the caller-saved registers, calls_before[p] counts the calls at positions below p
+    const uint32_t positions = 2*ir->insts_len+2;
+    uint32_t* calls_before = (uint32_t*)malloc(sizeof(uint32_t)*(positions+1));
+    calls_before[0] = 0;
+    for (uint32_t p = 0; p < positions; p++)
+        calls_before[p+1] = calls_before[p] + (p % 2 && ir->insts[p/2].op == IR_CALL);
+
+    for (uint32_t pi = 0; pi < ir->phis_len; pi++) {
+        const ir_phi phi = ir->phis[pi];
+        by_reg[phi.dst].start = by_reg[phi.dst].end = 2*ir->blocks[phi.block].start;
+        // Lowering emits no loops, so the predecessors are laid out before the phi
+        for (uint32_t i = 0; i < phi.nargs; i++) {
+            const ir_phi_arg arg = ir->phi_args[phi.args+i];
+            const ir_block pred = ir->blocks[arg.block];
+            ra_use(by_reg, arg.reg, 2*(pred.start+pred.len));
+        }
+    }
+
+    uint32_t args = 0;
+    for (uint32_t ii = 0; ii < ir->insts_len; ii++) {
+        const ir_inst in = ir->insts[ii];
+        const uint32_t pos = 2*ii+1;
+        if (in.dst != IR_NONE)
+            by_reg[in.dst].start = by_reg[in.dst].end = pos;
+        if (in.op == IR_ARG) {
+            // Arguments are moved into place right before the call
+            if (args < sizeof(ra_param_gprs))
+                ra_hint(by_reg, in.a, ra_param_gprs[args]);
+            args++;
+            ra_use(by_reg, in.a, pos);
+            continue;
+        }
+        if (in.op == IR_CALL) {
+            args = 0;
+            ra_hint(by_reg, in.dst, RA_RAX);
+        }
+        else if (in.op == IR_PARAM && (size_t)in.imm < sizeof(ra_param_gprs))
+            ra_hint(by_reg, in.dst, ra_param_gprs[in.imm]);
+        else if (in.op == IR_RET)
+            ra_hint(by_reg, in.a, RA_RAX);
+        if (in.op == IR_STORE || in.op == IR_BINOP || in.op == IR_UNOP || in.op == IR_RET)
+            ra_use(by_reg, in.a, pos);
+        if (in.op == IR_BINOP)
+            ra_use(by_reg, in.b, pos);
+    }
+
+    uint32_t len = 0;
+    for (uint32_t r = 0; r < ir->nregs; r++) {
+        ra_interval it = by_reg[r];
+        if (it.start == UINT32_MAX)
+            continue;
+        it.crosses_call = it.end > it.start+1 && calls_before[it.end] > calls_before[it.start+1];
+        out[len++] = it;
+    }
+    qsort(out, len, sizeof(ra_interval), ra_interval_cmp);
+    free(by_reg);
+    free(calls_before);
+    return len;
+}
+
+// Loads and stores of one instruction, given where its operands live
+static size_t ra_inst_memory_ops(const ir_inst in, const unsigned char* gprs, uint32_t arg) {
+    size_t ops = 0;
+    if (in.dst != IR_NONE && in.op != IR_UNDEF)
+        ops += gprs == NULL || gprs[in.dst] == RA_GPRS;
+    if (in.op == IR_STORE || in.op == IR_BINOP || in.op == IR_UNOP || in.op == IR_ARG || (in.op == IR_RET && in.a != IR_NONE))
+        ops += gprs == NULL || gprs[in.a] == RA_GPRS;
+    if (in.op == IR_BINOP)
+        ops += gprs == NULL || gprs[in.b] == RA_GPRS;
+    // Globals are memory either way, so are parameters and arguments past the ones passed in registers
+    if (in.op == IR_LOAD || in.op == IR_STORE)
+        ops++;
+    if ((in.op == IR_PARAM && (size_t)in.imm >= sizeof(ra_param_gprs)) || (in.op == IR_ARG && arg >= sizeof(ra_param_gprs)))
+        ops++;
+    return ops;
+}
+
+// Linear scan register allocation over the live intervals of `ir`
+// Values live across a call only get callee-saved registers, when none is free the interval that ends last is spilled
+void ra_allocate(const ir_fn* ir, ra_result* ra) {
+    memset(ra, 0, sizeof(ra_result));
+    ra->gprs = (unsigned char*)malloc(ir->nregs+1);
+    ra->slots = (uint32_t*)calloc(ir->nregs+1, sizeof(uint32_t));
+    memset(ra->gprs, RA_GPRS, ir->nregs+1);
+
+    ra_interval* intervals = (ra_interval*)malloc(sizeof(ra_interval)*(ir->nregs+1));
+    ra_interval** active = (ra_interval**)malloc(sizeof(ra_interval*)*(ir->nregs+1));
+    const uint32_t len = ra_intervals(ir, intervals);
+    uint32_t active_len = 0;
+    uint32_t free_gprs = 0;
+    for (size_t i = 0; i < sizeof(ra_order); i++)
+        free_gprs |= 1u << ra_order[i];
+
+    for (uint32_t i = 0; i < len; i++) {
+        ra_interval* it = &intervals[i];
+
+        // An operand that dies here can hand its register to the result
+        uint32_t expired = 0;
+        while (expired < active_len && active[expired]->end <= it->start)
+            free_gprs |= 1u << ra->gprs[active[expired++]->reg];
+        active_len -= expired;
+        memmove(active, active+expired, sizeof(ra_interval*)*active_len);
+
+        const uint32_t allowed = it->crosses_call ? RA_CALLEE_SAVED : ~0u;
+        unsigned char gpr = RA_GPRS;
+        if (it->hint != RA_GPRS && (free_gprs & allowed & (1u << it->hint)))
+            gpr = it->hint;
+        for (size_t k = 0; gpr == RA_GPRS && k < sizeof(ra_order); k++)
+            if (free_gprs & allowed & (1u << ra_order[k]))
+                gpr = ra_order[k];
+
+        if (gpr == RA_GPRS) {
+            // Steals the register of the active interval that ends last if it outlives this one
+            int victim = -1;
+            for (int k = active_len-1; k >= 0; k--) {
+                if (allowed & (1u << ra->gprs[active[k]->reg])) {
+                    victim = k;
+                    break;
+                }
+            }
+            if (victim < 0 || active[victim]->end <= it->end) {
+                ra->spilled++;
+                continue;
+            }
+            gpr = ra->gprs[active[victim]->reg];
+            ra->gprs[active[victim]->reg] = RA_GPRS;
+            ra->spilled++;
+            active_len--;
+            memmove(active+victim, active+victim+1, sizeof(ra_interval*)*(active_len-victim));
+            free_gprs |= 1u << gpr;
+        }
+
+        free_gprs &= ~(1u << gpr);
+        ra->gprs[it->reg] = gpr;
+        ra->callee_saved |= (1u << gpr) & RA_CALLEE_SAVED;
+        ra_activate(active, &active_len, it);
+    }
+
+    // Spilled values share stack slots the same way, a slot is taken from the def of its value to the last use
+    uint32_t* slot_ends = (uint32_t*)malloc(sizeof(uint32_t)*(ra->spilled+1));
+    for (uint32_t i = 0; i < len; i++) {
+        const ra_interval it = intervals[i];
+        if (ra->gprs[it.reg] != RA_GPRS)
+            continue;
+        uint32_t slot = 0;
+        while (slot < ra->frame_slots && slot_ends[slot] >= it.start)
+            slot++;
+        if (slot == ra->frame_slots)
+            ra->frame_slots++;
+        slot_ends[slot] = it.end;
+        ra->slots[it.reg] = slot;
+    }
+    free(slot_ends);
+    ra->values = len;
+
+    uint32_t args = 0;
+    for (uint32_t ii = 0; ii < ir->insts_len; ii++) {
+        const ir_inst in = ir->insts[ii];
+        ra->memory_ops += ra_inst_memory_ops(in, ra->gprs, args);
+        ra->naive_memory_ops += ra_inst_memory_ops(in, NULL, args);
+        args = in.op == IR_ARG ? args+1 : 0;
+    }
+    for (uint32_t pi = 0; pi < ir->phis_len; pi++) {
+        const ir_phi phi = ir->phis[pi];
+        for (uint32_t i = 0; i < phi.nargs; i++) {
+            const ir_reg arg = ir->phi_args[phi.args+i].reg;
+            ra->memory_ops += (arg != IR_NONE && ra->gprs[arg] == RA_GPRS) + (ra->gprs[phi.dst] == RA_GPRS);
+            ra->naive_memory_ops += 2;
+        }
+    }
+    ra->memory_ops += 2*__builtin_popcount(ra->callee_saved); // push and pop in the prologue and epilogue
+
+    free(intervals);
+    free(active);
+}
+
+void ra_free(ra_result* ra) {
+    free(ra->gprs);
+    free(ra->slots);
+    memset(ra, 0, sizeof(ra_result));
+}
+
+void ra_dump(FILE* out, const ir_fn* ir, const ra_result* ra) {
+    fprintf(out, "  \x1b[91;1mregs\x1b[39;22m \x1b[95;1m%s\x1b[39;22m(%u values, %u spilled to %u slots, %zu memory ops, %zu with a slot per value) {\n",
+        ir->name, ra->values, ra->spilled, ra->frame_slots, ra->memory_ops, ra->naive_memory_ops);
+    if (ra->callee_saved) {
+        fprintf(out, "    saves");
+        for (int g = 0; g < RA_GPRS; g++)
+            if (ra->callee_saved & (1u << g))
+                fprintf(out, " %s", ra_gpr_names[g]);
+        fprintf(out, "\n");
+    }
+    uint32_t shown = 0;
+    for (ir_reg r = 0; r < ir->nregs; r++) {
+        if (shown % 8 == 0)
+            fprintf(out, "%s   ", shown ? "\n" : "");
+        if (ra->gprs[r] != RA_GPRS)
+            fprintf(out, " %%%u=\x1b[96m%s\x1b[39m", r, ra_gpr_names[ra->gprs[r]]);
+        else
+            fprintf(out, " %%%u=\x1b[93m[rsp+%u]\x1b[39m", r, ra->slots[r]*8);
+        shown++;
+    }
+    fprintf(out, "%s  }\n", shown ? "\n" : "");
+}
+
+const char* shift_args(int* argc, const char*** argv) {
+    return (*argc)--, *(*argv)++;
+}
+
+void debug_ast_type(lex_node_type node) {
+    if (node.kind == NODE_TYPE_UNIT) {
+        printf("()");
+    }
+    else if (node.kind == NODE_TYPE_NAME) {
+        printf("%s", (const char*)node.data);
+    }
+    else if (node.kind == NODE_TYPE_POINTER) {
+        debug_ast_type(*(lex_node_type*)node.data);
+        printf("*");
+    }
+    else {
+        printf("\x1b[91m?\x1b[39m");
+    }
+}
+
+void debug_ast(lex_node node, int indent) {
+    if (node.kind == NODE_ROOT) {
+        lex_node_root* data = node.data;
+        printf("%*s\x1b[91;1mROOT\x1b[39;22m {\n", indent, "");
+        for (size_t i = 0; i < data->children.len; i++) {
+            debug_ast(data->children.nodes[i], indent+2);
+        }
+        printf("%*s}\n", indent, "");
+    }
+    else if (node.kind == NODE_DEF) {
+        lex_node_def* data = node.data;
+        printf("%*s\x1b[91;1mDEF\x1b[39;22m \x1b[94m", indent, "");
+        debug_ast_type(data->type);
+        printf(" \x1b[39m\x1b[95;1m%s\x1b[39;22m", data->name);
+        printf("\n");
+    }
+    else if (node.kind == NODE_TYPE) {
+        printf("%*s\x1b[91;1mTYPE\x1b[39;22m ", indent, "");
+        debug_ast_type(*(lex_node_type*)node.data);
+        printf("\n");
+    }
+    else if (node.kind == NODE_FUNCTION) {
+        lex_node_fn* data = node.data;
+        printf("%*s\x1b[91;1mFN\x1b[39;22m \x1b[94m", indent, "");
+        debug_ast_type(data->type);
+        printf("\x1b[39m \x1b[95;1m%s\x1b[39;22m {\n", data->name);
+        for (size_t i = 0; i < data->params.len; i++)
+            debug_ast(data->params.nodes[i], indent+2);
+        debug_ast((lex_node){.kind=NODE_BLOCK,.data=&data->body}, indent+2);
+        printf("%*s}\n", indent, "");
+    }
+    else if (node.kind == NODE_FUNCTION_PARAM) {
+        lex_node_fn_param* data = node.data;
+        printf("%*s\x1b[91;1mPARAM\x1b[39;22m \x1b[94m", indent, "");
+        debug_ast_type(data->type);
+        printf("\x1b[39m \x1b[95;1m%s\x1b[39;22m\n", data->name);
+    }
+    else if (node.kind == NODE_BLOCK) {
+        lex_node_root* data = node.data;
+        printf("%*s\x1b[91;1mBLOCK\x1b[39;22m {\n", indent, "");
+        for (size_t i = 0; i < data->children.len; i++) {
+            debug_ast(data->children.nodes[i], indent+2);
+        }
+        printf("%*s}\n", indent, "");
+    }
+    else if (node.kind == NODE_BINOP) {
+        lex_node_binop* data = node.data;
+        printf("%*s\x1b[91;1mBINOP\x1b[39;22m \x1b[96m%s\x1b[39m {\n", indent, "", data->op.t);
+        debug_ast(data->lhs, indent+2);
+        debug_ast(data->rhs, indent+2);
+        printf("%*s}\n", indent, "");
+    }
+    else if (node.kind == NODE_UNOP) {
+        lex_node_unop* data = node.data;
+        printf("%*s\x1b[91;1mUNOP\x1b[39;22m \x1b[96m%s\x1b[39m {\n", indent, "", data->op.t);
+        debug_ast(data->value, indent+2);
+        printf("%*s}\n", indent, "");
+    }
+    else if (node.kind == NODE_CALL) {
+        lex_node_call* data = node.data;
+        printf("%*s\x1b[91;1mCALL\x1b[39;22m \x1b[95;1m%s\x1b[39;22m", indent, "", data->callee.name);
+        if (data->callee.slot != SYM_NONE)
+            printf(" \x1b[90m#%u\x1b[39m", data->callee.slot);
+        printf(" {\n");
+        for (size_t i = 0; i < data->args.len; i++)
+            debug_ast(data->args.nodes[i], indent+2);
+        printf("%*s}\n", indent, "");
+    }
+    else if (node.kind == NODE_IMPORT) {
+        lex_node_import* data = node.data;
+        printf("%*s\x1b[91;1mIMPORT\x1b[39;22m \x1b[92m\"%s\"\x1b[39m", indent, "", data->path);
+        if (data->module)
+            printf(" \x1b[90m%zu declarations\x1b[39m", data->module->decls.len);
+        printf("\n");
+    }
+    else if (node.kind == NODE_NAME) {
+        lex_node_name* data = node.data;
+        printf("%*s\x1b[91;1mNAME\x1b[39;22m \x1b[95;1m%s\x1b[39;22m", indent, "", data->name);
+        if (data->slot != SYM_NONE)
+            printf(" \x1b[90m#%u\x1b[39m", data->slot);
+        printf("\n");
+    }
+    else if (node.kind == NODE_NUMBER) {
+        printf("%*s\x1b[91;1mNUMBER\x1b[39;22m \x1b[93m%zi\x1b[39m\n", indent, "", *(long*)node.data);
+    }
+    else {
+        printf("%*s\x1b[90m(Invalid node kind %d)\x1b[39m\n", indent, "", node.kind);
+    }
+}
+
+static inline double now_seconds() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec*1e-9;
+}
+
+// Reads a whole file into memory from `a`, NULL terminated, returns NULL on failure
+char* read_file(arena* a, const char* path, size_t* len) {
+    FILE* f = fopen(path, "rb");
+    if (f == NULL)
+        return NULL;
+    if (fseek(f, 0, SEEK_END)) {
+        fclose(f);
+        return NULL;
+    }
+    const long size = ftell(f);
+    if (size < 0 || fseek(f, 0, SEEK_SET)) {
+        fclose(f);
+        return NULL;
+    }
+    char* data = a ? (char*)arena_alloc(a, size+1) : (char*)malloc(size+1);
+    if (size && !fread(data, size, 1, f)) {
+        if (!a)
+            free(data);
+        fclose(f);
+        return NULL;
+    }
+    data[size] = 0;
+    fclose(f);
+    if (len)
+        *len = size;
+    return data;
+}
+
+// Interfaces of every module imported so far, shared by all files and threads and never freed
+typedef struct {
+    pthread_mutex_t lock;
+    arena arena;
+    module_interface** slots; // Open addressing on the source hash, NULL is empty
+    size_t len;
+    size_t cap;
+    const char* dir;          // where interfaces are kept between runs, NULL when disabled
+    _Atomic size_t imports;
+    _Atomic size_t parsed;
+    _Atomic size_t from_disk;
+} module_cache;
+
+module_cache global_modules;
+
+// The disk cache lives in $SPL_MODULE_CACHE, or .spl-cache when unset, an empty value disables it
+void module_cache_init(module_cache* cache) {
+    memset(cache, 0, sizeof(module_cache));
+    pthread_mutex_init(&cache->lock, NULL);
+    cache->cap = MODULE_CACHE_CAPACITY_DEFAULT;
+    cache->slots = (module_interface**)calloc(cache->cap, sizeof(module_interface*));
+    const char* dir = getenv("SPL_MODULE_CACHE");
+    if (dir == NULL)
+        dir = MODULE_CACHE_DIR_DEFAULT;
+    cache->dir = *dir ? dir : NULL;
+}
+
+// Must be called with the lock held
+static module_interface* module_cache_find(module_cache* cache, uint64_t hash) {
+    for (size_t i = hash & (cache->cap-1); cache->slots[i]; i = (i+1) & (cache->cap-1))
+        if (cache->slots[i]->hash == hash)
+            return cache->slots[i];
+    return NULL;
+}
+
+// Must be called with the lock held
+static void module_cache_put(module_cache* cache, module_interface* module) {
+    if ((cache->len+1)*2 > cache->cap) {
+        module_interface** old = cache->slots;
+        const size_t old_cap = cache->cap;
+        cache->cap *= 2;
+        cache->slots = (module_interface**)calloc(cache->cap, sizeof(module_interface*));
+        cache->len = 0;
+        for (size_t i = 0; i < old_cap; i++)
+            if (old[i])
+                module_cache_put(cache, old[i]);
+        free(old);
+    }
+    size_t i = module->hash & (cache->cap-1);
+    while (cache->slots[i])
+        i = (i+1) & (cache->cap-1);
+    cache->slots[i] = module;
+    cache->len++;
+}
+
+static char* module_strdup(const char* str) {
+    const size_t len = strlen(str);
+    char* copy = (char*)node_alloc(len+1);
+    memcpy(copy, str, len+1);
+    return copy;
+}
+
+// Parses a type the way type_str spells it
+static bool module_type(const char* spelling, lex_node_type* type) {
+    size_t len = strlen(spelling);
+    size_t stars = 0;
+    while (stars < len && spelling[len-1-stars] == '*')
+        stars++;
+    char name[MODULE_NAME_MAX];
+    if (stars == len || len-stars >= sizeof(name))
+        return false;
+    memcpy(name, spelling, len-stars);
+    name[len-stars] = 0;
+
+    *type = strcmp(name, "()") ? type_table_name(&global_types, name) : type_table_get(&global_types, TYPE_UNIT)->node;
+    while (stars--)
+        *type = type_table_ptr(&global_types, type->id);
+    return true;
+}
+
+// Writes the top-level declarations of a module, one per line:
+//   fn <type> <name> [<param type> <param name>]...
+//   def <type> <name>
+static void module_interface_text(const lex_node_root* root, str_t* out) {
+    char type[MODULE_NAME_MAX];
+    str_printf(out, "%s\n", MODULE_INTERFACE_MAGIC);
+    for (size_t i = 0; i < root->children.len; i++) {
+        const lex_node node = root->children.nodes[i];
+        if (node.kind == NODE_FUNCTION) {
+            const lex_node_fn* fn = node.data;
+            type_str(fn->type.id, type, sizeof(type));
+            str_printf(out, "fn %s %s", type, fn->name);
+            for (size_t j = 0; j < fn->params.len; j++) {
+                const lex_node_fn_param* param = fn->params.nodes[j].data;
+                type_str(param->type.id, type, sizeof(type));
+                str_printf(out, " %s %s", type, param->name);
+            }
+            str_printf(out, "\n");
+        }
+        else if (node.kind == NODE_DEF) {
+            const lex_node_def* def = node.data;
+            type_str(def->type.id, type, sizeof(type));
+            str_printf(out, "def %s %s\n", type, def->name);
+        }
+    }
+}
+
+// Builds an interface from its text, which is clobbered, returns NULL when it is malformed
+// Must be called with the lock held, the nodes live in the arena of the cache
+static module_interface* module_interface_read(module_cache* cache, uint64_t hash, char* text) {
+    char* lines = NULL;
+    char* line = strtok_r(text, "\n", &lines);
+    if (line == NULL || strcmp(line, MODULE_INTERFACE_MAGIC))
+        return NULL;
+
+    arena* previous = node_arena;
+    node_arena = &cache->arena;
+    module_interface* module = (module_interface*)node_alloc(sizeof(module_interface));
+    module->hash = hash;
+    lex_nodes_init(&module->decls);
+
+    bool ok = true;
+    while (ok && (line = strtok_r(NULL, "\n", &lines))) {
+        char* words = NULL;
+        const char* kind = strtok_r(line, " ", &words);
+        const char* spelling = strtok_r(NULL, " ", &words);
+        const char* name = strtok_r(NULL, " ", &words);
+        lex_node_type type;
+        if (kind == NULL || spelling == NULL || name == NULL || !module_type(spelling, &type)) {
+            ok = false;
+        }
+        else if (!strcmp(kind, "def")) {
+            lex_node_def def = {.name = module_strdup(name), .type = type, .slot = SYM_NONE};
+            lex_nodes_push(&module->decls, (lex_node){.kind = NODE_DEF, .data = MALLOC(&def)});
+        }
+        else if (!strcmp(kind, "fn")) {
+            lex_node_fn fn = {.name = module_strdup(name), .type = type, .slot = SYM_NONE};
+            lex_nodes_init(&fn.params);
+            while (ok && (spelling = strtok_r(NULL, " ", &words))) {
+                lex_node_fn_param param = {.slot = SYM_NONE};
+                name = strtok_r(NULL, " ", &words);
+                if (name == NULL || !module_type(spelling, &param.type)) {
+                    ok = false;
+                    break;
+                }
+                param.name = module_strdup(name);
+                lex_nodes_push(&fn.params, (lex_node){.kind = NODE_FUNCTION_PARAM, .data = MALLOC(&param)});
+            }
+            lex_nodes_push(&module->decls, (lex_node){.kind = NODE_FUNCTION, .data = MALLOC(&fn)});
+        }
+        else {
+            ok = false;
+        }
+    }
+    node_arena = previous;
+    return ok ? module : NULL;
+}
+
+// Publishes an interface for later runs, renamed into place so that readers never see part of it
+static void module_store(const module_cache* cache, uint64_t hash, const str_t* text) {
+    char path[PATH_MAX];
+    char tmp[PATH_MAX];
+    snprintf(path, sizeof(path), "%s/%016llx.spli", cache->dir, (unsigned long long)hash);
+    snprintf(tmp, sizeof(tmp), "%s/%016llx.%ld.%lx.tmp", cache->dir, (unsigned long long)hash, (long)getpid(), (unsigned long)pthread_self());
+    mkdir(cache->dir, 0777);
+
+    FILE* f = fopen(tmp, "wb");
+    if (f == NULL)
+        return;
+    const bool ok = fwrite(str_data(text), 1, str_len(text), f) == str_len(text);
+    if (fclose(f) || !ok || rename(tmp, path))
+        unlink(tmp);
+}
+
+// Parses a module that no cache knows about yet and keeps its interface
+static module_interface* module_parse(module_cache* cache, uint64_t hash, const char* source, lex_node_import* import) {
+    arena scratch = {0};
+    arena* previous = node_arena;
+    node_arena = &scratch;
+    Tokens tokens;
+    tokens_init(&tokens);
+    tokenize(source, &tokens);
+    const lex_result result = lex(&tokens, NULL);
+    node_arena = previous;
+
+    module_interface* module = NULL;
+    if (!result.status) {
+        import->syntax_error = result.result.error.message;
+    }
+    else {
+        str_t text;
+        str_init(&text);
+        module_interface_text(result.result.node.data, &text);
+        if (cache->dir)
+            module_store(cache, hash, &text);
+
+        pthread_mutex_lock(&cache->lock);
+        module = module_cache_find(cache, hash);
+        if (!module && (module = module_interface_read(cache, hash, str_data(&text))))
+            module_cache_put(cache, module);
+        pthread_mutex_unlock(&cache->lock);
+        str_free(&text);
+
+        if (module == NULL)
+            import->syntax_error = "Malformed module interface";
+        cache->parsed++;
+    }
+    tokens_free(&tokens);
+    arena_free(&scratch);
+    return module;
+}
+
+// Finds the interface of the module at `path` in memory, then on disk, and only parses it when neither has it
+static void module_import(lex_node_import* import, const char* path) {
+    module_cache* cache = &global_modules;
+    cache->imports++;
+
+    size_t len;
+    char* source = read_file(NULL, path, &len);
+    if (source == NULL) {
+        import->error = errno;
+        return;
+    }
+    const uint64_t hash = hash_bytes(source, len);
+    import->hash = hash;
+
+    pthread_mutex_lock(&cache->lock);
+    module_interface* module = module_cache_find(cache, hash);
+    pthread_mutex_unlock(&cache->lock);
+
+    if (module == NULL && cache->dir) {
+        char cached[PATH_MAX];
+        snprintf(cached, sizeof(cached), "%s/%016llx.spli", cache->dir, (unsigned long long)hash);
+        char* text = read_file(NULL, cached, NULL);
+        if (text) {
+            pthread_mutex_lock(&cache->lock);
+            module = module_cache_find(cache, hash);
+            if (!module && (module = module_interface_read(cache, hash, text))) {
+                module_cache_put(cache, module);
+                cache->from_disk++;
+            }
+            pthread_mutex_unlock(&cache->lock);
+            free(text);
+        }
+    }
+
+    if (module == NULL)
+        module = module_parse(cache, hash, source, import);
+    free(source);
+    import->module = module;
+}
+
+// Why an import could not be loaded
+static inline const char* module_error(const lex_node_import* import) {
+    return import->syntax_error ? import->syntax_error : strerror(import->error);
+}
+
+typedef struct {
+    lex_node_import** imports;
+    char** paths;
+} module_load_ctx;
+
+static void module_task(void* arg, size_t index, unsigned worker) {
+    (void)worker;
+    module_load_ctx* ctx = arg;
+    module_import(ctx->imports[index], ctx->paths[index]);
+}
+
+// Loads every module imported by `root`, in parallel when a pool is given, returns how many failed
+// Paths are relative to the directory of `importer`, whose own imports are not followed
+size_t module_load_imports(lex_node root, const char* importer, thread_pool* pool) {
+    const lex_node_root* data = root.data;
+    module_load_ctx ctx = {0};
+    size_t len = 0;
+    for (size_t i = 0; i < data->children.len; i++) {
+        if (data->children.nodes[i].kind != NODE_IMPORT)
+            continue;
+        if (!ctx.imports) {
+            ctx.imports = (lex_node_import**)malloc(sizeof(lex_node_import*)*data->children.len);
+            ctx.paths = (char**)malloc(sizeof(char*)*data->children.len);
+        }
+        lex_node_import* import = data->children.nodes[i].data;
+        const char* slash = strrchr(importer, '/');
+        const size_t dir = import->path[0] == '/' || slash == NULL ? 0 : slash-importer+1;
+        ctx.paths[len] = (char*)node_alloc(dir+strlen(import->path)+1);
+        memcpy(ctx.paths[len], importer, dir);
+        strcpy(ctx.paths[len]+dir, import->path);
+        import->file = ctx.paths[len];
+        ctx.imports[len++] = import;
+    }
+    if (!len)
+        return 0;
+
+    if (pool && len > 1)
+        pool_run(pool, len, module_task, &ctx);
+    else
+        for (size_t i = 0; i < len; i++)
+            module_task(&ctx, i, 0);
+
+    size_t failed = 0;
+    for (size_t i = 0; i < len; i++)
+        failed += ctx.imports[i]->module == NULL;
+    free(ctx.imports);
+    free(ctx.paths);
+    return failed;
+}
+
+// Files a compiled source imported and the hash of what was read from each, tells when a result went stale
+typedef struct {
+    char** files;
+    uint64_t* hashes;
+    size_t len;
+} module_deps;
+
+void module_deps_free(module_deps* deps) {
+    for (size_t i = 0; i < deps->len; i++)
+        free(deps->files[i]);
+    free(deps->files);
+    free(deps->hashes);
+    memset(deps, 0, sizeof(module_deps));
+}
+
+// Records the imports of a loaded root
+void module_deps_collect(module_deps* deps, lex_node root) {
+    const lex_node_root* data = root.data;
+    for (size_t i = 0; i < data->children.len; i++) {
+        const lex_node_import* import = data->children.nodes[i].data;
+        if (data->children.nodes[i].kind != NODE_IMPORT || import->file == NULL)
+            continue;
+        deps->files = (char**)realloc(deps->files, sizeof(char*)*(deps->len+1));
+        deps->hashes = (uint64_t*)realloc(deps->hashes, sizeof(uint64_t)*(deps->len+1));
+        deps->files[deps->len] = strdup(import->file);
+        deps->hashes[deps->len++] = import->hash;
+    }
+}
+
+// Whether every file still holds what it did when `deps` was collected
+bool module_deps_current(const module_deps* deps) {
+    for (size_t i = 0; i < deps->len; i++) {
+        size_t len;
+        char* source = read_file(NULL, deps->files[i], &len);
+        const uint64_t hash = source ? hash_bytes(source, len) : 0;
+        free(source);
+        if (hash != deps->hashes[i])
+            return false;
+    }
+    return true;
+}
+
+typedef struct {
+    size_t bytes;
+    size_t tokens;
+    size_t forms;
+    size_t errors;
+    size_t ir_insts;
+    size_t inlined;      // calls
+    size_t pruned;       // nodes unreachable from PRUNE_ENTRY_DEFAULT
+    size_t pruned_bytes;
+} compile_stats;
+
+typedef enum {
+    COMPILE_DUMP_IR = 1,
+} compile_flags;
+
+// Runs every pass over one source and appends its diagnostics to `out` as `path:line:col: message` lines
+// Tokens and AST come from node_arena when the caller set one, otherwise they are never released
+// `names` may be kept by the caller across sources, a fresh table is used when it is NULL
+// `deps`, when not NULL, gets the modules the source imported
+bool compile_source(const char* path, const char* source, Tokens* tokens, intern_table* names, unsigned flags, str_t* out, compile_stats* stats, module_deps* deps) {
+    const size_t errors = stats->errors;
+
+    tokens->len = 0;
+    tokenize(source, tokens);
+    stats->bytes += strlen(source);
+    stats->tokens += tokens->len;
+
+    diagnostics syntax_errors;
+    diagnostics_init(&syntax_errors);
+    lex_result result = lex(tokens, &syntax_errors);
+    for (size_t i = 0; i < syntax_errors.len; i++)
+        str_printf(out, "%s:%zu:%zu: syntax error: %s\n", path, syntax_errors.items[i].l+1, syntax_errors.items[i].c, syntax_errors.items[i].message);
+    stats->errors += syntax_errors.len;
+    diagnostics_free(&syntax_errors);
+    if (!result.status)
+        return false;
+    lex_node_root* root = result.result.node.data;
+    stats->forms += root->children.len;
+
+    const size_t failed = module_load_imports(result.result.node, path, NULL);
+    if (deps)
+        module_deps_collect(deps, result.result.node);
+    if (failed) {
+        for (size_t i = 0; i < root->children.len; i++) {
+            const lex_node_import* import = root->children.nodes[i].data;
+            if (root->children.nodes[i].kind != NODE_IMPORT || import->module)
+                continue;
+            str_printf(out, "%s:%zu:%zu: Could not import '%s': %s\n", path, import->l+1, import->c, import->path, module_error(import));
+            stats->errors++;
+        }
+    }
+
+    intern_table local_names;
+    if (names == NULL) {
+        intern_init(&local_names);
+        names = &local_names;
+    }
+    sym_table symbols;
+    sym_init(&symbols, names);
+
+    resolve_ast(&symbols, result.result.node);
+    for (uint32_t i = 0; i < symbols.unresolved_len; i++) {
+        const lex_node_name* name = symbols.unresolved[i];
+        str_printf(out, "%s:%zu:%zu: Undefined name '%s'\n", path, name->l+1, name->c, name->name);
+    }
+    stats->errors += symbols.unresolved_len;
+
+    diagnostics diags;
+    diagnostics_init(&diags);
+    stats->errors += check_ast(result.result.node, &symbols, NULL, &diags);
+    for (size_t i = 0; i < diags.len; i++)
+        str_printf(out, "%s:%zu:%zu: %s\n", path, diags.items[i].l+1, diags.items[i].c, diags.items[i].message);
+    diagnostics_free(&diags);
+
+    inline_stats inlined = {0};
+    inline_ast(result.result.node, &symbols, INLINE_BUDGET_DEFAULT, &inlined);
+    stats->inlined += inlined.calls;
+
+    prune_stats pruned = {0};
+    prune_ast(result.result.node, &symbols, PRUNE_ENTRY_DEFAULT, &pruned);
+    stats->pruned += pruned.nodes;
+    stats->pruned_bytes += pruned.bytes;
+
+    fold_ast(result.result.node);
+    cse_ast(result.result.node, names);
+
+    char* dump = NULL;
+    size_t dump_len = 0;
+    FILE* dump_file = (flags & COMPILE_DUMP_IR) ? open_memstream(&dump, &dump_len) : NULL;
+
+    for (size_t i = 0; i < root->children.len; i++) {
+        if (root->children.nodes[i].kind != NODE_FUNCTION)
+            continue;
+        ir_fn ir;
+        if (ir_lower_fn(root->children.nodes[i].data, &ir)) {
+            str_printf(out, "%s: could not lower '%s': %s\n", path, ir.name, ir.error);
+            stats->errors++;
+        }
+        else if (dump_file)
+            ir_dump(dump_file, &ir);
+        stats->ir_insts += ir.insts_len;
+        ir_free(&ir);
+    }
+
+    if (dump_file) {
+        fclose(dump_file);
+        str_append(out, dump, dump_len);
+        free(dump);
+    }
+
+    sym_free(&symbols);
+    if (names == &local_names)
+        intern_free(&local_names);
+    return stats->errors == errors;
+}
+
+typedef struct {
+    arena arena;  // tokens, AST and source of the file being compiled
+    str_t out;    // diagnostics of every file this worker compiled
+    Tokens tokens;
+    intern_table names;
+    compile_stats stats;
+    size_t files;
+    size_t arena_peak;
+} batch_worker;
+
+typedef struct {
+    const char** paths;
+    size_t len;
+    batch_worker* workers;
+    unsigned* file_worker; // where the output of each file lives
+    size_t* file_start;
+    size_t* file_len;
+} batch_ctx;
+
+static void batch_task(void* arg, size_t index, unsigned worker) {
+    batch_ctx* ctx = arg;
+    batch_worker* w = &ctx->workers[worker];
+    const char* path = ctx->paths[index];
+    const size_t start = str_len(&w->out);
+
+    node_arena = &w->arena;
+    char* source = read_file(&w->arena, path, NULL);
+    if (source == NULL) {
+        str_printf(&w->out, "%s: could not read: %s\n", path, strerror(errno));
+        w->stats.errors++;
+    }
+    else
+        compile_source(path, source, &w->tokens, &w->names, 0, &w->out, &w->stats, NULL);
+    if (w->arena.used > w->arena_peak)
+        w->arena_peak = w->arena.used;
+    arena_reset(&w->arena);
+    node_arena = NULL;
+
+    w->files++;
+    ctx->file_worker[index] = worker;
+    ctx->file_start[index] = start;
+    ctx->file_len[index] = str_len(&w->out)-start;
+}
+
+// Adds the paths listed one per line in a response file
+static bool batch_read_list(const char* path, const char*** paths, size_t* len, size_t* cap) {
+    char* list = read_file(NULL, path, NULL);
+    if (list == NULL)
+        return false;
+    for (char* line = strtok(list, "\r\n"); line; line = strtok(NULL, "\r\n")) {
+        if (!*line)
+            continue;
+        if (*len >= *cap) {
+            *cap *= 2;
+            *paths = (const char**)realloc(*paths, sizeof(const char*)**cap);
+        }
+        (*paths)[(*len)++] = line;
+    }
+    return true;
+}
+
+// Compiles many files on a work-stealing pool, outputs are printed in the order the files were given
+int batch_main(int argc, const char** argv) {
+    unsigned jobs = 0;
+    size_t cap = 64;
+    size_t len = 0;
+    const char** paths = (const char**)malloc(sizeof(const char*)*cap);
+
+    while (argc > 0) {
+        const char* arg = shift_args(&argc, &argv);
+        if (!strcmp(arg, "-j") && argc > 0) {
+            jobs = atoi(shift_args(&argc, &argv));
+            continue;
+        }
+        if (arg[0] == '@') {
+            if (!batch_read_list(arg+1, &paths, &len, &cap)) {
+                printf("Could not read %s: %s\n", arg+1, strerror(errno));
+                return 1;
+            }
+            continue;
+        }
+        if (len >= cap) {
+            cap *= 2;
+            paths = (const char**)realloc(paths, sizeof(const char*)*cap);
+        }
+        paths[len++] = arg;
+    }
+
+    thread_pool pool;
+    pool_init(&pool, jobs);
+
+    const unsigned workers = pool_workers(&pool);
+    batch_ctx ctx = {
+        .paths = paths,
+        .len = len,
+        .workers = (batch_worker*)calloc(workers, sizeof(batch_worker)),
+        .file_worker = (unsigned*)malloc(sizeof(unsigned)*(len+1)),
+        .file_start = (size_t*)malloc(sizeof(size_t)*(len+1)),
+        .file_len = (size_t*)malloc(sizeof(size_t)*(len+1)),
+    };
+    for (unsigned i = 0; i < workers; i++) {
+        tokens_init(&ctx.workers[i].tokens);
+        intern_init(&ctx.workers[i].names);
+    }
+
+    const double start = now_seconds();
+    pool_run(&pool, len, batch_task, &ctx);
+    const double elapsed = now_seconds()-start;
+
+    for (size_t i = 0; i < len; i++)
+        fwrite(str_data(&ctx.workers[ctx.file_worker[i]].out)+ctx.file_start[i], 1, ctx.file_len[i], stdout);
+
+    compile_stats total = {0};
+    for (unsigned i = 0; i < workers; i++) {
+        const compile_stats st = ctx.workers[i].stats;
+        total.bytes += st.bytes;
+        total.tokens += st.tokens;
+        total.forms += st.forms;
+        total.errors += st.errors;
+        total.ir_insts += st.ir_insts;
+        total.inlined += st.inlined;
+        total.pruned += st.pruned;
+        total.pruned_bytes += st.pruned_bytes;
+    }
+
+    printf("batch: %zu files, %.2f MB, %zu tokens, %zu forms, %zu IR instructions, %zu errors\n",
+        len, total.bytes/1e6, total.tokens, total.forms, total.ir_insts, total.errors);
+    printf("batch: %.3f s on %u workers, %.0f files/s, %.2f MB/s, %.2f M tokens/s\n",
+        elapsed, workers, len/elapsed, total.bytes/1e6/elapsed, total.tokens/1e6/elapsed);
+    if (total.inlined)
+        printf("batch: inlined %zu calls\n", total.inlined);
+    if (total.pruned)
+        printf("batch: pruned %zu nodes, %.1f KB unreachable from '%s'\n", total.pruned, total.pruned_bytes/1e3, PRUNE_ENTRY_DEFAULT);
+    if (global_modules.imports)
+        printf("batch: %zu imports, %zu modules parsed, %zu from the interface cache\n",
+            (size_t)global_modules.imports, (size_t)global_modules.parsed, (size_t)global_modules.from_disk);
+    if (global_literals.refs)
+        printf("batch: %zu string literals pooled as %u distinct, %.1f KB\n",
+            (size_t)global_literals.refs, global_literals.len, global_literals.data_len/1024.0);
+    for (unsigned i = 0; i < workers; i++)
+        printf("  worker %u: %zu files, %zu steals, %.1f KB arena peak\n",
+            i, ctx.workers[i].files, pool.ranges[i].steals, ctx.workers[i].arena_peak/1e3);
+
+    for (unsigned i = 0; i < workers; i++) {
+        arena_free(&ctx.workers[i].arena);
+        str_free(&ctx.workers[i].out);
+        tokens_free(&ctx.workers[i].tokens);
+        intern_free(&ctx.workers[i].names);
+    }
+    free(ctx.workers);
+    free(ctx.file_worker);
+    free(ctx.file_start);
+    free(ctx.file_len);
+    free(paths);
+    pool_free(&pool);
+    return total.errors != 0;
+}
+
+typedef enum {
+    SERVER_COMPILE = 1,
+    SERVER_STATS,
+    SERVER_QUIT,
+} server_request_kind;
+
+// Sent by the client, followed by the path and the source
+typedef struct {
+    uint32_t kind;  // server_request_kind
+    uint32_t flags; // compile_flags
+    uint32_t path_len;
+    uint32_t pad;
+    uint64_t source_len;
+} server_request;
+
+// Sent by the server, followed by `len` bytes of diagnostics or dumps
+typedef struct {
+    uint32_t status; // 0 when the source compiled without errors
+    uint32_t cached;
+    uint64_t len;
+} server_response;
+
+typedef struct {
+    uint64_t key; // hash of the source, path and flags, 0 is empty
+    uint32_t status;
+    char* text;
+    size_t len;
+    module_deps deps; // the result only holds while the imported modules are unchanged
+} server_cache_entry;
+
+// State that stays warm between requests
+typedef struct {
+    arena arena;
+    Tokens tokens;
+    intern_table names;
+
+    server_cache_entry* cache; // Open addressing on the key
+    size_t cache_len;
+    size_t cache_cap;
+
+    size_t requests;
+    size_t hits;
+    double compile_time;
+} compile_server;
+
+static bool io_write_all(int fd, const void* data, size_t len) {
+    const char* p = data;
+    while (len) {
+        const ssize_t n = write(fd, p, len);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            return false;
+        p += n;
+        len -= n;
+    }
+    return true;
+}
+
+static bool io_read_all(int fd, void* data, size_t len) {
+    char* p = data;
+    while (len) {
+        const ssize_t n = read(fd, p, len);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            return false;
+        p += n;
+        len -= n;
+    }
+    return true;
+}
+
+static bool server_respond(int fd, uint32_t status, bool cached, const char* text, size_t len) {
+    const server_response response = {.status = status, .cached = cached, .len = len};
+    return io_write_all(fd, &response, sizeof(response)) && io_write_all(fd, text, len);
+}
+
+static server_cache_entry* server_cache_find(compile_server* server, uint64_t key) {
+    size_t s = key & (server->cache_cap-1);
+    while (server->cache[s].key && server->cache[s].key != key)
+        s = (s+1) & (server->cache_cap-1);
+    return &server->cache[s];
+}
+
+static void server_cache_put(compile_server* server, uint64_t key, uint32_t status, char* text, size_t len, module_deps deps) {
+    if ((server->cache_len+1)*2 > server->cache_cap) {
+        server_cache_entry* old = server->cache;
+        const size_t cap = server->cache_cap;
+        // Past the limit the cache starts over instead of growing
+        const bool full = cap >= SERVER_CACHE_MAX;
+        server->cache_cap = full ? cap : cap*2;
+        server->cache = (server_cache_entry*)calloc(server->cache_cap, sizeof(server_cache_entry));
+        server->cache_len = 0;
+        for (size_t i = 0; i < cap; i++) {
+            if (!old[i].key)
+                continue;
+            if (full) {
+                free(old[i].text);
+                module_deps_free(&old[i].deps);
+            }
+            else {
+                *server_cache_find(server, old[i].key) = old[i];
+                server->cache_len++;
+            }
+        }
+        free(old);
+    }
+    *server_cache_find(server, key) = (server_cache_entry){.key = key, .status = status, .text = text, .len = len, .deps = deps};
+    server->cache_len++;
+}
+
+// Handles the requests of one connection until the client hangs up, returns false on SERVER_QUIT
+static bool server_serve(compile_server* server, int fd) {
+    server_request request;
+    while (io_read_all(fd, &request, sizeof(request))) {
+        if (request.kind == SERVER_QUIT) {
+            server_respond(fd, 0, false, "", 0);
+            return false;
+        }
+
+        if (request.kind == SERVER_STATS) {
+            str_t text = {0};
+            str_printf(&text, "%zu requests, %zu cache hits, %zu cached results, %.3f ms compiling\n",
+                server->requests, server->hits, server->cache_len, server->compile_time*1e3);
+            server_respond(fd, 0, false, str_data(&text), str_len(&text));
+            str_free(&text);
+            continue;
+        }
+
+        // Lengths come from the client, one past the limits drops the connection before anything is allocated
+        if (request.kind != SERVER_COMPILE || request.path_len >= SERVER_PATH_MAX || request.source_len > SERVER_SOURCE_MAX)
+            return true;
+
+        node_arena = &server->arena;
+        char* path = (char*)arena_alloc(&server->arena, request.path_len+1);
+        char* source = (char*)arena_alloc(&server->arena, request.source_len+1);
+        if (!io_read_all(fd, path, request.path_len) || !io_read_all(fd, source, request.source_len)) {
+            arena_reset(&server->arena);
+            node_arena = NULL;
+            return true;
+        }
+        path[request.path_len] = 0;
+        source[request.source_len] = 0;
+        // Imports resolve against the path and it is part of the cache key, so it has to be absolute
+        if (path[0] != '/') {
+            arena_reset(&server->arena);
+            node_arena = NULL;
+            return true;
+        }
+        server->requests++;
+
+        uint64_t key = hash_mix(hash_bytes(source, request.source_len), hash_bytes(path, request.path_len));
+        key = hash_mix(key, request.flags) | 1;
+
+        // The key only covers the source itself, a result goes stale as soon as one of its imports changes
+        server_cache_entry* entry = server_cache_find(server, key);
+        if (entry->key && module_deps_current(&entry->deps)) {
+            server->hits++;
+            server_respond(fd, entry->status, true, entry->text, entry->len);
+        }
+        else {
+            str_t out = {0};
+            compile_stats stats = {0};
+            module_deps deps = {0};
+            const double start = now_seconds();
+            const bool ok = compile_source(path, source, &server->tokens, &server->names, request.flags, &out, &stats, &deps);
+            server->compile_time += now_seconds()-start;
+            const size_t len = str_len(&out);
+            char* text = str_release(&out);
+            if (entry->key) {
+                free(entry->text);
+                module_deps_free(&entry->deps);
+                *entry = (server_cache_entry){.key = key, .status = !ok, .text = text, .len = len, .deps = deps};
+            }
+            else
+                server_cache_put(server, key, !ok, text, len, deps);
+            server_respond(fd, !ok, false, text, len);
+        }
+
+        arena_reset(&server->arena);
+        node_arena = NULL;
+    }
+    return true;
+}
+
+// Keeps a compiler resident behind a Unix domain socket
+int server_main(const char* socket_path) {
+    const int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    TRY( fd < 0, "Could not create socket: " );
+
+    struct sockaddr_un addr = {.sun_family = AF_UNIX};
+    if (strlen(socket_path) >= sizeof(addr.sun_path)) {
+        printf("Socket path too long: %s\n", socket_path);
+        return 1;
+    }
+    strcpy(addr.sun_path, socket_path);
+    unlink(socket_path);
+    TRY( bind(fd, (struct sockaddr*)&addr, sizeof(addr)), "Could not bind %s: ", socket_path );
+    TRY( listen(fd, 16), "Could not listen: " );
+    signal(SIGPIPE, SIG_IGN);
+
+    compile_server server = {
+        .cache_cap = SERVER_CACHE_CAPACITY_DEFAULT,
+        .cache = (server_cache_entry*)calloc(SERVER_CACHE_CAPACITY_DEFAULT, sizeof(server_cache_entry)),
+    };
+    tokens_init(&server.tokens);
+    intern_init(&server.names);
+
+    printf("listening on %s\n", socket_path);
+    fflush(stdout);
+
+    for (bool running = true; running;) {
+        const int client = accept(fd, NULL, NULL);
+        if (client < 0) {
+            if (errno == EINTR)
+                continue;
+            ERR("Could not accept: ");
+        }
+        running = server_serve(&server, client);
+        close(client);
+    }
+
+    printf("served %zu requests, %zu cache hits\n", server.requests, server.hits);
+    close(fd);
+    unlink(socket_path);
+
+    for (size_t i = 0; i < server.cache_cap; i++) {
+        free(server.cache[i].text);
+        module_deps_free(&server.cache[i].deps);
+    }
+    free(server.cache);
+    arena_free(&server.arena);
+    tokens_free(&server.tokens);
+    intern_free(&server.names);
+    return 0;
+}
+
+static int client_connect(const char* socket_path) {
+    const int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (fd < 0)
+        return -1;
+    struct sockaddr_un addr = {.sun_family = AF_UNIX};
+    strncpy(addr.sun_path, socket_path, sizeof(addr.sun_path)-1);
+    if (connect(fd, (struct sockaddr*)&addr, sizeof(addr))) {
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+// Sends one request and reads the response text into `out`, which is replaced
+static bool client_request(int fd, server_request_kind kind, unsigned flags, const char* path, const char* source, size_t source_len, server_response* response, str_t* out) {
+    const server_request request = {
+        .kind = kind,
+        .flags = flags,
+        .path_len = path ? strlen(path) : 0,
+        .source_len = source_len,
+    };
+    if (
+        !io_write_all(fd, &request, sizeof(request)) ||
+        !io_write_all(fd, path, request.path_len) ||
+        !io_write_all(fd, source, source_len) ||
+        !io_read_all(fd, response, sizeof(server_response))
+    )
+        return false;
+    str_set_len(out, 0);
+    str_reserve(out, response->len);
+    if (!io_read_all(fd, str_data(out), response->len))
+        return false;
+    str_set_len(out, response->len);
+    return true;
+}
+
+// Sends files to a running server and prints what it answers
+int client_main(const char* socket_path, int argc, const char** argv) {
+    const int fd = client_connect(socket_path);
+    TRY( fd < 0, "Could not connect to %s: ", socket_path );
+
+    unsigned flags = 0;
+    int status = 0;
+    str_t out = {0};
+    server_response response;
+
+    while (argc > 0) {
+        const char* arg = shift_args(&argc, &argv);
+        if (!strcmp(arg, "--dump")) {
+            flags |= COMPILE_DUMP_IR;
+            continue;
+        }
+        if (!strcmp(arg, "--stats") || !strcmp(arg, "--quit")) {
+            const server_request_kind kind = arg[2] == 's' ? SERVER_STATS : SERVER_QUIT;
+            if (!client_request(fd, kind, 0, NULL, NULL, 0, &response, &out)) {
+                printf("Lost connection to %s\n", socket_path);
+                return 1;
+            }
+            fwrite(str_data(&out), 1, str_len(&out), stdout);
+            continue;
+        }
+
+        // The server runs in another directory, so it gets the canonical path
+        size_t len;
+        char* path = realpath(arg, NULL);
+        char* source = path ? read_file(NULL, path, &len) : NULL;
+        if (source == NULL) {
+            printf("Could not read %s: %s\n", arg, strerror(errno));
+            free(path);
+            status = 1;
+            continue;
+        }
+        if (len > SERVER_SOURCE_MAX) {
+            printf("%s is too large for the server, the limit is %d bytes\n", arg, SERVER_SOURCE_MAX);
+            free(source);
+            free(path);
+            status = 1;
+            continue;
+        }
+        const bool sent = client_request(fd, SERVER_COMPILE, flags, path, source, len, &response, &out);
+        free(source);
+        free(path);
+        if (!sent) {
+            printf("Lost connection to %s\n", socket_path);
+            return 1;
+        }
+        fwrite(str_data(&out), 1, str_len(&out), stdout);
+        status |= response.status;
+    }
+
+    str_free(&out);
+    close(fd);
+    return status;
+}
+
+static int cmp_double(const void* a, const void* b) {
+    const double x = *(const double*)a, y = *(const double*)b;
+    return x < y ? -1 : x > y;
+}
+
+static void bench_report(const char* label, double* samples, size_t n) {
+    double sum = 0;
+    for (size_t i = 0; i < n; i++)
+        sum += samples[i];
+    qsort(samples, n, sizeof(double), cmp_double);
+    printf("  %-16s mean %9.1f us, p50 %9.1f us, p99 %9.1f us\n",
+        label, sum/n*1e6, samples[n/2]*1e6, samples[n*99/100]*1e6);
+}
+
+// Compares the latency of a request to the server with the one of starting a new process
+int client_bench_main(const char* socket_path, const char* path, size_t n) {
+    const int fd = client_connect(socket_path);
+    TRY( fd < 0, "Could not connect to %s: ", socket_path );
+
+    size_t len;
+    char* source = read_file(NULL, path, &len);
+    TRY( source == NULL, "Could not read %s: ", path );
+    char* canonical = realpath(path, NULL);
+    TRY( canonical == NULL, "Could not resolve %s: ", path );
+
+    double* samples = (double*)malloc(sizeof(double)*n);
+    str_t out = {0};
+    str_t unique = {0};
+    server_response response;
+
+    printf("%zu requests for %s (%zu bytes):\n", n, path, len);
+
+    // Same content every time, answered from the cache
+    for (size_t i = 0; i < n; i++) {
+        const double start = now_seconds();
+        TRY( !client_request(fd, SERVER_COMPILE, 0, canonical, source, len, &response, &out), "Lost connection: " );
+        samples[i] = now_seconds()-start;
+    }
+    bench_report("server, cached", samples, n);
+
+    // A trailing comment makes every request miss the cache
+    for (size_t i = 0; i < n; i++) {
+        str_set_len(&unique, 0);
+        str_append(&unique, source, len);
+        str_printf(&unique, "\n(; %zu ;)\n", i);
+        const double start = now_seconds();
+        TRY( !client_request(fd, SERVER_COMPILE, 0, canonical, str_data(&unique), str_len(&unique), &response, &out), "Lost connection: " );
+        samples[i] = now_seconds()-start;
+    }
+    bench_report("server, compiled", samples, n);
+
+    posix_spawn_file_actions_t actions;
+    posix_spawn_file_actions_init(&actions);
+    posix_spawn_file_actions_addopen(&actions, 1, "/dev/null", O_WRONLY, 0);
+    char* const args[] = {"/proc/self/exe", "--batch", "-j", "1", (char*)path, NULL};
+    extern char** environ;
+    for (size_t i = 0; i < n; i++) {
+        const double start = now_seconds();
+        pid_t pid;
+        TRY( posix_spawn(&pid, "/proc/self/exe", &actions, NULL, args, environ), "Could not spawn: " );
+        waitpid(pid, NULL, 0);
+        samples[i] = now_seconds()-start;
+    }
+    bench_report("fresh process", samples, n);
+    posix_spawn_file_actions_destroy(&actions);
+
+    free(samples);
+    free(source);
+    free(canonical);
+    str_free(&out);
+    str_free(&unique);
+    close(fd);
+    return 0;
+}
+
+// A top-level form of a watched file, kept parsed until its text changes
+// Positions in its tree and diagnostics are relative to the form so that moving it costs nothing
+typedef struct {
+    size_t start;      // offset of the `(` opening it, or of stray text outside of any form
+    size_t len;
+    size_t line;
+    size_t col;        // of its first character, positions on the first line are offset by it
+    bool open;         // runs until the end of the file without being closed
+    bool parsed;       // since the last check
+    uint64_t decls;    // hash of the top-level declarations it makes
+    arena arena;       // tokens and AST of the form
+    lex_nodes nodes;   // top-level nodes it parsed to
+    const char* error; // syntax error, nodes is empty then
+    diagnostics diags; // found the last time it was checked
+} watch_form;
+
+// A file given to --watch, events come from the watch on its directory so that editors replacing it are seen
+typedef struct {
+    const char* path;
+    const char* name;
+    int wd;
+    bool dirty;
+    char* source; // contents the forms were split from
+    size_t source_len;
+    uint64_t decls;
+    sym_table symbols; // top-level declarations in the global scope, then the locals of the last check
+    uint32_t globals;
+    watch_form* forms;
+    size_t len;
+    size_t cap;
+} watch_file;
+
+static void watch_push(watch_form** forms, size_t* len, size_t* cap, watch_form form) {
+    if (*len >= *cap) {
+        *cap = *cap ? *cap*2 : LEX_NODES_CAPACITY_DEFAULT;
+        *forms = (watch_form*)realloc(*forms, sizeof(watch_form)*(*cap));
+    }
+    (*forms)[(*len)++] = form;
+}
+
+static void watch_form_free(watch_form* form) {
+    arena_free(&form->arena);
+    diagnostics_free(&form->diags);
+}
+
+// Splits `source` into top-level forms from `i`, which must not be inside of one, until a form starts at an
+// offset `resync` accepts, returns that offset or `len`
+static size_t watch_split(const char* source, size_t len, size_t i, size_t line, size_t line_start,
+        watch_form** forms, size_t* count, size_t* cap, bool (*resync)(void*, size_t), void* ctx) {
+    size_t depth = 0;
+    bool junk = false; // the last form is stray text that runs until the next one
+
+    for (; i < len; i++) {
+        const char c = source[i];
+
+        if (c == '\n') {
+            line++;
+            line_start = i+1;
+            continue;
+        }
+
+        if (c == '(' && i+1 < len && source[i+1] == ';') {
+            for (i += 2; i+1 < len && !(source[i] == ';' && source[i+1] == ')'); i++) {
+                if (source[i] == '\n') {
+                    line++;
+                    line_start = i+1;
+                }
+            }
+            i++;
+            continue;
+        }
+
+        if (depth == 0) {
+            if (c == '(') {
+                if (junk) {
+                    (*forms)[*count-1].len = i-(*forms)[*count-1].start;
+                    (*forms)[*count-1].open = false;
+                }
+                if (resync(ctx, i))
+                    return i;
+                watch_push(forms, count, cap, (watch_form){
+                    .start = i,
+                    .len = len-i,
+                    .line = line,
+                    .col = i-line_start+1,
+                    .open = true,
+                });
+                depth = 1;
+                junk = false;
+            }
+            else if (c != ' ' && c != '\t' && c != '\r' && !junk) {
+                watch_push(forms, count, cap, (watch_form){
+                    .start = i,
+                    .len = len-i,
+                    .line = line,
+                    .col = i-line_start+1,
+                    .open = true,
+                    .error = "Expected an instruction",
+                });
+                junk = true;
+            }
+            continue;
+        }
+
+        if (c == '"') {
+            for (i++; i < len && source[i] != '"'; i++) {
+                if (source[i] == '\\')
+                    i++;
+                else if (source[i] == '\n') {
+                    line++;
+                    line_start = i+1;
+                }
+            }
+        }
+        else if (c == '(')
+            depth++;
+        else if (c == ')' && --depth == 0) {
+            watch_form* form = &(*forms)[*count-1];
+            form->len = i+1-form->start;
+            form->open = false;
+        }
+    }
+    return len;
+}
+
+static void watch_parse(watch_form* form, const char* path, char* source, Tokens* tokens) {
+    form->arena = (arena){.chunk = WATCH_FORM_CHUNK};
+    form->parsed = true;
+    diagnostics_init(&form->diags);
+    if (form->error)
+        return;
+    node_arena = &form->arena;
+
+    char* end = source+form->start+form->len;
+    const char c = *end;
+    *end = 0;
+    tokens->len = 0;
+    tokenize(source+form->start, tokens);
+    *end = c;
+
+    lex_result result = lex(tokens, NULL);
+    if (result.status)
+        form->nodes = ((lex_node_root*)result.result.node.data)->children;
+    else
+        form->error = result.result.error.message;
+    // Resolved import paths go in the form's arena so a reparse lets go of them
+    if (result.status)
+        module_load_imports(result.result.node, path, NULL);
+    node_arena = NULL;
+
+    // What other forms can see of this one, bodies are left out since nothing outside depends on them
+    form->decls = 0;
+    for (size_t i = 0; i < form->nodes.len; i++) {
+        const lex_node node = form->nodes.nodes[i];
+        uint64_t h = hash_mix(form->decls, node.kind);
+        if (node.kind == NODE_FUNCTION) {
+            const lex_node_fn* fn = node.data;
+            h = hash_mix(hash_mix(h, hash_bytes(fn->name, strlen(fn->name))), fn->type.id);
+            for (size_t j = 0; j < fn->params.len; j++)
+                h = hash_mix(h, ((lex_node_fn_param*)fn->params.nodes[j].data)->type.id);
+        }
+        else if (node.kind == NODE_DEF) {
+            const lex_node_def* def = node.data;
+            h = hash_mix(hash_mix(h, hash_bytes(def->name, strlen(def->name))), def->type.id);
+        }
+        else if (node.kind == NODE_IMPORT) {
+            const lex_node_import* import = node.data;
+            h = hash_mix(hash_mix(h, hash_bytes(import->path, strlen(import->path))), import->module ? import->module->hash : 0);
+        }
+        form->decls = h;
+    }
+}
+
+typedef struct {
+    const watch_form* old;
+    size_t old_len;
+    size_t next;     // first old form that could still be resynced with
+    size_t boundary; // offset in the new source after which nothing changed
+    size_t shift;    // added to old offsets past the change, wraps around when the source shrank
+} watch_resync;
+
+// Whether an old form starts at the same place in the unchanged tail, the rest of the split is then known
+static bool watch_resync_at(void* arg, size_t offset) {
+    watch_resync* r = arg;
+    if (offset < r->boundary)
+        return false;
+    const size_t old_offset = offset-r->shift;
+    while (r->next < r->old_len && r->old[r->next].start < old_offset)
+        r->next++;
+    return r->next < r->old_len && r->old[r->next].start == old_offset;
+}
+
+static bool watch_never(void* arg, size_t offset) {
+    (void)arg;
+    (void)offset;
+    return false;
+}
+
+static size_t watch_count_lines(const char* data, size_t len) {
+    size_t lines = 0;
+    for (const char* p = data; (p = memchr(p, '\n', data+len-p)); p++)
+        lines++;
+    return lines;
+}
+
+// Re-reads a watched file, splits and parses again only the forms touched by the edit, and checks again
+// only those unless what they declare changed
+static void watch_update(watch_file* file, Tokens* tokens, intern_table* names, str_t* out) {
+    const double start = now_seconds();
+
+    size_t len;
+    char* source = read_file(NULL, file->path, &len);
+    if (source == NULL) {
+        str_printf(out, "%s: could not read: %s\n", file->path, strerror(errno));
+        return;
+    }
+
+    // Bytes before `prefix` and after `len-suffix` are the same as last time, compared a block at a time first
+    const size_t common = len < file->source_len ? len : file->source_len;
+    size_t prefix = 0;
+    while (prefix+WATCH_COMPARE_BLOCK <= common && !memcmp(source+prefix, file->source+prefix, WATCH_COMPARE_BLOCK))
+        prefix += WATCH_COMPARE_BLOCK;
+    while (prefix < common && source[prefix] == file->source[prefix])
+        prefix++;
+    size_t suffix = 0;
+    while (suffix+WATCH_COMPARE_BLOCK <= common-prefix &&
+            !memcmp(source+len-suffix-WATCH_COMPARE_BLOCK, file->source+file->source_len-suffix-WATCH_COMPARE_BLOCK, WATCH_COMPARE_BLOCK))
+        suffix += WATCH_COMPARE_BLOCK;
+    while (suffix < common-prefix && source[len-1-suffix] == file->source[file->source_len-1-suffix])
+        suffix++;
+
+    // Forms ending before the edit are kept as they are
+    size_t keep = 0;
+    while (keep < file->len && !file->forms[keep].open && file->forms[keep].start+file->forms[keep].len <= prefix)
+        keep++;
+    // The split carries over stray text until the next form, so it can not resume right after some
+    while (keep && file->source[file->forms[keep-1].start] != '(')
+        keep--;
+
+    size_t resume = 0, line = 0;
+    if (keep) {
+        const watch_form* last = &file->forms[keep-1];
+        resume = last->start+last->len;
+        line = last->line+watch_count_lines(source+last->start, last->len);
+    }
+    size_t line_start = resume;
+    while (line_start && source[line_start-1] != '\n')
+        line_start--;
+
+    // Forms the edit touched are split and parsed again
+    watch_resync r = {
+        .old = file->forms,
+        .old_len = file->len,
+        .next = keep,
+        .boundary = len-suffix,
+        .shift = len-file->source_len,
+    };
+    watch_form* parsed = NULL;
+    size_t reparsed = 0, parsed_cap = 0;
+    const size_t tail = watch_split(source, len, resume, line, line_start, &parsed, &reparsed, &parsed_cap,
+        file->source ? watch_resync_at : watch_never, &r);
+    for (size_t i = 0; i < reparsed; i++)
+        watch_parse(&parsed[i], file->path, source, tokens);
+
+    // The ones after it only move
+    const size_t resynced = tail < len ? r.next : file->len;
+    for (size_t i = keep; i < resynced; i++)
+        watch_form_free(&file->forms[i]);
+    const size_t moved = file->len-resynced;
+    const size_t count = keep+reparsed+moved;
+    if (count > file->cap) {
+        file->cap = count*2;
+        file->forms = (watch_form*)realloc(file->forms, sizeof(watch_form)*file->cap);
+    }
+    watch_form* forms = file->forms;
+    memmove(forms+keep+reparsed, forms+resynced, sizeof(watch_form)*moved);
+    if (reparsed)
+        memcpy(forms+keep, parsed, sizeof(watch_form)*reparsed);
+    free(parsed);
+
+    if (moved) {
+        const size_t line_shift = line+watch_count_lines(source+resume, tail-resume)-forms[keep+reparsed].line;
+        // Only forms on the line the edit ends on can change column
+        bool same_line = true;
+        for (size_t i = keep+reparsed; i < count; i++) {
+            watch_form* form = &forms[i];
+            form->start += r.shift;
+            form->line += line_shift;
+            if (same_line && memchr(source+r.boundary, '\n', form->start-r.boundary))
+                same_line = false;
+            if (same_line) {
+                size_t line_start = form->start;
+                while (line_start && source[line_start-1] != '\n')
+                    line_start--;
+                form->col = form->start-line_start+1;
+            }
+        }
+    }
+
+    free(file->source);
+    file->len = count;
+    file->source = source;
+    file->source_len = len;
+
+    // A fn only depends on what the others declare, so when that is unchanged only new forms are checked
+    uint64_t decls = 0;
+    for (size_t i = 0; i < count; i++)
+        decls = hash_mix(decls, forms[i].decls);
+    const bool all = decls != file->decls || !file->symbols.bindings;
+    file->decls = decls;
+
+    size_t checked = 0;
+    for (size_t i = 0; i < count; i++)
+        if (forms[i].nodes.len && (all || forms[i].parsed))
+            checked++;
+
+    if (checked) {
+        sym_table* symbols = &file->symbols;
+        if (all) {
+            sym_free(symbols);
+            sym_init(symbols, names);
+            sym_push_scope(symbols);
+            for (size_t i = 0; i < count; i++)
+                for (size_t j = 0; j < forms[i].nodes.len; j++)
+                    resolve_decl(symbols, forms[i].nodes.nodes[j]);
+            file->globals = symbols->len;
+        }
+        else {
+            // Same declarations in the same order, so the slot of each is still its position
+            // Imports of the same module declare the same shared nodes, so their bindings stay as they are
+            uint32_t slot = 0;
+            for (size_t i = 0; i < count; i++) {
+                for (size_t j = 0; j < forms[i].nodes.len; j++) {
+                    const lex_node node = forms[i].nodes.nodes[j];
+                    if (node.kind == NODE_IMPORT) {
+                        const module_interface* module = ((lex_node_import*)node.data)->module;
+                        slot += module ? module->decls.len : 0;
+                        continue;
+                    }
+                    if (forms[i].parsed && node.kind == NODE_FUNCTION) {
+                        lex_node_fn* fn = node.data;
+                        fn->slot = slot;
+                        symbols->bindings[slot].name = fn->name;
+                        symbols->bindings[slot].decl = fn;
+                    }
+                    else if (forms[i].parsed) {
+                        lex_node_def* def = node.data;
+                        def->slot = slot;
+                        symbols->bindings[slot].name = def->name;
+                        symbols->bindings[slot].decl = def;
+                    }
+                    slot++;
+                }
+            }
+            symbols->len = file->globals;
+            symbols->unresolved_len = 0;
+        }
+
+        // Functions to check and the form each one comes from
+        lex_node_root root = {0};
+        watch_form** owners = NULL;
+        size_t fns_cap = 0;
+        for (size_t i = 0; i < count; i++) {
+            watch_form* form = &forms[i];
+            if (!form->nodes.len || !(all || form->parsed))
+                continue;
+            diagnostics_free(&form->diags);
+            diagnostics_init(&form->diags);
+
+            for (size_t j = 0; j < form->nodes.len; j++) {
+                const lex_node node = form->nodes.nodes[j];
+                if (node.kind == NODE_IMPORT && !((lex_node_import*)node.data)->module) {
+                    const lex_node_import* import = node.data;
+                    diagnostics_push(&form->diags, import->l, import->c, 0, "Could not import '%s': %s", import->path, module_error(import));
+                }
+                if (node.kind != NODE_FUNCTION)
+                    continue;
+                const uint32_t unresolved = symbols->unresolved_len;
+                resolve_fn(symbols, node.data);
+                for (uint32_t k = unresolved; k < symbols->unresolved_len; k++) {
+                    const lex_node_name* name = symbols->unresolved[k];
+                    diagnostics_push(&form->diags, name->l, name->c, 0, "Undefined name '%s'", name->name);
+                }
+
+                if (root.children.len >= fns_cap) {
+                    fns_cap = fns_cap ? fns_cap*2 : LEX_NODES_CAPACITY_DEFAULT;
+                    root.children.nodes = (lex_node*)realloc(root.children.nodes, sizeof(lex_node)*fns_cap);
+                    owners = (watch_form**)realloc(owners, sizeof(watch_form*)*fns_cap);
+                }
+                owners[root.children.len] = form;
+                root.children.nodes[root.children.len++] = node;
+            }
+        }
+
+        diagnostics diags;
+        diagnostics_init(&diags);
+        check_ast((lex_node){.kind = NODE_ROOT, .data = &root}, symbols, NULL, &diags);
+        for (size_t i = 0; i < diags.len; i++) {
+            // The position of the fn among the checked ones is kept in the high bits of the order
+            const diagnostic* d = &diags.items[i];
+            diagnostics_push(&owners[d->order >> 32]->diags, d->l, d->c, d->order, "%s", d->message);
+        }
+        diagnostics_free(&diags);
+
+        for (size_t i = 0; i < count; i++)
+            if (all || forms[i].parsed)
+                diagnostics_sort(&forms[i].diags);
+        free(root.children.nodes);
+        free(owners);
+    }
+
+    size_t errors = 0;
+    for (size_t i = 0; i < count; i++) {
+        watch_form* form = &forms[i];
+        form->parsed = false;
+        if (form->error) {
+            str_printf(out, "%s:%zu:%zu: syntax error: %s\n", file->path, form->line+1, form->col, form->error);
+            errors++;
+        }
+        for (size_t j = 0; j < form->diags.len; j++) {
+            const diagnostic* d = &form->diags.items[j];
+            str_printf(out, "%s:%zu:%zu: %s\n", file->path, form->line+d->l+1, d->l ? d->c : form->col-1+d->c, d->message);
+        }
+        errors += form->diags.len;
+    }
+
+    str_printf(out, "%s: %zu forms, %zu parsed, %zu checked, %zu errors, updated in %.3f ms\n",
+        file->path, count, reparsed, checked, errors, (now_seconds()-start)*1e3);
+}
+
+// Checks files again every time one of them is written, until interrupted
+int watch_main(int argc, const char** argv) {
+    const int fd = inotify_init1(IN_CLOEXEC);
+    TRY( fd < 0, "Could not start inotify: " );
+
+    watch_file* files = (watch_file*)calloc(argc, sizeof(watch_file));
+    for (int i = 0; i < argc; i++) {
+        watch_file* file = &files[i];
+        file->path = argv[i];
+
+        const char* slash = strrchr(file->path, '/');
+        char* dir = slash ? strndup(file->path, slash == file->path ? 1 : slash-file->path) : strdup(".");
+        file->name = slash ? slash+1 : file->path;
+        // Watching the same directory twice hands back the same descriptor
+        file->wd = inotify_add_watch(fd, dir, IN_CLOSE_WRITE | IN_MOVED_TO);
+        TRY( file->wd < 0, "Could not watch %s: ", dir );
+        free(dir);
+    }
+
+    Tokens tokens;
+    tokens_init(&tokens);
+    intern_table names;
+    intern_init(&names);
+    str_t out = {0};
+
+    for (int i = 0; i < argc; i++)
+        watch_update(&files[i], &tokens, &names, &out);
+
+    for (;;) {
+        fwrite(str_data(&out), 1, str_len(&out), stdout);
+        fflush(stdout);
+        str_set_len(&out, 0);
+
+        char events[4096] __attribute__((aligned(__alignof__(struct inotify_event))));
+        const ssize_t n = read(fd, events, sizeof(events));
+        if (n < 0 && errno == EINTR)
+            continue;
+        TRY( n <= 0, "Could not read inotify events: " );
+
+        for (char* p = events; p < events+n;) {
+            const struct inotify_event* event = (const struct inotify_event*)p;
+            for (int i = 0; i < argc; i++)
+                if (files[i].wd == event->wd && event->len && !strcmp(event->name, files[i].name))
+                    files[i].dirty = true;
+            p += sizeof(struct inotify_event)+event->len;
+        }
+
+        for (int i = 0; i < argc; i++) {
+            if (!files[i].dirty)
+                continue;
+            files[i].dirty = false;
+            watch_update(&files[i], &tokens, &names, &out);
+        }
+    }
+}
+
+#define EVAL_PROFILE_NONE ((uint32_t)-1)
+
+// One calling context, the path of calls that led from the entry fn to a fn
+typedef struct {
+    uint32_t fn;      // slot
+    uint32_t parent;
+    uint32_t child;   // first one, EVAL_PROFILE_NONE when there is none
+    uint32_t sibling;
+    uint64_t self;
+} eval_profile_context;
+
+typedef struct {
+    uint64_t start;
+    uint64_t children; // ticks spent in the calls this one made
+} eval_profile_frame;
+
+// Counters of a profiled execution, time is only taken at calls so that the cost stays a few ns per call
+// Times are in ticks of eval_profile_clock, converted to ns once a profile is reported
+typedef struct {
+    uint32_t slots;
+    uint64_t* calls;     // by fn slot
+    uint64_t* inclusive; // by fn slot, a recursive fn only counts its outermost call
+    uint64_t* exclusive; // by fn slot
+    uint32_t* active;       // by fn slot, calls on the stack
+    uint64_t binops[TK_NOT+1];
+    uint64_t unops[TK_NOT+1];
+    const char* spellings[TK_NOT+1];
+    uint64_t* lines; // nodes executed by line
+    size_t lines_cap;
+    eval_profile_context* contexts; // contexts[0] is the root every entry call starts from
+    uint32_t contexts_len;
+    uint32_t contexts_cap;
+    uint32_t context;
+    eval_profile_frame frames[EVAL_DEPTH_MAX];
+    uint64_t start_ticks;
+    double start_seconds;
+} eval_profile;
+
+// Frames of every active call live on one stack, a param or local is found at a fixed index from its frame
+typedef struct {
+    const sym_table* symbols;
+    eval_profile* profile; // NULL unless profiling
+    long* globals;         // by slot, only used by global defs
+    uint32_t* frame_index; // by slot, of params and locals in the frame of their fn
+    uint32_t* frame_size;  // by fn slot
+    long* stack;
+    size_t sp;
+    size_t cap;
+    unsigned depth;
+    const char* error;
+    char error_buf[128];
+} eval_state;
+
+void eval_init(eval_state* st, const sym_table* symbols) {
+    memset(st, 0, sizeof(eval_state));
+    st->symbols = symbols;
+    st->globals = (long*)calloc(symbols->len+1, sizeof(long));
+    st->frame_index = (uint32_t*)calloc(symbols->len+1, sizeof(uint32_t));
+    st->frame_size = (uint32_t*)calloc(symbols->len+1, sizeof(uint32_t));
+    // Params are declared before the locals of their fn, so they take the first indexes of its frame
+    for (uint32_t i = 0; i < symbols->len; i++)
+        if (symbols->bindings[i].owner != SYM_NONE)
+            st->frame_index[i] = st->frame_size[symbols->bindings[i].owner]++;
+    st->cap = EVAL_STACK_DEFAULT;
+    st->stack = (long*)malloc(sizeof(long)*st->cap);
+}
+
+void eval_free(eval_state* st) {
+    free(st->globals);
+    free(st->frame_index);
+    free(st->frame_size);
+    free(st->stack);
+}
+
+// The time stamp counter costs a fraction of a clock_gettime and is steady on anything recent
+static inline uint64_t eval_profile_clock() {
+#if defined(__x86_64__) || defined(__i386__)
+    return __rdtsc();
+#else
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec*1000000000ull + ts.tv_nsec;
+#endif
+}
+
+void eval_profile_init(eval_profile* p, const sym_table* symbols) {
+    memset(p, 0, sizeof(eval_profile));
+    p->slots = symbols->len;
+    p->calls = (uint64_t*)calloc(p->slots+1, sizeof(uint64_t));
+    p->inclusive = (uint64_t*)calloc(p->slots+1, sizeof(uint64_t));
+    p->exclusive = (uint64_t*)calloc(p->slots+1, sizeof(uint64_t));
+    p->active = (uint32_t*)calloc(p->slots+1, sizeof(uint32_t));
+    p->contexts_cap = SYM_CAPACITY_DEFAULT;
+    p->contexts = (eval_profile_context*)malloc(sizeof(eval_profile_context)*p->contexts_cap);
+    p->contexts[p->contexts_len++] = (eval_profile_context){
+        .fn = SYM_NONE,
+        .parent = EVAL_PROFILE_NONE,
+        .child = EVAL_PROFILE_NONE,
+        .sibling = EVAL_PROFILE_NONE,
+    };
+    p->start_ticks = eval_profile_clock();
+    p->start_seconds = now_seconds();
+}
+
+void eval_profile_free(eval_profile* p) {
+    free(p->calls);
+    free(p->inclusive);
+    free(p->exclusive);
+    free(p->active);
+    free(p->lines);
+    free(p->contexts);
+}
+
+
+static void eval_profile_line(eval_profile* p, size_t line) {
+    if (line >= p->lines_cap) {
+        const size_t cap = p->lines_cap ? p->lines_cap : SYM_CAPACITY_DEFAULT;
+        size_t new_cap = cap;
+        while (line >= new_cap)
+            new_cap *= 2;
+        p->lines = (uint64_t*)realloc(p->lines, sizeof(uint64_t)*new_cap);
+        memset(p->lines+p->lines_cap, 0, sizeof(uint64_t)*(new_cap-p->lines_cap));
+        p->lines_cap = new_cap;
+    }
+    p->lines[line]++;
+}
+
+static inline void eval_profile_op(eval_profile* p, const Token* op, bool unary) {
+    (unary ? p->unops : p->binops)[op->k]++;
+    p->spellings[op->k] = op->t;
+    eval_profile_line(p, op->l);
+}
+
+static void eval_profile_enter(eval_profile* p, uint32_t fn, unsigned depth) {
+    uint32_t context = p->contexts[p->context].child;
+    while (context != EVAL_PROFILE_NONE && p->contexts[context].fn != fn)
+        context = p->contexts[context].sibling;
+    if (context == EVAL_PROFILE_NONE) {
+        if (p->contexts_len >= p->contexts_cap) {
+            p->contexts_cap *= 2;
+            p->contexts = (eval_profile_context*)realloc(p->contexts, sizeof(eval_profile_context)*p->contexts_cap);
+        }
+        context = p->contexts_len++;
+        p->contexts[context] = (eval_profile_context){
+            .fn = fn,
+            .parent = p->context,
+            .child = EVAL_PROFILE_NONE,
+            .sibling = p->contexts[p->context].child,
+        };
+        p->contexts[p->context].child = context;
+    }
+    p->context = context;
+    p->calls[fn]++;
+    p->active[fn]++;
+    p->frames[depth] = (eval_profile_frame){.start = eval_profile_clock()};
+}
+
+static void eval_profile_exit(eval_profile* p, uint32_t fn, unsigned depth) {
+    const uint64_t elapsed = eval_profile_clock()-p->frames[depth].start;
+    const uint64_t self = elapsed-p->frames[depth].children;
+    p->exclusive[fn] += self;
+    p->contexts[p->context].self += self;
+    if (--p->active[fn] == 0)
+        p->inclusive[fn] += elapsed;
+    if (depth > 0)
+        p->frames[depth-1].children += elapsed;
+    p->context = p->contexts[p->context].parent;
+}
+
+// Seconds per tick, measured over the whole profile
+static double eval_profile_seconds(const eval_profile* p) {
+    const uint64_t ticks = eval_profile_clock()-p->start_ticks;
+    return ticks ? (now_seconds()-p->start_seconds)/ticks : 0.0;
+}
+
+static const eval_profile* eval_profile_sorting;
+
+static int eval_profile_cmp_fn(const void* a, const void* b) {
+    const uint64_t x = eval_profile_sorting->exclusive[*(const uint32_t*)a];
+    const uint64_t y = eval_profile_sorting->exclusive[*(const uint32_t*)b];
+    return x < y ? 1 : x > y ? -1 : 0;
+}
+
+static int eval_profile_cmp_line(const void* a, const void* b) {
+    const uint64_t x = eval_profile_sorting->lines[*(const size_t*)a];
+    const uint64_t y = eval_profile_sorting->lines[*(const size_t*)b];
+    return x < y ? 1 : x > y ? -1 : 0;
+}
+
+// Prints fns by exclusive time, operators by count and the hottest lines of `source`
+void eval_profile_report(const eval_profile* p, const sym_table* symbols, const char* source, FILE* out) {
+    uint32_t* fns = (uint32_t*)malloc(sizeof(uint32_t)*(p->slots+1));
+    uint32_t fns_len = 0;
+    uint64_t total = 0, calls = 0;
+    for (uint32_t i = 0; i < p->slots; i++) {
+        if (!p->calls[i])
+            continue;
+        fns[fns_len++] = i;
+        total += p->exclusive[i];
+        calls += p->calls[i];
+    }
+    const double ms_per_tick = eval_profile_seconds(p)*1e3;
+    // Sorting is only ever done by the thread that reports
+    eval_profile_sorting = p;
+    qsort(fns, fns_len, sizeof(uint32_t), eval_profile_cmp_fn);
+
+    fprintf(out, "profile: %zu calls of %u fns, %.3f ms\n", (size_t)calls, fns_len, total*ms_per_tick);
+    fprintf(out, "  %6s %12s %12s %12s  %s\n", "self%", "self ms", "total ms", "calls", "fn");
+    for (uint32_t i = 0; i < fns_len; i++) {
+        const uint32_t fn = fns[i];
+        fprintf(out, "  %6.2f %12.3f %12.3f %12zu  %s\n",
+            total ? 100.0*p->exclusive[fn]/total : 0.0,
+            p->exclusive[fn]*ms_per_tick, p->inclusive[fn]*ms_per_tick, (size_t)p->calls[fn], symbols->bindings[fn].name);
+    }
+    free(fns);
+
+    // Printed operators are cleared from copies of the counters
+    uint64_t binops[TK_NOT+1], unops[TK_NOT+1];
+    memcpy(binops, p->binops, sizeof(binops));
+    memcpy(unops, p->unops, sizeof(unops));
+    fprintf(out, "operators:\n");
+    for (;;) {
+        uint64_t best = 0;
+        token_kind kind = 0;
+        bool unary = false;
+        for (int k = 0; k <= TK_NOT; k++) {
+            if (binops[k] > best)
+                best = binops[k], kind = k, unary = false;
+            if (unops[k] > best)
+                best = unops[k], kind = k, unary = true;
+        }
+        if (!best)
+            break;
+        fprintf(out, "  %12zu  `%s` %s\n", (size_t)best, p->spellings[kind], ir_op_str(kind, unary));
+        (unary ? unops : binops)[kind] = 0;
+    }
+
+    size_t* lines = (size_t*)malloc(sizeof(size_t)*(p->lines_cap+1));
+    size_t lines_len = 0;
+    for (size_t i = 0; i < p->lines_cap; i++)
+        if (p->lines[i])
+            lines[lines_len++] = i;
+    qsort(lines, lines_len, sizeof(size_t), eval_profile_cmp_line);
+
+    fprintf(out, "hot lines:\n");
+    for (size_t i = 0; i < lines_len && i < EVAL_PROFILE_LINES; i++) {
+        const char* text = source;
+        for (size_t l = 0; text && l < lines[i]; l++) {
+            text = strchr(text, '\n');
+            text = text ? text+1 : NULL;
+        }
+        const int len = text ? (int)strcspn(text, "\r\n") : 0;
+        fprintf(out, "  %12zu  %4zu | %.*s\n", (size_t)p->lines[lines[i]], lines[i]+1, len, text ? text : "");
+    }
+    free(lines);
+}
+
+// Writes one `entry;caller;callee <ns>` line per calling context, as flamegraph tools expect
+bool eval_profile_write_stacks(const eval_profile* p, const sym_table* symbols, const char* path) {
+    FILE* f = fopen(path, "w");
+    if (f == NULL)
+        return false;
+    const double ns_per_tick = eval_profile_seconds(p)*1e9;
+    uint32_t* stack = (uint32_t*)malloc(sizeof(uint32_t)*(EVAL_DEPTH_MAX+1));
+    for (uint32_t i = 1; i < p->contexts_len; i++) {
+        if (!p->contexts[i].self)
+            continue;
+        size_t depth = 0;
+        for (uint32_t c = i; c != 0 && depth <= EVAL_DEPTH_MAX; c = p->contexts[c].parent)
+            stack[depth++] = c;
+        while (depth > 0) {
+            depth--;
+            fprintf(f, "%s%c", symbols->bindings[p->contexts[stack[depth]].fn].name, depth ? ';' : ' ');
+        }
+        fprintf(f, "%.0f\n", p->contexts[i].self*ns_per_tick);
+    }
+    free(stack);
+    return !fclose(f);
+}
+
+__attribute__((format(printf, 2, 3)))
+static bool eval_fail(eval_state* st, const char* fmt, ...) {
+    va_list args;
+    va_start(args, fmt);
+    vsnprintf(st->error_buf, sizeof(st->error_buf), fmt, args);
+    va_end(args);
+    st->error = st->error_buf;
+    return false;
+}
+
+// Pushes a zeroed frame of `size` values, returns where it starts
+static size_t eval_push_frame(eval_state* st, size_t size) {
+    const size_t frame = st->sp;
+    if (st->sp+size > st->cap) {
+        while (st->sp+size > st->cap)
+            st->cap *= 2;
+        st->stack = (long*)realloc(st->stack, sizeof(long)*st->cap);
+    }
+    memset(st->stack+frame, 0, sizeof(long)*size);
+    st->sp += size;
+    return frame;
+}
+
+static bool eval_body(eval_state* st, const lex_node_fn* fn, size_t frame, long* result);
+
+static bool eval_expr(eval_state* st, size_t frame, lex_node node, long* result) {
+    if (node.kind == NODE_NUMBER) {
+        *result = *(long*)node.data;
+        return true;
+    }
+
+    if (node.kind == NODE_NAME) {
+        const lex_node_name* name = node.data;
+        if (name->slot == SYM_NONE)
+            return eval_fail(st, "%zu:%zu: Undefined name '%s'", name->l+1, name->c, name->name);
+        const sym_binding* binding = &st->symbols->bindings[name->slot];
+        if (binding->kind == SYM_FN)
+            return eval_fail(st, "%zu:%zu: '%s' is a function and can not be used as a value", name->l+1, name->c, name->name);
+        *result = binding->kind == SYM_GLOBAL ? st->globals[name->slot] : st->stack[frame+st->frame_index[name->slot]];
+        return true;
+    }
+
+    if (node.kind == NODE_UNOP) {
+        const lex_node_unop* data = node.data;
+        if (st->profile)
+            eval_profile_op(st->profile, &data->op, true);
+        if (data->op.k == TK_MUL)
+            return eval_fail(st, "%zu:%zu: Dereferences can not be evaluated", data->op.l+1, data->op.c);
+        long value;
+        if (!eval_expr(st, frame, data->value, &value))
+            return false;
+        if (!eval_unop(data->op.k, value, result))
+            return eval_fail(st, "%zu:%zu: `%s` is undefined for %ld", data->op.l+1, data->op.c, data->op.t, value);
+        return true;
+    }
+
+    if (node.kind == NODE_BINOP) {
+        const lex_node_binop* data = node.data;
+        if (st->profile)
+            eval_profile_op(st->profile, &data->op, false);
+        if (data->op.k == TK_SET) {
+            const lex_node_name* name = data->lhs.data;
+            if (data->lhs.kind != NODE_NAME || name->slot == SYM_NONE)
+                return eval_fail(st, "%zu:%zu: Only names can be assigned to", data->op.l+1, data->op.c);
+            if (!eval_expr(st, frame, data->rhs, result))
+                return false;
+            if (st->symbols->bindings[name->slot].kind == SYM_GLOBAL)
+                st->globals[name->slot] = *result;
+            else
+                st->stack[frame+st->frame_index[name->slot]] = *result;
+            return true;
+        }
+        long lhs, rhs;
+        if (!eval_expr(st, frame, data->lhs, &lhs) || !eval_expr(st, frame, data->rhs, &rhs))
+            return false;
+        if (!eval_binop(data->op.k, lhs, rhs, result))
+            return eval_fail(st, "%zu:%zu: `%s` is undefined for %ld and %ld", data->op.l+1, data->op.c, data->op.t, lhs, rhs);
+        return true;
+    }
+
+    if (node.kind == NODE_CALL) {
+        const lex_node_call* data = node.data;
+        const lex_node_name* callee = &data->callee;
+        if (st->profile)
+            eval_profile_line(st->profile, callee->l);
+        if (callee->slot == SYM_NONE || st->symbols->bindings[callee->slot].kind != SYM_FN)
+            return eval_fail(st, "%zu:%zu: '%s' is not a function", callee->l+1, callee->c, callee->name);
+        const lex_node_fn* fn = st->symbols->bindings[callee->slot].decl;
+        if (fn->body.children.nodes == NULL)
+            return eval_fail(st, "%zu:%zu: '%s' is imported and has no body to evaluate", callee->l+1, callee->c, callee->name);
+        if (fn->params.len != data->args.len)
+            return eval_fail(st, "%zu:%zu: '%s' expects %zu arguments, got %zu", callee->l+1, callee->c, callee->name, fn->params.len, data->args.len);
+
+        // The stack may move while the arguments are evaluated, so the callee frame is only addressed by index
+        const size_t callee_frame = eval_push_frame(st, st->frame_size[callee->slot]);
+        for (size_t i = 0; i < data->args.len; i++) {
+            long value;
+            if (!eval_expr(st, frame, data->args.nodes[i], &value)) {
+                st->sp = callee_frame;
+                return false;
+            }
+            st->stack[callee_frame+i] = value;
+        }
+        const bool ok = eval_body(st, fn, callee_frame, result);
+        st->sp = callee_frame;
+        return ok;
+    }
+
+    return eval_fail(st, "Can not evaluate this expression");
+}
+
+// A body evaluates to its last expression, 0 when it ends with a def
+static bool eval_body(eval_state* st, const lex_node_fn* fn, size_t frame, long* result) {
+    if (st->depth >= EVAL_DEPTH_MAX)
+        return eval_fail(st, "Call stack overflow in '%s'", fn->name);
+    if (st->profile)
+        eval_profile_enter(st->profile, fn->slot, st->depth);
+    st->depth++;
+    bool ok = true;
+    *result = 0;
+    for (size_t i = 0; ok && i < fn->body.children.len; i++) {
+        const lex_node child = fn->body.children.nodes[i];
+        if (child.kind == NODE_DEF) {
+            const lex_node_def* def = child.data;
+            st->stack[frame+st->frame_index[def->slot]] = 0;
+            *result = 0;
+        }
+        else
+            ok = eval_expr(st, frame, child, result);
+    }
+    st->depth--;
+    if (st->profile)
+        eval_profile_exit(st->profile, fn->slot, st->depth);
+    return ok;
+}
+
+// Evaluates one call of a resolved `fn` with `args`, one per param, the reason of a failure is left in st->error
+bool eval_fn(eval_state* st, const lex_node_fn* fn, const long* args, long* result) {
+    st->error = NULL;
+    if (fn->body.children.nodes == NULL)
+        return eval_fail(st, "'%s' is imported and has no body to evaluate", fn->name);
+    const size_t frame = eval_push_frame(st, st->frame_size[fn->slot]);
+    memcpy(st->stack+frame, args, sizeof(long)*fn->params.len);
+    const bool ok = eval_body(st, fn, frame, result);
+    st->sp = frame;
+    return ok;
+}
+
+// Computes `n` lanes of an operator, `b` is NULL for unary ones
+// Lanes were checked beforehand, so a kernel never sees a division by zero or an oversized shift
+typedef void (*eval_kernel)(const long* a, const long* b, long* out, size_t n);
+
+typedef struct {
+    const char* name;
+    eval_kernel binop[TK_NOT+1]; // by token kind, NULL falls back to eval_generic
+    eval_kernel unop[TK_NOT+1];
+} eval_kernel_set;
+
+// Plain loops the compiler is free to vectorize for whatever target it builds for
+#define EVAL_GENERIC_BINOP(name, expr) \
+    static void eval_generic_##name(const long* restrict a, const long* restrict b, long* restrict out, size_t n) { \
+        for (size_t i = 0; i < n; i++) \
+            out[i] = (expr); \
+    }
+#define EVAL_GENERIC_UNOP(name, expr) \
+    static void eval_generic_##name(const long* restrict a, const long* restrict b, long* restrict out, size_t n) { \
+        (void)b; \
+        for (size_t i = 0; i < n; i++) \
+            out[i] = (expr); \
+    }
+
+EVAL_GENERIC_BINOP(add, (long)((unsigned long)a[i] + (unsigned long)b[i]))
+EVAL_GENERIC_BINOP(sub, (long)((unsigned long)a[i] - (unsigned long)b[i]))
+EVAL_GENERIC_BINOP(mul, (long)((unsigned long)a[i] * (unsigned long)b[i]))
+EVAL_GENERIC_BINOP(div, a[i] / b[i])
+EVAL_GENERIC_BINOP(eq, a[i] == b[i])
+EVAL_GENERIC_BINOP(ne, a[i] != b[i])
+EVAL_GENERIC_BINOP(gt, a[i] > b[i])
+EVAL_GENERIC_BINOP(ge, a[i] >= b[i])
+EVAL_GENERIC_BINOP(lt, a[i] < b[i])
+EVAL_GENERIC_BINOP(le, a[i] <= b[i])
+EVAL_GENERIC_BINOP(shl, (long)((unsigned long)a[i] << b[i]))
+EVAL_GENERIC_BINOP(shr, a[i] >> b[i])
+EVAL_GENERIC_UNOP(pos, a[i])
+EVAL_GENERIC_UNOP(neg, (long)(-(unsigned long)a[i]))
+EVAL_GENERIC_UNOP(not, !a[i])
+
+static const eval_kernel_set eval_generic = {
+    .name = "generic",
+    .binop = {
+        [TK_ADD] = eval_generic_add, [TK_SUB] = eval_generic_sub,
+        [TK_MUL] = eval_generic_mul, [TK_DIV] = eval_generic_div,
+        [TK_EQ] = eval_generic_eq, [TK_NE] = eval_generic_ne,
+        [TK_GT] = eval_generic_gt, [TK_GE] = eval_generic_ge,
+        [TK_LT] = eval_generic_lt, [TK_LE] = eval_generic_le,
+        [TK_SHL] = eval_generic_shl, [TK_SHR] = eval_generic_shr,
+    },
+    .unop = {
+        [TK_ADD] = eval_generic_pos, [TK_SUB] = eval_generic_neg, [TK_NOT] = eval_generic_not,
+    },
+};
+
+#if defined(__x86_64__) || defined(__i386__)
+// x86 has no integer division in SIMD registers, so `/` always stays on the generic loop
+
+#define EVAL_SIMD_BINOP(isa, feature, vec, width, load, store, name, expr) \
+    __attribute__((target(feature))) \
+    static void eval_##isa##_##name(const long* a, const long* b, long* out, size_t n) { \
+        size_t i = 0; \
+        for (; i+width <= n; i += width) { \
+            const vec x = load((const vec*)(a+i)); \
+            const vec y = load((const vec*)(b+i)); \
+            store((vec*)(out+i), expr); \
+        } \
+        eval_generic_##name(a+i, b+i, out+i, n-i); \
+    }
+#define EVAL_SIMD_UNOP(isa, feature, vec, width, load, store, name, expr) \
+    __attribute__((target(feature))) \
+    static void eval_##isa##_##name(const long* a, const long* b, long* out, size_t n) { \
+        size_t i = 0; \
+        for (; i+width <= n; i += width) { \
+            const vec x = load((const vec*)(a+i)); \
+            store((vec*)(out+i), expr); \
+        } \
+        eval_generic_##name(a+i, b, out+i, n-i); \
+    }
+
+// Low 64 bits of a 64x64 bit product out of 32x32 bit ones, a_hi*b_hi only affects the high half
+__attribute__((target("sse4.2")))
+static inline __m128i eval_sse_mul64(__m128i x, __m128i y) {
+    const __m128i cross = _mm_add_epi64(
+        _mm_mul_epu32(_mm_srli_epi64(x, 32), y),
+        _mm_mul_epu32(x, _mm_srli_epi64(y, 32))
+    );
+    return _mm_add_epi64(_mm_mul_epu32(x, y), _mm_slli_epi64(cross, 32));
+}
+
+#define EVAL_SSE_BINOP(name, expr) EVAL_SIMD_BINOP(sse, "sse4.2", __m128i, 2, _mm_loadu_si128, _mm_storeu_si128, name, expr)
+#define EVAL_SSE_UNOP(name, expr) EVAL_SIMD_UNOP(sse, "sse4.2", __m128i, 2, _mm_loadu_si128, _mm_storeu_si128, name, expr)
+#define EVAL_SSE_ONE _mm_set1_epi64x(1)
+
+EVAL_SSE_BINOP(add, _mm_add_epi64(x, y))
+EVAL_SSE_BINOP(sub, _mm_sub_epi64(x, y))
+EVAL_SSE_BINOP(mul, eval_sse_mul64(x, y))
+EVAL_SSE_BINOP(eq, _mm_and_si128(_mm_cmpeq_epi64(x, y), EVAL_SSE_ONE))
+EVAL_SSE_BINOP(ne, _mm_andnot_si128(_mm_cmpeq_epi64(x, y), EVAL_SSE_ONE))
+EVAL_SSE_BINOP(gt, _mm_and_si128(_mm_cmpgt_epi64(x, y), EVAL_SSE_ONE))
+EVAL_SSE_BINOP(ge, _mm_andnot_si128(_mm_cmpgt_epi64(y, x), EVAL_SSE_ONE))
+EVAL_SSE_BINOP(lt, _mm_and_si128(_mm_cmpgt_epi64(y, x), EVAL_SSE_ONE))
+EVAL_SSE_BINOP(le, _mm_andnot_si128(_mm_cmpgt_epi64(x, y), EVAL_SSE_ONE))
+EVAL_SSE_UNOP(neg, _mm_sub_epi64(_mm_setzero_si128(), x))
+EVAL_SSE_UNOP(not, _mm_and_si128(_mm_cmpeq_epi64(x, _mm_setzero_si128()), EVAL_SSE_ONE))
+
+// SSE only shifts every lane by the same count, so shifts are left to the generic loop
+static const eval_kernel_set eval_sse = {
+    .name = "sse4.2",
+    .binop = {
+        [TK_ADD] = eval_sse_add, [TK_SUB] = eval_sse_sub, [TK_MUL] = eval_sse_mul,
+        [TK_EQ] = eval_sse_eq, [TK_NE] = eval_sse_ne,
+        [TK_GT] = eval_sse_gt, [TK_GE] = eval_sse_ge,
+        [TK_LT] = eval_sse_lt, [TK_LE] = eval_sse_le,
+    },
+    .unop = {
+        [TK_SUB] = eval_sse_neg, [TK_NOT] = eval_sse_not,
+    },
+};
+
+__attribute__((target("avx2")))
+static inline __m256i eval_avx2_mul64(__m256i x, __m256i y) {
+    const __m256i cross = _mm256_add_epi64(
+        _mm256_mul_epu32(_mm256_srli_epi64(x, 32), y),
+        _mm256_mul_epu32(x, _mm256_srli_epi64(y, 32))
+    );
+    return _mm256_add_epi64(_mm256_mul_epu32(x, y), _mm256_slli_epi64(cross, 32));
+}
+
+// AVX2 has no arithmetic shift of 64 bit lanes, a logical one of the value with its sign flipped away does the same
+__attribute__((target("avx2")))
+static inline __m256i eval_avx2_sra64(__m256i x, __m256i y) {
+    const __m256i sign = _mm256_cmpgt_epi64(_mm256_setzero_si256(), x);
+    return _mm256_xor_si256(_mm256_srlv_epi64(_mm256_xor_si256(x, sign), y), sign);
+}
+
+#define EVAL_AVX2_BINOP(name, expr) EVAL_SIMD_BINOP(avx2, "avx2", __m256i, 4, _mm256_loadu_si256, _mm256_storeu_si256, name, expr)
+#define EVAL_AVX2_UNOP(name, expr) EVAL_SIMD_UNOP(avx2, "avx2", __m256i, 4, _mm256_loadu_si256, _mm256_storeu_si256, name, expr)
+#define EVAL_AVX2_ONE _mm256_set1_epi64x(1)
+
+EVAL_AVX2_BINOP(add, _mm256_add_epi64(x, y))
+EVAL_AVX2_BINOP(sub, _mm256_sub_epi64(x, y))
+EVAL_AVX2_BINOP(mul, eval_avx2_mul64(x, y))
+EVAL_AVX2_BINOP(eq, _mm256_and_si256(_mm256_cmpeq_epi64(x, y), EVAL_AVX2_ONE))
+EVAL_AVX2_BINOP(ne, _mm256_andnot_si256(_mm256_cmpeq_epi64(x, y), EVAL_AVX2_ONE))
+EVAL_AVX2_BINOP(gt, _mm256_and_si256(_mm256_cmpgt_epi64(x, y), EVAL_AVX2_ONE))
+EVAL_AVX2_BINOP(ge, _mm256_andnot_si256(_mm256_cmpgt_epi64(y, x), EVAL_AVX2_ONE))
+EVAL_AVX2_BINOP(lt, _mm256_and_si256(_mm256_cmpgt_epi64(y, x), EVAL_AVX2_ONE))
+EVAL_AVX2_BINOP(le, _mm256_andnot_si256(_mm256_cmpgt_epi64(x, y), EVAL_AVX2_ONE))
+EVAL_AVX2_BINOP(shl, _mm256_sllv_epi64(x, y))
+EVAL_AVX2_BINOP(shr, eval_avx2_sra64(x, y))
+EVAL_AVX2_UNOP(neg, _mm256_sub_epi64(_mm256_setzero_si256(), x))
+EVAL_AVX2_UNOP(not, _mm256_and_si256(_mm256_cmpeq_epi64(x, _mm256_setzero_si256()), EVAL_AVX2_ONE))
+
+static const eval_kernel_set eval_avx2 = {
+    .name = "avx2",
+    .binop = {
+        [TK_ADD] = eval_avx2_add, [TK_SUB] = eval_avx2_sub, [TK_MUL] = eval_avx2_mul,
+        [TK_EQ] = eval_avx2_eq, [TK_NE] = eval_avx2_ne,
+        [TK_GT] = eval_avx2_gt, [TK_GE] = eval_avx2_ge,
+        [TK_LT] = eval_avx2_lt, [TK_LE] = eval_avx2_le,
+        [TK_SHL] = eval_avx2_shl, [TK_SHR] = eval_avx2_shr,
+    },
+    .unop = {
+        [TK_SUB] = eval_avx2_neg, [TK_NOT] = eval_avx2_not,
+    },
+};
+
+static const eval_kernel_set* eval_kernel_sets[] = {&eval_generic, &eval_sse, &eval_avx2};
+#else
+static const eval_kernel_set* eval_kernel_sets[] = {&eval_generic};
+#endif
+
+// Whether the machine running this can use a kernel set
+bool eval_kernels_supported(const eval_kernel_set* kernels) {
+#if defined(__x86_64__) || defined(__i386__)
+    if (kernels == &eval_avx2)
+        return __builtin_cpu_supports("avx2");
+    if (kernels == &eval_sse)
+        return __builtin_cpu_supports("sse4.2");
+#endif
+    return kernels == &eval_generic;
+}
+
+// The widest kernel set the machine running this supports
+const eval_kernel_set* eval_kernels_best() {
+    for (size_t i = sizeof(eval_kernel_sets)/sizeof(*eval_kernel_sets); i > 0; i--)
+        if (eval_kernels_supported(eval_kernel_sets[i-1]))
+            return eval_kernel_sets[i-1];
+    return &eval_generic;
+}
+
+typedef enum {
+    EVAL_COLUMN = 1,
+    EVAL_CONST,
+    EVAL_BINOP,
+    EVAL_UNOP,
+} eval_op_kind;
+
+// One column-at-a-time step, operands are indexes of earlier ops
+typedef struct {
+    unsigned char kind; // eval_op_kind
+    unsigned char tk;   // token_kind of EVAL_BINOP and EVAL_UNOP
+    uint32_t a;         // operand, or the param of EVAL_COLUMN
+    uint32_t b;
+    long imm;           // value of EVAL_CONST
+} eval_op;
+
+typedef struct {
+    const lex_node_fn* fn;
+    eval_op* ops; // operands always come before the ops that use them, the value is the last one
+    uint32_t len;
+    uint32_t cap;
+    const char* error;
+} eval_plan;
+
+static uint32_t eval_plan_push(eval_plan* plan, eval_op op) {
+    if (plan->len >= plan->cap) {
+        plan->cap = plan->cap ? plan->cap*2 : IR_CAPACITY_DEFAULT;
+        plan->ops = (eval_op*)realloc(plan->ops, sizeof(eval_op)*plan->cap);
+    }
+    plan->ops[plan->len] = op;
+    return plan->len++;
+}
+
+// Flattens an expression into the plan, returns false when it does more than arithmetic on params
+static bool eval_plan_node(eval_plan* plan, lex_node node, uint32_t* index) {
+    if (node.kind == NODE_NUMBER) {
+        *index = eval_plan_push(plan, (eval_op){.kind = EVAL_CONST, .imm = *(long*)node.data});
+        return true;
+    }
+    if (node.kind == NODE_NAME) {
+        const long param = inline_param(plan->fn, node.data);
+        if (param < 0) {
+            plan->error = "Only params can be read by a batch";
+            return false;
+        }
+        *index = eval_plan_push(plan, (eval_op){.kind = EVAL_COLUMN, .a = param});
+        return true;
+    }
+    if (node.kind == NODE_UNOP) {
+        const lex_node_unop* data = node.data;
+        uint32_t value;
+        if (data->op.k == TK_MUL || !eval_plan_node(plan, data->value, &value)) {
+            plan->error = plan->error ? plan->error : "Dereferences can not be evaluated in a batch";
+            return false;
+        }
+        *index = eval_plan_push(plan, (eval_op){.kind = EVAL_UNOP, .tk = data->op.k, .a = value});
+        return true;
+    }
+    if (node.kind == NODE_BINOP) {
+        const lex_node_binop* data = node.data;
+        uint32_t lhs, rhs;
+        if (data->op.k == TK_SET) {
+            plan->error = "Assignments can not be evaluated in a batch";
+            return false;
+        }
+        if (!eval_plan_node(plan, data->lhs, &lhs) || !eval_plan_node(plan, data->rhs, &rhs))
+            return false;
+        *index = eval_plan_push(plan, (eval_op){.kind = EVAL_BINOP, .tk = data->op.k, .a = lhs, .b = rhs});
+        return true;
+    }
+    plan->error = node.kind == NODE_CALL ? "Calls can not be evaluated in a batch" : "Can not evaluate this expression in a batch";
+    return false;
+}
+
+// Whether every lane of an operator is defined, checked once per chunk before its kernel runs
+static bool eval_lanes_valid(token_kind op, const long* a, const long* b, size_t n) {
+    bool valid = true;
+    if (op == TK_DIV)
+        for (size_t i = 0; i < n; i++)
+            valid &= b[i] != 0 && !(a[i] == LONG_MIN && b[i] == -1);
+    else if (op == TK_SHL || op == TK_SHR)
+        for (size_t i = 0; i < n; i++)
+            valid &= (unsigned long)b[i] < 64;
+    return valid;
+}
+
+// Evaluates `fn` for `rows` rows at once, `columns` holds the inputs of each param and results go to `out`
+// Only bodies whose value is arithmetic on params are supported, earlier expressions have to be pure
+// `kernels` is NULL for the best set this machine supports
+bool eval_batch(const lex_node_fn* fn, const long* const* columns, size_t rows, long* out, const eval_kernel_set* kernels, const char** error) {
+    eval_plan plan = {.fn = fn};
+    uint32_t value = 0;
+    bool ok = false;
+    for (size_t i = 0; i < fn->body.children.len; i++) {
+        const lex_node child = fn->body.children.nodes[i];
+        if (i+1 < fn->body.children.len && child.kind != NODE_DEF && !lex_node_pure(child)) {
+            plan.error = "Only the last expression of a batch may have effects";
+            break;
+        }
+        if (i+1 == fn->body.children.len)
+            ok = child.kind != NODE_DEF && eval_plan_node(&plan, child, &value);
+    }
+    if (!ok) {
+        *error = plan.error ? plan.error : "There is no value to evaluate";
+        free(plan.ops);
+        return false;
+    }
+
+    if (kernels == NULL)
+        kernels = eval_kernels_best();
+    long* chunks = (long*)malloc(sizeof(long)*EVAL_CHUNK*plan.len);
+    const long** inputs = (const long**)malloc(sizeof(long*)*plan.len);
+    for (uint32_t i = 0; i < plan.len; i++) {
+        inputs[i] = chunks + (size_t)i*EVAL_CHUNK;
+        for (size_t j = 0; plan.ops[i].kind == EVAL_CONST && j < EVAL_CHUNK; j++)
+            chunks[(size_t)i*EVAL_CHUNK+j] = plan.ops[i].imm;
+    }
+
+    *error = NULL;
+    for (size_t start = 0; start < rows && !*error; start += EVAL_CHUNK) {
+        const size_t n = rows-start < EVAL_CHUNK ? rows-start : EVAL_CHUNK;
+        for (uint32_t i = 0; i < plan.len; i++) {
+            const eval_op op = plan.ops[i];
+            // The last op writes straight into the results
+            long* dst = i == value ? out+start : chunks + (size_t)i*EVAL_CHUNK;
+            if (op.kind == EVAL_COLUMN)
+                inputs[i] = columns[op.a]+start;
+            else if (op.kind == EVAL_BINOP) {
+                if (!eval_lanes_valid(op.tk, inputs[op.a], inputs[op.b], n)) {
+                    *error = op.tk == TK_DIV ? "Division by zero or overflow in a batch" : "Shift by 64 bits or more in a batch";
+                    break;
+                }
+                eval_kernel kernel = kernels->binop[op.tk] ? kernels->binop[op.tk] : eval_generic.binop[op.tk];
+                if (kernel == NULL) {
+                    *error = "Unknown operator in a batch";
+                    break;
+                }
+                kernel(inputs[op.a], inputs[op.b], dst, n);
+                inputs[i] = dst;
+            }
+            else if (op.kind == EVAL_UNOP) {
+                eval_kernel kernel = kernels->unop[op.tk] ? kernels->unop[op.tk] : eval_generic.unop[op.tk];
+                if (kernel == NULL) {
+                    *error = "Unknown operator in a batch";
+                    break;
+                }
+                kernel(inputs[op.a], NULL, dst, n);
+                inputs[i] = dst;
+            }
+            if (i == value && inputs[i] != dst)
+                memcpy(dst, inputs[i], sizeof(long)*n);
+        }
+    }
+
+    free(inputs);
+    free(chunks);
+    free(plan.ops);
+    return *error == NULL;
+}
+
+// A program loaded up to folding, for executing its fns
+typedef struct {
+    char* source;
+    Tokens tokens;
+    lex_node root;
+    intern_table names;
+    sym_table symbols;
+} eval_program;
+
+// Runs the passes that execution depends on, prints what went wrong and returns false when `source` is not a valid program
+// Profiles leave calls alone so that time is attributed to the fns the source spells out
+// The program takes `source` over, `path` only shows up in messages
+bool eval_load_source(eval_program* program, const char* path, char* source, bool inline_calls) {
+    memset(program, 0, sizeof(eval_program));
+    program->source = source;
+    tokens_init(&program->tokens);
+    tokenize(program->source, &program->tokens);
+    diagnostics syntax_errors;
+    diagnostics_init(&syntax_errors);
+    lex_result result = lex(&program->tokens, &syntax_errors);
+    for (size_t i = 0; i < syntax_errors.len; i++)
+        printf("%s:%zu:%zu: syntax error: %s\n", path, syntax_errors.items[i].l+1, syntax_errors.items[i].c, syntax_errors.items[i].message);
+    diagnostics_free(&syntax_errors);
+    if (!result.status)
+        return false;
+    program->root = result.result.node;
+    lex_node_root* root = program->root.data;
+
+    size_t errors = module_load_imports(program->root, path, NULL);
+    for (size_t i = 0; errors && i < root->children.len; i++) {
+        const lex_node_import* import = root->children.nodes[i].data;
+        if (root->children.nodes[i].kind == NODE_IMPORT && !import->module)
+            printf("%s:%zu:%zu: Could not import '%s': %s\n", path, import->l+1, import->c, import->path, module_error(import));
+    }
+
+    intern_init(&program->names);
+    sym_init(&program->symbols, &program->names);
+    errors += resolve_ast(&program->symbols, program->root);
+    for (uint32_t i = 0; i < program->symbols.unresolved_len; i++) {
+        const lex_node_name* name = program->symbols.unresolved[i];
+        printf("%s:%zu:%zu: Undefined name '%s'\n", path, name->l+1, name->c, name->name);
+    }
+
+    diagnostics diags;
+    diagnostics_init(&diags);
+    errors += check_ast(program->root, &program->symbols, NULL, &diags);
+    for (size_t i = 0; i < diags.len; i++)
+        printf("%s:%zu:%zu: %s\n", path, diags.items[i].l+1, diags.items[i].c, diags.items[i].message);
+    diagnostics_free(&diags);
+    if (errors)
+        return false;
+
+    if (inline_calls) {
+        inline_stats inlined = {0};
+        inline_ast(program->root, &program->symbols, INLINE_BUDGET_DEFAULT, &inlined);
+    }
+    fold_ast(program->root);
+    return true;
+}
+
+// Same as eval_load_source with the contents of `path`
+bool eval_load(eval_program* program, const char* path, bool inline_calls) {
+    char* source = read_file(NULL, path, NULL);
+    if (source == NULL) {
+        memset(program, 0, sizeof(eval_program));
+        printf("Could not read %s: %s\n", path, strerror(errno));
+        return false;
+    }
+    return eval_load_source(program, path, source, inline_calls);
+}
+
+// The fn of a loaded program called `name`, NULL when there is none
+const lex_node_fn* eval_find(const eval_program* program, const char* name) {
+    const lex_node_root* root = program->root.data;
+    for (size_t i = 0; i < root->children.len; i++)
+        if (root->children.nodes[i].kind == NODE_FUNCTION && !strcmp(((lex_node_fn*)root->children.nodes[i].data)->name, name))
+            return root->children.nodes[i].data;
+    return NULL;
+}
+
+static inline uint64_t eval_bench_random(uint64_t* state) {
+    *state ^= *state << 13;
+    *state ^= *state >> 7;
+    *state ^= *state << 17;
+    return *state;
+}
+
+// Evaluates `name` over random rows one call at a time and then in batches with every supported kernel set
+int eval_bench_main(const char* path, const char* name, size_t rows) {
+    eval_program program;
+    if (!eval_load(&program, path, true))
+        return 1;
+    const lex_node_fn* fn = eval_find(&program, name);
+    if (fn == NULL) {
+        printf("%s: no fn '%s'\n", path, name);
+        return 1;
+    }
+    if (rows == 0)
+        rows = EVAL_BENCH_ROWS_DEFAULT;
+
+    // Small positive inputs keep divisions and shifts defined
+    const size_t params = fn->params.len;
+    long** columns = (long**)malloc(sizeof(long*)*(params+1));
+    uint64_t seed = 0x9e3779b97f4a7c15ull;
+    for (size_t p = 0; p < params; p++) {
+        columns[p] = (long*)malloc(sizeof(long)*rows);
+        for (size_t r = 0; r < rows; r++)
+            columns[p][r] = 1 + eval_bench_random(&seed) % 63;
+    }
+    long* expected = (long*)malloc(sizeof(long)*rows);
+    long* out = (long*)malloc(sizeof(long)*rows);
+    long* args = (long*)malloc(sizeof(long)*(params+1));
+
+    printf("eval-bench: '%s' over %zu rows of %zu params\n", name, rows, params);
+
+    eval_state st;
+    eval_init(&st, &program.symbols);
+    double start = now_seconds();
+    for (size_t r = 0; r < rows; r++) {
+        for (size_t p = 0; p < params; p++)
+            args[p] = columns[p][r];
+        if (!eval_fn(&st, fn, args, &expected[r])) {
+            printf("  row %zu: %s\n", r, st.error);
+            return 1;
+        }
+    }
+    const double scalar = now_seconds()-start;
+    printf("  %-8s %10.2f ms %12.0f rows/s\n", "per-row", scalar*1e3, rows/scalar);
+    eval_free(&st);
+
+    int status = 0;
+    for (size_t k = 0; k < sizeof(eval_kernel_sets)/sizeof(*eval_kernel_sets); k++) {
+        const eval_kernel_set* kernels = eval_kernel_sets[k];
+        if (!eval_kernels_supported(kernels)) {
+            printf("  %-8s not supported by this machine\n", kernels->name);
+            continue;
+        }
+        const char* error;
+        start = now_seconds();
+        if (!eval_batch(fn, (const long* const*)columns, rows, out, kernels, &error)) {
+            printf("  %-8s %s\n", kernels->name, error);
+            status = 1;
+            break;
+        }
+        const double elapsed = now_seconds()-start;
+        size_t mismatches = 0;
+        for (size_t r = 0; r < rows; r++)
+            mismatches += out[r] != expected[r];
+        printf("  %-8s %10.2f ms %12.0f rows/s %8.2fx", kernels->name, elapsed*1e3, rows/elapsed, scalar/elapsed);
+        if (mismatches) {
+            printf(", \x1b[91m%zu rows differ from per-row results\x1b[39m", mismatches);
+            status = 1;
+        }
+        printf("\n");
+    }
+
+    for (size_t p = 0; p < params; p++)
+        free(columns[p]);
+    free(columns);
+    free(expected);
+    free(out);
+    free(args);
+    return status;
+}
+
+// Parses one row of inputs, returns false unless it holds exactly `n` numbers
+static bool run_parse_row(const char* const* fields, size_t len, long* row, size_t n) {
+    if (len != n)
+        return false;
+    for (size_t i = 0; i < n; i++) {
+        char* end;
+        errno = 0;
+        row[i] = strtol(fields[i], &end, 0);
+        if (errno || end == fields[i] || *end)
+            return false;
+    }
+    return true;
+}
+
+// Calls `name` once with the given args, or once per line of a `@rows` file, and prints one result per line
+// With a profile, a report goes to stderr and the calling contexts to `stacks_path`
+int run_main(int argc, const char** argv) {
+    const char* stacks_path = NULL;
+    if (argc >= 2 && !strcmp(argv[0], "--profile")) {
+        stacks_path = argv[1];
+        argc -= 2, argv += 2;
+    }
+    if (argc < 2) {
+        printf("Usage: --run [--profile <stacks>] <file.spl> <fn> [args... | @rows]\n");
+        return 1;
+    }
+    const char* path = shift_args(&argc, &argv);
+    const char* name = shift_args(&argc, &argv);
+
+    eval_program program;
+    if (!eval_load(&program, path, stacks_path == NULL))
+        return 1;
+    const lex_node_fn* fn = eval_find(&program, name);
+    if (fn == NULL) {
+        printf("%s: no fn '%s'\n", path, name);
+        return 1;
+    }
+
+    eval_state st;
+    eval_init(&st, &program.symbols);
+    eval_profile profile;
+    if (stacks_path) {
+        eval_profile_init(&profile, &program.symbols);
+        st.profile = &profile;
+    }
+
+    long* args = (long*)malloc(sizeof(long)*(fn->params.len+1));
+    char* rows = NULL;
+    int status = 0;
+    if (argc == 1 && argv[0][0] == '@') {
+        rows = read_file(NULL, argv[0]+1, NULL);
+        if (rows == NULL) {
+            printf("Could not read %s: %s\n", argv[0]+1, strerror(errno));
+            return 1;
+        }
+        // One more field than the fn takes is enough to tell a row that is too long
+        const char** fields = (const char**)malloc(sizeof(char*)*(fn->params.len+1));
+        size_t line = 0;
+        for (char* next = rows; next && !status; line++) {
+            char* text = next;
+            next = strchr(text, '\n');
+            if (next)
+                *next++ = 0;
+            size_t len = 0;
+            for (char* field = strtok(text, " \t\r,"); field; field = strtok(NULL, " \t\r,")) {
+                if (len <= fn->params.len)
+                    fields[len] = field;
+                len++;
+            }
+            if (len == 0)
+                continue;
+            long result;
+            if (!run_parse_row(fields, len, args, fn->params.len)) {
+                printf("%s:%zu: '%s' takes %zu numbers\n", argv[0]+1, line+1, name, fn->params.len);
+                status = 1;
+            }
+            else if (!eval_fn(&st, fn, args, &result)) {
+                printf("%s:%zu: %s\n", argv[0]+1, line+1, st.error);
+                status = 1;
+            }
+            else
+                printf("%ld\n", result);
+        }
+        free(fields);
+    }
+    else {
+        long result;
+        if (!run_parse_row(argv, argc, args, fn->params.len)) {
+            printf("'%s' takes %zu numbers\n", name, fn->params.len);
+            status = 1;
+        }
+        else if (!eval_fn(&st, fn, args, &result)) {
+            printf("%s\n", st.error);
+            status = 1;
+        }
+        else
+            printf("%ld\n", result);
+    }
+
+    if (stacks_path) {
+        eval_profile_report(&profile, &program.symbols, program.source, stderr);
+        if (!eval_profile_write_stacks(&profile, &program.symbols, stacks_path)) {
+            printf("Could not write %s: %s\n", stacks_path, strerror(errno));
+            status = 1;
+        }
+        eval_profile_free(&profile);
+    }
+    free(rows);
+    free(args);
+    eval_free(&st);
+    return status;
+}
+
+typedef struct {
+    const char* source;
+    const char* fn;
+    long args[4];
+    size_t nargs;
+    long result;
+    const char* error; // part of the error the call has to fail with, NULL when it returns `result`
+} self_check_case;
+
+// Programs that optimizations got wrong before, each one has to give the same answer with and without inlining
+static const self_check_case self_check_cases[] = {
+    // The callee assigns the global its argument reads, substituting the argument would read it too late
+    {
+        "(def (int) g)\n"
+        "(fn (int) f ((int) a) (+ (= g 1) a))\n"
+        "(fn (int) main ((int) x) (= g x) (f g))\n",
+        "main", {5}, 1, 6, NULL,
+    },
+    {
+        "(def (int) g)\n"
+        "(fn (int) set ((int) v) (= g v))\n"
+        "(fn (int) f ((int) a) (+ (set 1) a))\n"
+        "(fn (int) main ((int) x) (= g x) (f g))\n",
+        "main", {5}, 1, 6, NULL,
+    },
+    // Folding `x*0` must not drop an operand that fails at run time
+    {"(fn (int) f ((int) a) (* (/ a 0) 0))\n", "f", {5}, 1, 0, "`/` is undefined"},
+    {"(fn (int) f ((int) a) (* 0 (<< a 64)))\n", "f", {5}, 1, 0, "`<<` is undefined"},
+    {"(fn (int) f ((int) a) (* (/ a 2) 0))\n", "f", {5}, 1, 0, NULL},
+    {
+        "(fn (int) d ((int) a (int) b) (+ (* a 0) (/ b b)))\n"
+        "(fn (int) f ((int) a) (d a 0))\n",
+        "f", {5}, 1, 0, "`/` is undefined",
+    },
+    {
+        "(fn (int) sq ((int) x) (* x x))\n"
+        "(fn (int) f ((int) a) (sq (sq a)))\n",
+        "f", {3}, 1, 81, NULL,
+    },
+};
+
+// Runs every self_check_cases entry with inlining on and off, returns non-zero when any of them fails
+int self_check_main() {
+    const size_t count = sizeof(self_check_cases)/sizeof(*self_check_cases);
+    size_t failures = 0;
+    for (size_t i = 0; i < count; i++) {
+        const self_check_case* c = &self_check_cases[i];
+        for (int inline_calls = 0; inline_calls < 2; inline_calls++) {
+            arena scratch = {0};
+            arena* previous = node_arena;
+            node_arena = &scratch;
+            char label[32];
+            snprintf(label, sizeof(label), "case %zu", i);
+
+            eval_program program;
+            const lex_node_fn* fn = NULL;
+            if (eval_load_source(&program, label, strdup(c->source), inline_calls))
+                fn = eval_find(&program, c->fn);
+            eval_state st;
+            eval_init(&st, &program.symbols);
+            long result = 0;
+            const char* error = "it does not load";
+            if (fn != NULL)
+                error = eval_fn(&st, fn, c->args, &result) ? NULL : st.error;
+
+            const bool passed = c->error ? error && strstr(error, c->error) : !error && result == c->result;
+            if (!passed) {
+                failures++;
+                printf("  \x1b[91m%s, '%s' with inlining %s: ", label, c->fn, inline_calls ? "on" : "off");
+                if (error)
+                    printf("failed, %s", error);
+                else
+                    printf("returned %ld", result);
+                if (c->error)
+                    printf(", expected an error with %s\x1b[39m\n", c->error);
+                else
+                    printf(", expected %ld\x1b[39m\n", c->result);
+            }
+            eval_free(&st);
+
+            sym_free(&program.symbols);
+            intern_free(&program.names);
+            tokens_free(&program.tokens);
+            free(program.source);
+            node_arena = previous;
+            arena_free(&scratch);
+        }
+    }
+    printf("self-check: %zu cases, %zu failures\n", count, failures);
+    return failures != 0;
+}
+
+// One digit per iteration, what tokenize() did before num_parse
+static unsigned long num_bench_bytewise(const char* text, size_t* consumed) {
+    unsigned long v = 0;
+    size_t i = 0;
+    while (isnum(text[i]))
+        v = v*10 + (text[i++]-'0');
+    *consumed = i;
+    return v;
+}
+
+// Writes a random literal into `buf`, returns the base strtoul needs for it once prefix and separators are dropped
+static unsigned num_bench_literal(uint64_t* seed, char* buf) {
+    static const char digits[] = "0123456789abcdef";
+    const uint64_t r = eval_bench_random(seed);
+    const unsigned base = (unsigned[]){10, 10, 16, 8, 2}[r % 5];
+    // Up to one digit past what fits so that overflow gets exercised
+    const unsigned max_digits = base == 16 ? 17 : base == 8 ? 23 : base == 2 ? 65 : 21;
+    const unsigned n = 1 + (r >> 8) % max_digits;
+    const bool separators = (r >> 16) % 4 == 0;
+    size_t len = 0;
+    if (base != 10) {
+        buf[len++] = '0';
+        buf[len++] = base == 16 ? 'x' : base == 8 ? 'o' : 'b';
+    }
+    for (unsigned i = 0; i < n; i++) {
+        if (separators && i > 0 && i % 3 == 0)
+            buf[len++] = '_';
+        buf[len++] = digits[eval_bench_random(seed) % base];
+    }
+    // Decimal literals keep a leading digit so that they never look like a prefix
+    if (base == 10 && n > 1 && buf[0] == '0')
+        buf[0] = '1';
+    buf[len] = 0;
+    return base;
+}
+
+// Literals at the edges of what num_parse takes, the malformed ones have to be consumed whole and reported as such
+static const struct { const char* text; bool malformed; } num_bench_edges[] = {
+    {"18446744073709551615", false}, {"18446744073709551616", false},
+    {"0xffffffffffffffff", false}, {"0x10000000000000000", false}, {"0b1_0", false}, {"0", false},
+    {"0x", true}, {"0b", true}, {"_", true}, {"1__2", true}, {"1_", true}, {"0b102", true},
+    {"0x_1", true}, {"0o8", true}, {"12ab", true}, {"0xfg", true},
+};
+
+// Checks num_parse on `buf` against strtoul on it with the prefix and separators dropped, returns what num_parse gave
+// Parsed alone and with source after it as the tokenizer sees it, mismatches are counted and the first few printed
+static num_status num_bench_check(const char* buf, bool malformed, size_t* mismatches) {
+    const size_t len = strlen(buf);
+    const char p = len >= 2 && buf[0] == '0' ? buf[1] | 0x20 : 0;
+    const unsigned base = p == 'x' ? 16 : p == 'o' ? 8 : p == 'b' ? 2 : 10;
+    char plain[128];
+    size_t plain_len = 0;
+    for (const char* c = buf + (base == 10 ? 0 : 2); *c; c++)
+        if (*c != '_')
+            plain[plain_len++] = *c;
+    plain[plain_len] = 0;
+
+    errno = 0;
+    const unsigned long expected = strtoul(plain, NULL, base);
+    const num_status want = malformed ? NUM_MALFORMED : errno == ERANGE ? NUM_OVERFLOW : NUM_OK;
+    char source[160];
+    snprintf(source, sizeof(source), "%s (+ a 1))", buf);
+    num_status status = NUM_OK;
+    for (int followed = 0; followed < 2; followed++) {
+        size_t consumed;
+        unsigned long value;
+        status = num_parse(source, followed ? strlen(source) : len, &consumed, &value);
+        if (consumed != len || status != want || (status == NUM_OK && value != expected)) {
+            if ((*mismatches)++ < 8)
+                printf("  \x1b[91m'%s'%s parsed to %lu with status %d, expected status %d and %lu\x1b[39m\n",
+                    buf, followed ? " with source after it" : "", value, status, want, expected);
+        }
+    }
+    return status;
+}
+
+// Sum of the literals in `text` read with num_parse, the old loop or strtoul
+static unsigned long num_bench_sum(const char* text, size_t text_len, int method) {
+    unsigned long sum = 0;
+    for (size_t i = 0; i < text_len; i++) {
+        size_t consumed;
+        unsigned long value;
+        if (method == 0)
+            num_parse(text+i, text_len-i, &consumed, &value);
+        else if (method == 1)
+            value = num_bench_bytewise(text+i, &consumed);
+        else {
+            char* end;
+            value = strtoul(text+i, &end, 10);
+            consumed = end-(text+i);
+        }
+        sum += value;
+        i += consumed;
+    }
+    return sum;
+}
+
+// Checks num_parse against strtoul on edge cases and random literals of every base, then times it against the old loop and strtoul
+int num_bench_main(size_t count) {
+    if (count == 0)
+        count = NUM_BENCH_LITERALS_DEFAULT;
+
+    char buf[128];
+    size_t mismatches = 0, overflows = 0, edges = 0;
+    for (size_t k = 0; k < sizeof(num_bench_edges)/sizeof(num_bench_edges[0]); k++, edges++)
+        num_bench_check(num_bench_edges[k].text, num_bench_edges[k].malformed, &mismatches);
+    // Every digit count up to one past the 20 that 2^64 needs, all nines and a run counting up from 1
+    for (unsigned n = 1; n <= 21; n++) {
+        memset(buf, '9', n);
+        buf[n] = 0;
+        num_bench_check(buf, false, &mismatches);
+        for (unsigned i = 0; i < n; i++)
+            buf[i] = '0' + (i+1) % 10;
+        num_bench_check(buf, false, &mismatches);
+        edges += 2;
+    }
+
+    uint64_t seed = 0x9e3779b97f4a7c15ull;
+    for (size_t k = 0; k < count; k++) {
+        num_bench_literal(&seed, buf);
+        overflows += num_bench_check(buf, false, &mismatches) == NUM_OVERFLOW;
+    }
+    printf("num-bench: %zu edge and %zu random literals checked against strtoul, %zu overflow, %zu mismatches\n",
+        edges, count, overflows, mismatches);
+
+    // Timing uses decimal literals without separators, the case all three can parse
+    // Short ones are most of what source holds, long ones are where converting 8 digits at a time pays off
+    static const struct { const char* label; unsigned max_digits; } sets[] = {{"1 to 3 digits", 3}, {"1 to 19 digits", 19}};
+    const char* labels[3] = {"num_parse", "bytewise", "strtoul"};
+    char* text = (char*)malloc(count*20+1);
+    bool differ = false;
+    for (size_t s = 0; s < sizeof(sets)/sizeof(sets[0]); s++) {
+        size_t text_len = 0;
+        for (size_t k = 0; k < count; k++) {
+            const uint64_t r = eval_bench_random(&seed);
+            const unsigned l = 1 + r % sets[s].max_digits;
+            for (unsigned d = 0; d < l; d++)
+                text[text_len++] = d == 0 && l > 1 ? '1' + (r >> 8) % 9 : '0' + eval_bench_random(&seed) % 10;
+            text[text_len++] = ' ';
+        }
+        text[text_len] = 0;
+
+        // The methods take turns and the best round of each counts, a single pass is mostly noise
+        unsigned long sums[3] = {0};
+        double times[3] = {0};
+        for (int round = 0; round < NUM_BENCH_ROUNDS; round++)
+            for (int m = 0; m < 3; m++) {
+                const double start = now_seconds();
+                sums[m] = num_bench_sum(text, text_len, m);
+                const double time = now_seconds()-start;
+                if (round == 0 || time < times[m])
+                    times[m] = time;
+            }
+        printf("  %s, best of %d rounds:\n", sets[s].label, NUM_BENCH_ROUNDS);
+        for (int m = 0; m < 3; m++)
+            printf("    %-10s %8.2f ms %8.2f ns/literal %8.1f MB/s%s\n", labels[m], times[m]*1e3, times[m]*1e9/count,
+                text_len/times[m]/1e6, sums[m] != sums[0] ? ", \x1b[91mdifferent results\x1b[39m" : "");
+        differ |= sums[1] != sums[0] || sums[2] != sums[0];
+    }
+    free(text);
+    return mismatches != 0 || differ;
+}
+
+// Appends a random expression over `vars` to `out`, nested up to `depth` operators deep
+static void ra_bench_expr(str_t* out, uint64_t* seed, const char** vars, size_t nvars, unsigned depth) {
+    static const char* ops[] = {"+", "-", "*", "<<", ">>", "==", "<"};
+    const uint64_t r = eval_bench_random(seed);
+    if (depth == 0 || r % 8 == 0) {
+        if ((r >> 8) % 6 == 0)
+            str_printf(out, "%u", (unsigned)(r >> 16) % 100);
+        else
+            str_printf(out, "%s", vars[(r >> 16) % nvars]);
+        return;
+    }
+    str_printf(out, "(%s ", ops[(r >> 8) % (sizeof(ops)/sizeof(*ops))]);
+    ra_bench_expr(out, seed, vars, nvars, depth-1);
+    str_printf(out, " ");
+    ra_bench_expr(out, seed, vars, nvars, depth-1);
+    str_printf(out, ")");
+}
+
+// Source of `fns` fns with 8 params and 8 locals, every one assigned `statements` times from nested expressions
+// Some assignments call an earlier fn so that values have to survive calls, the result sums every local
+static void ra_bench_source(str_t* out, size_t fns, size_t statements) {
+    static const char* vars[] = {"a", "b", "c", "d", "e", "f", "g", "h", "x0", "x1", "x2", "x3", "x4", "x5", "x6", "x7"};
+    const size_t nvars = sizeof(vars)/sizeof(*vars);
+    uint64_t seed = 0x2545f4914f6cdd1dull;
+    for (size_t k = 0; k < fns; k++) {
+        str_printf(out, "(fn (int) f%zu ((int) a (int) b (int) c (int) d (int) e (int) f (int) g (int) h)\n", k);
+        for (size_t v = 8; v < nvars; v++)
+            str_printf(out, "  (def (int) %s) (= %s %s)\n", vars[v], vars[v], vars[v-8]);
+        for (size_t i = 0; i < statements; i++) {
+            const uint64_t r = eval_bench_random(&seed);
+            str_printf(out, "  (= %s ", vars[8 + r % 8]);
+            if (k > 0 && (r >> 8) % 4 == 0) {
+                str_printf(out, "(f%zu", (size_t)(r >> 16) % k);
+                for (int a = 0; a < 8; a++) {
+                    str_printf(out, " ");
+                    ra_bench_expr(out, &seed, vars, nvars, 1);
+                }
+                str_printf(out, ")");
+            }
+            else
+                ra_bench_expr(out, &seed, vars, nvars, 4);
+            str_printf(out, ")\n");
+        }
+        str_printf(out, "  (+ (+ (+ x0 x1) (+ x2 x3)) (+ (+ x4 x5) (+ x6 x7))))\n");
+    }
+}
+
+// Allocates registers for generated expression-heavy fns, compares memory traffic with a stack slot per value
+int ra_bench_main(size_t fns, size_t statements) {
+    if (fns == 0)
+        fns = RA_BENCH_FNS_DEFAULT;
+    if (statements == 0)
+        statements = RA_BENCH_STATEMENTS_DEFAULT;
+
+    arena scratch = {0};
+    arena* previous = node_arena;
+    node_arena = &scratch;
+    str_t source;
+    str_init(&source);
+    ra_bench_source(&source, fns, statements);
+    Tokens tokens;
+    tokens_init(&tokens);
+    tokenize(str_data(&source), &tokens);
+    const lex_result result = lex(&tokens, NULL);
+    if (!result.status) {
+        printf("ra-bench: generated source does not parse: %zu:%zu: %s\n", result.result.error.l+1, result.result.error.c, result.result.error.message);
+        return 1;
+    }
+    intern_table names;
+    intern_init(&names);
+    sym_table symbols;
+    sym_init(&symbols, &names);
+    resolve_ast(&symbols, result.result.node);
+
+    const lex_node_root* root = result.result.node.data;
+    ir_fn* irs = (ir_fn*)calloc(root->children.len, sizeof(ir_fn));
+    size_t lowered = 0, insts = 0;
+    for (size_t i = 0; i < root->children.len; i++) {
+        if (root->children.nodes[i].kind != NODE_FUNCTION)
+            continue;
+        if (ir_lower_fn(root->children.nodes[i].data, &irs[lowered])) {
+            printf("ra-bench: could not lower '%s': %s\n", irs[lowered].name, irs[lowered].error);
+            return 1;
+        }
+        insts += irs[lowered++].insts_len;
+    }
+
+    size_t values = 0, spilled = 0, slots = 0, saved = 0, memory_ops = 0, naive_memory_ops = 0;
+    const double start = now_seconds();
+    for (size_t i = 0; i < lowered; i++) {
+        ra_result ra;
+        ra_allocate(&irs[i], &ra);
+        values += ra.values;
+        spilled += ra.spilled;
+        slots += ra.frame_slots;
+        saved += __builtin_popcount(ra.callee_saved);
+        memory_ops += ra.memory_ops;
+        naive_memory_ops += ra.naive_memory_ops;
+        ra_free(&ra);
+    }
+    const double elapsed = now_seconds()-start;
+
+    printf("ra-bench: %zu fns of %zu assignments, %zu IR instructions, %zu values\n", lowered, statements, insts, values);
+    printf("  %zu values spilled (%.1f%%) to %.1f slots per fn, %.1f callee-saved registers saved per fn\n",
+        spilled, values ? 100.0*spilled/values : 0.0, (double)slots/lowered, (double)saved/lowered);
+    printf("  %-12s %10zu memory ops %8.1f per fn\n", "stack slots", naive_memory_ops, (double)naive_memory_ops/lowered);
+    printf("  %-12s %10zu memory ops %8.1f per fn, %.1fx fewer\n", "linear scan", memory_ops, (double)memory_ops/lowered,
+        memory_ops ? (double)naive_memory_ops/memory_ops : 0.0);
+    printf("  allocated in %.2f ms, %.1f ns per value\n", elapsed*1e3, values ? elapsed*1e9/values : 0.0);
+
+    for (size_t i = 0; i < lowered; i++)
+        ir_free(&irs[i]);
+    free(irs);
+    sym_free(&symbols);
+    intern_free(&names);
+    tokens_free(&tokens);
+    str_free(&source);
+    node_arena = previous;
+    arena_free(&scratch);
+    return 0;
+}
+
+int main(int argc, const char** argv) {
+    const char* program = shift_args(&argc, &argv);
+    
+    if (argc == 0) {
+        printf("Usage: %s [--entry <fn>] [--inline-budget <nodes>] <file.spl>\n", program);
+        printf("       %s --batch [-j <jobs>] <file.spl | @list>...\n", program);
+        printf("       %s --watch <file.spl>...\n", program);
+        printf("       %s --server <socket>\n", program);
+        printf("       %s --client <socket> [--dump] [--stats] [--quit] <file.spl>...\n", program);
+        printf("       %s --client-bench <socket> <file.spl> [requests]\n", program);
+        printf("       %s --eval-bench <file.spl> <fn> [rows]\n", program);
+        printf("       %s --num-bench [literals]\n", program);
+        printf("       %s --self-check\n", program);
+        printf("       %s --ra-bench [fns] [assignments]\n", program);
+        printf("       %s --run [--profile <stacks>] <file.spl> <fn> [args... | @rows]\n", program);
+        return 1;
+    }
+
+    type_table_init(&global_types);
+    literal_pool_init(&global_literals);
+    module_cache_init(&global_modules);
+
+    if (!strcmp(argv[0], "--batch")) {
+        shift_args(&argc, &argv);
+        return batch_main(argc, argv);
+    }
+
+    if (!strcmp(argv[0], "--watch") && argc >= 2)
+        return watch_main(argc-1, argv+1);
+
+    if (!strcmp(argv[0], "--server") && argc >= 2)
+        return server_main(argv[1]);
+
+    if (!strcmp(argv[0], "--client") && argc >= 2)
+        return client_main(argv[1], argc-2, argv+2);
+
+    if (!strcmp(argv[0], "--client-bench") && argc >= 3)
+        return client_bench_main(argv[1], argv[2], argc >= 4 ? strtoul(argv[3], NULL, 10) : 100);
+
+    if (!strcmp(argv[0], "--run")) {
+        shift_args(&argc, &argv);
+        return run_main(argc, argv);
+    }
+
+    if (!strcmp(argv[0], "--self-check"))
+        return self_check_main();
+
+    if (!strcmp(argv[0], "--num-bench"))
+        return num_bench_main(argc >= 2 ? strtoul(argv[1], NULL, 10) : 0);
+
+    if (!strcmp(argv[0], "--ra-bench"))
+        return ra_bench_main(argc >= 2 ? strtoul(argv[1], NULL, 10) : 0, argc >= 3 ? strtoul(argv[2], NULL, 10) : 0);
+
+    if (!strcmp(argv[0], "--eval-bench") && argc >= 3)
+        return eval_bench_main(argv[1], argv[2], argc >= 4 ? strtoul(argv[3], NULL, 10) : 0);
+
+    const char* entry = PRUNE_ENTRY_DEFAULT;
+    size_t inline_budget = INLINE_BUDGET_DEFAULT;
+    for (;;) {
+        if (!strcmp(argv[0], "--entry") && argc >= 3)
+            entry = argv[1];
+        else if (!strcmp(argv[0], "--inline-budget") && argc >= 3)
+            inline_budget = strtoul(argv[1], NULL, 10);
+        else
+            break;
+        shift_args(&argc, &argv);
+        shift_args(&argc, &argv);
+    }
+
+    const char* source_path = shift_args(&argc, &argv);
+    
+    FILE* f = fopen(source_path, "rt");
+    if (f == NULL) {
+        printf("Could not open %s: %s\n", source_path, strerror(errno));
+        return 1;
+    }
+
+    TRY( fseek(f, 0, SEEK_END) );
+    size_t source_len = ftell(f);
+    if (!source_len) {
+        printf("An empty program was provided\n");
+        printf(
+            "Try a simple one:\n"
+            "\x1b[90m|\x1b[39m(\x1b[91mfn\x1b[39m \x1b[96mmain\x1b[39m()\n"
+            "\x1b[90m|\x1b[39m  (\x1b[96mprintf\x1b[39m \x1b[92m\"Hello, world!\x1b[1m\\n\x1b[22m\"\x1b[39m)\n"
+            "\x1b[90m|\x1b[39m  (\x1b[91mreturn\x1b[39m \x1b[35m0\x1b[39m)\n"
+            "\x1b[90m|\x1b[39m)\n"
+        );
+        return 0;
+    }
+    TRY( fseek(f, 0, SEEK_SET) );
+    char* source = (char*)malloc(source_len+1);
+    TRY( !fread(source, source_len, 1, f), "Failed to read: " );
+    source[source_len] = 0;
+    TRY( fclose(f), "Failed to close: " );
+
+    Tokens tokens;
+    tokens_init(&tokens);
+    tokenize(source, &tokens);
+
+    printf("showing %zu tokens:\n", tokens.len);
+    for (size_t i = 0; i < tokens.len; i++) {
+        Token tk = tokens.tokens[i];
+        printf("  %02zu \x1b[92m%s\x1b[39m [%02x %s]\n", i, tk.t, tk.k, token_kind_str(tk.k));
+        if (tk.k == TK_STRING) {
+            size_t len;
+            const char* str = literal_copy(&global_literals, (uint32_t)(uintptr_t)tk.d, &len);
+            for (size_t j = 0; j < len; j++)
+                printf("    %02zu %02x\n", j, str[j]);
+        }
+        if (tk.k == TK_NUMBER && tk.d) {
+            long num = *(long*)tk.d;
+            printf("    %zu\n", num);
         }
-        if (tk.k == TK_NUMBER) {
-            long num = *(long*)tk.d;
-            printf("    %zu\n", num);
-        }
     }
     printf("end\n");
 
-    lex_result result = lex(&tokens);
+    diagnostics syntax_errors;
+    diagnostics_init(&syntax_errors);
+    lex_result result = lex(&tokens, &syntax_errors);
     
     if (result.status == 0) {
-        printf("Syntax error:\n  %s\n", result.result.error.message);
+        printf("%zu syntax errors:\n", syntax_errors.len);
+        for (size_t i = 0; i < syntax_errors.len; i++)
+            printf("  \x1b[91m%zu:%zu: %s\x1b[39m\n", syntax_errors.items[i].l+1, syntax_errors.items[i].c, syntax_errors.items[i].message);
+        diagnostics_free(&syntax_errors);
         return 1;
     }
+    diagnostics_free(&syntax_errors);
+
+    thread_pool pool;
+    pool_init(&pool, 0);
+
+    lex_node_root* root = result.result.node.data;
+    const size_t failed = module_load_imports(result.result.node, source_path, &pool);
+    if (global_modules.imports)
+        printf("imported %zu modules, %zu parsed, %zu from the interface cache, %zu failed\n",
+            (size_t)global_modules.imports, (size_t)global_modules.parsed, (size_t)global_modules.from_disk, failed);
+    for (size_t i = 0; failed && i < root->children.len; i++) {
+        const lex_node_import* import = root->children.nodes[i].data;
+        if (root->children.nodes[i].kind == NODE_IMPORT && !import->module)
+            printf("  \x1b[91m%zu:%zu: Could not import '%s': %s\x1b[39m\n", import->l+1, import->c, import->path, module_error(import));
+    }
+
+    printf("%u distinct types\n", global_types.len);
+    if (global_literals.refs)
+        printf("pooled %zu string literals as %u distinct, %zu bytes\n", (size_t)global_literals.refs, global_literals.len, global_literals.data_len);
+
+    intern_table names;
+    intern_init(&names);
+
+    sym_table symbols;
+    sym_init(&symbols, &names);
+    const size_t unresolved = resolve_ast(&symbols, result.result.node);
+    printf("resolved %u bindings, %zu unresolved names\n", symbols.len, unresolved);
+    for (size_t i = 0; i < unresolved; i++)
+        printf("  \x1b[91mUndefined name '%s'\x1b[39m\n", symbols.unresolved[i]->name);
+
+    diagnostics type_errors;
+    diagnostics_init(&type_errors);
+    printf("type checked with %u workers, %zu errors\n", pool_workers(&pool), check_ast(result.result.node, &symbols, &pool, &type_errors));
+    for (size_t i = 0; i < type_errors.len; i++)
+        printf("  \x1b[91m%zu:%zu: %s\x1b[39m\n", type_errors.items[i].l+1, type_errors.items[i].c, type_errors.items[i].message);
+    diagnostics_free(&type_errors);
+
+    inline_stats inlined = {0};
+    inline_ast(result.result.node, &symbols, inline_budget, &inlined);
+    printf("inlined %zu calls, %+ld nodes, %zu recursive and %zu over the budget of %zu left alone\n",
+        inlined.calls, inlined.growth, inlined.recursive, inlined.over, inline_budget);
+
+    prune_stats pruned = {0};
+    if (prune_ast(result.result.node, &symbols, entry, &pruned))
+        printf("pruned %zu fns and %zu defs unreachable from '%s', %zu nodes, %zu bytes\n", pruned.fns, pruned.defs, entry, pruned.nodes, pruned.bytes);
+    else
+        printf("no fn '%s' to prune from\n", entry);
+
+    printf("folded %zu nodes\n", fold_ast(result.result.node));
+    printf("shared %zu common subexpression nodes\n", cse_ast(result.result.node, &names));
 
     printf("showing AST:\n");
     debug_ast(result.result.node, 2);
     printf("end\n");
 
+    printf("showing IR:\n");
+    for (size_t i = 0; i < root->children.len; i++) {
+        if (root->children.nodes[i].kind != NODE_FUNCTION)
+            continue;
+        ir_fn ir;
+        if (ir_lower_fn(root->children.nodes[i].data, &ir))
+            printf("  \x1b[91mCould not lower '%s': %s\x1b[39m\n", ir.name, ir.error);
+        else {
+            ir_dump(stdout, &ir);
+            ra_result ra;
+            ra_allocate(&ir, &ra);
+            ra_dump(stdout, &ir, &ra);
+            ra_free(&ra);
+        }
+        ir_free(&ir);
+    }
+    printf("end\n");
+
+    pool_free(&pool);
     return 0;
 }
@@ -2,4 +2,4 @@
 
 set -xe
 
-clang -Wall -Wextra -o simple simple.c
+clang -Wall -Wextra -pthread -o simple simple.c